@@ -1,43 +1,777 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <sys/socket.h>
-#include <string.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/prctl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+#include <zlib.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+#include <ctype.h>
 
 #define BUFFER_SIZE 1024
-#define TAG_SIZE 6
+#define READ_BUFFER_SIZE 16384
+#define LINE_INITIAL_SIZE 256
+#define STREAM_CHUNK_SIZE 65536
+#define TAG_SIZE 12
 #define MSG_NUM_STR_SIZE 10
 #define FOLDER_SIZE 512
 #define DEFAULT_FOLDER "INBOX"
 #define RETRIEVE_COMMAND "retrieve"
+#define ATTACHMENTS_COMMAND "attachments"
 #define CONNECT_RESPONSE "* OK "
-#define LOGIN_RESPONSE "%s OK "
-#define SELECT_RESPONSE "%s OK "
+#define RESPONSE_OK 0
+#define RESPONSE_NO 1
+#define RESPONSE_BAD 2
+#define RESPONSE_PENDING -1
+#define LITERAL_TOO_LARGE -2
+#define MAX_PENDING 64
+#define RETRIEVE_BATCH_SIZE 64
+#define MAX_WORK_CHUNK_SIZE 64
+#define CHUNKS_PER_WORKER 8
+#define WORKER_PIPELINE_DEPTH 4
+#define MAX_JOBS 32
+#define DEFAULT_MESSAGE_SET "1"
+#define MBOX_FROM "From "
+#define LIST_CACHE_VERSION "FETCHMAIL-LIST 1"
+#define LIST_CACHE_ITEMS "UID BODY.PEEK[HEADER.FIELDS (SUBJECT FROM DATE)]"
+#define LIST_CACHE_ITEM "BODY[HEADER.FIELDS (SUBJECT FROM DATE)]"
+#define STORE_MAGIC "FMSTORE1"
+#define MIME_LINE_SIZE 1024
+#define MIME_FIELD_SIZE 256
+#define MIME_HEADER_MAX_SIZE 1048576
+#define MIME_MAX_DEPTH 32
+#define MIME_STATE_HEADER 0
+#define MIME_STATE_PREAMBLE 1
+#define MIME_STATE_BODY 2
+#define MIME_STATE_EPILOGUE 3
+#define MIME_STATE_DONE 4
+#define TRANSFER_IDENTITY 0
+#define TRANSFER_QUOTED_PRINTABLE 1
+#define TRANSFER_BASE64 2
+#define DECODE_BUFFER_SIZE 16384
+#define QP_ESCAPE_SIZE 80
+#define ARENA_BLOCK_SIZE 65536
+#define ARENA_ALIGNMENT 16
+#define ALLOC_STATS_VARIABLE "FETCHMAIL_ALLOC_STATS"
+#define COMPRESS_STATS_VARIABLE "FETCHMAIL_COMPRESS_STATS"
+#define MIME_STATS_VARIABLE "FETCHMAIL_MIME_STATS"
+#define MIME_STRUCTURE_ITEMS "(RFC822.SIZE BODYSTRUCTURE BODY.PEEK[HEADER.FIELDS (MIME-VERSION)])"
+#define MIME_STRUCTURE_ITEM "BODY[HEADER.FIELDS (MIME-VERSION)]"
+#define MIME_SECTION_SIZE 128
+#define COMPRESS_BUFFER_SIZE 16384
+#define CHARSET_UNKNOWN -1
+#define CHARSET_UTF8 0
+#define CHARSET_LATIN1 1
+#define CHARSET_CP1252 2
+#define CHARSET_UTF16 3
+#define CHARSET_UTF16BE 4
+#define CHARSET_UTF16LE 5
+#define REPLACEMENT_CHARACTER 0xfffd
+#define TLS_SESSION_DIR ".fetchmail"
+#define TLS_SESSION_EXTENSION ".tls"
+#define TLS_SESSION_MAX_SIZE 16384
+#define CONNECT_ATTEMPT_DELAY_MS 250
+#define DEFAULT_CONNECT_TIMEOUT_MS 30000
+#define MAX_CONNECT_ATTEMPTS 16
+#define DAEMON_COMMAND "daemon"
+#define DAEMON_REQUEST_SIZE 8192
+#define DAEMON_MAX_ARGS 64
+#define DAEMON_BUSY -1
+#define MAX_POOLED_SESSIONS 32
+#define KEEPALIVE_INTERVAL_MS 300000
+#define DAEMON_REPLY_TIMEOUT_MS 600000
+#define POLL_COMMAND "poll"
+#define DEFAULT_SERVER_LIMIT 8
+#define POLL_MAX_EVENTS 256
+#define POLL_TICK_MS 1000
+#define RECEIVE_AGAIN -2
+#define SEND_AGAIN -2
+#define ACCOUNT_WAITING 0
+#define ACCOUNT_CONNECTING 1
+#define ACCOUNT_HANDSHAKE 2
+#define ACCOUNT_GREETING 3
+#define ACCOUNT_LOGIN 4
+#define ACCOUNT_SELECT 5
+#define ACCOUNT_FETCH 6
+#define ACCOUNT_DONE 7
+#define IDLE_COMMAND "idle"
+#define IDLE_RESTART_MS 1740000
+#define IDLE_BACKOFF_MIN_MS 1000
+#define IDLE_BACKOFF_MAX_MS 300000
+#define SEARCH_DATE_SIZE 16
+#define LIST_BATCH_SIZE 256
+#define LIST_PIPELINE_DEPTH 8
+#define OPTION_SINCE 256
+#define OPTION_FROM 257
+#define OPTION_SUBJECT 258
+#define OPTION_UNSEEN 259
+#define OPTION_LARGER 260
+#define OPTION_LIMIT 261
+#define OPTION_OFFSET 262
+#define OPTION_CHUNK_SIZE 263
+#define OPTION_HEAD_BYTES 264
+#define RESUME_JOURNAL_NAME ".fetchmail-resume"
+#define PARTIAL_EXTENSION ".part"
+#define PARTIAL_ITEM_SIZE 40
+#define INDEX_COMMAND "index"
+#define SEARCH_COMMAND "search"
+#define TEXT_INDEX_MAGIC "FMTEXT01"
+#define TEXT_INDEX_EXTENSION ".fts"
+#define TEXT_INDEX_TEMP_EXTENSION ".fts-new"
+#define INDEX_TABLE_SIZE 4096
+#define TERM_MAX_SIZE 64
+#define PHRASE_MAX_TOKENS 32
+
+// Struct for buffered reading of the server responses
+typedef struct {
+    char buffer[READ_BUFFER_SIZE];
+    int start;                      // Next unread byte in the buffer
+    int end;                        // End of the received bytes in the buffer
+    char* line;                     // Current response line without the \r\n
+    int line_size;                  // Allocated size of the line
+    int literal_remaining;          // Bytes of the announced literal not consumed yet
+    int literal_announced;          // Whether the current line ended with a literal
+    int continued;                  // Whether the current line follows a literal of the same response
+} reader_t;
+
+typedef struct client client_t;
+
+// Struct for the transport carrying the bytes of a connection, plain TCP or TLS
+typedef struct {
+    int (*receive)(client_t* client, char* buffer, int len);    // Returning the bytes received, 0 at the end or -1
+    int (*send)(client_t* client, char* buffer, int len);       // Returning the bytes sent or -1
+    void (*close)(client_t* client);
+    int raw_socket;                 // Whether the socket carries the plain bytes, so splice may move them
+} transport_t;
 
-// Struct for client
+// Struct for the DEFLATE layer of a connection after COMPRESS, RFC 4978
+typedef struct {
+    const transport_t* carrier;     // Transport the compressed bytes travel over
+    z_stream inflater;
+    z_stream deflater;
+    unsigned char input[COMPRESS_BUFFER_SIZE];      // Compressed bytes received and not inflated yet
+    unsigned char output[COMPRESS_BUFFER_SIZE];     // Compressed bytes of the send being made
+    unsigned long long wire_received;
+    unsigned long long decoded_received;
+    unsigned long long wire_sent;
+    unsigned long long encoded_sent;                // Bytes handed to send before compression
+} compress_t;
+
+// Struct for a string that points into a buffer owned by someone else, it is not NUL terminated
+typedef struct {
+    char* data;                     // NULL if the string is missing
+    int len;
+} view_t;
+
+// Struct for one block of an arena
+typedef struct arena_block arena_block_t;
+struct arena_block {
+    arena_block_t* next;            // Block filled before this one
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+// Struct for memory handed out in pieces and given back all at once
+typedef struct {
+    arena_block_t* block;           // Block being handed out, NULL until the first allocation
+    size_t total;                   // Size of all of the blocks
+} arena_t;
+
+// Handler for the literal of a fetched item, called while the literal is unread
+typedef void (*literal_handler_t)(client_t* client, int message_num, int literal_size, void* context);
+
+// Handler for each line of an untagged FETCH response
+typedef void (*fetch_handler_t)(client_t* client, int message_num, char* line, void* context);
+
+// Handler for the tagged response that completes a command
+typedef void (*completion_handler_t)(client_t* client, int status, void* context);
+
+// Handler for each number of an untagged SEARCH response
+typedef void (*search_handler_t)(client_t* client, long number, void* context);
+
+// Struct for a command waiting for its tagged response
+typedef struct {
+    int tag_num;                    // Number in the tag, the slot is tag_num % MAX_PENDING
+    int status;                     // RESPONSE_PENDING until the tagged response arrives
+    int first_message;              // Range of messages whose untagged FETCH belongs to the command
+    int last_message;
+    char* item;                     // FETCH item whose literals go to the literal handler
+    literal_handler_t literal_handler;
+    fetch_handler_t fetch_handler;
+    completion_handler_t completion_handler;
+    search_handler_t search_handler;
+    void* context;
+    int handled;                    // Number of literals passed to the literal handler
+} pending_t;
+
+// Struct for the envelope fields of a message kept in the list cache
+typedef struct {
+    int uid;
+    char* subject;                  // Unfolded field values, NULL if the field is missing
+    char* from;
+    char* date;
+} cache_entry_t;
+
+// Struct for the list cache of one folder, the entries are sorted by UID
+typedef struct {
+    char path[PATH_MAX];
+    unsigned long uid_validity;
+    unsigned long uid_next;         // Every message below it is in the cache
+    unsigned long long highest_modseq;
+    cache_entry_t* entries;
+    int count;
+    int size;
+    int changed;                    // Whether the file has to be written again
+    arena_t strings;                // Fields of the entries, given back only when the cache is cleared
+} list_cache_t;
+
+// Struct for the filters and paging of the list command, turned into a SEARCH on the server
 typedef struct {
+    char since[SEARCH_DATE_SIZE];   // IMAP date the messages are from, empty if not filtered
+    char* from;                     // Text the From field must contain, or NULL
+    char* subject;                  // Text the Subject field must contain, or NULL
+    int unseen;
+    long larger;                    // Size in bytes the messages must exceed, or -1
+    int limit;                      // Matches listed at most, or -1 for all of them
+    int offset;                     // Matches skipped before listing
+} list_filter_t;
+
+// Struct for client
+struct client {
     char *username;
     char *password;
     char *folder;
-    int message_num;
+    char *message_set;
+    char *output_dir;
+    char *cache_dir;
+    char *socket_path;              // UNIX socket of the daemon, or NULL
+    char *accounts_path;            // Accounts file of the poll command, or NULL
+    int jobs;
+    int server_limit;               // Connections the poll command opens to one server at once
+    int connect_timeout;            // Milliseconds allowed for all of the connection attempts together
     int use_tls;
+    int use_compress;               // Whether to start COMPRESS=DEFLATE when the server offers it
+    int decode;
+    list_filter_t filter;           // Filters of the list command
+    long chunk_size;                // Bytes per partial FETCH of retrieve, or 0 to fetch whole messages
+    long head_bytes;                // Bytes of each message retrieve stops at, or 0 for all of them
+    char *query;                    // Query of the search command, or NULL
     char *command;
     char *server_name;
     int connfd;
+    const transport_t* transport;   // Plain until TLS is started on the connection
+    SSL* tls;                       // TLS state of the connection, or NULL
+    compress_t* compress;           // DEFLATE state once COMPRESS is active, or NULL
     int tag_counter;
-} client_t;
+    reader_t reader;
+    pending_t pending[MAX_PENDING];
+    int pending_count;
+    int exists;                     // Message count from the last EXISTS response, or -1
+    unsigned long uid_validity;     // Response codes of the SELECT, 0 if the server did not send them
+    unsigned long uid_next;
+    unsigned long long highest_modseq;
+    char *capabilities;             // Capabilities from the last CAPABILITY response, or NULL
+    char *select_options;           // Parameters added to the SELECT command, or NULL
+    list_cache_t *list_cache;       // Cache kept up to date by VANISHED responses, or NULL
+    int continued;                  // Whether a continuation request came since the flag was cleared, for IDLE or a literal
+    arena_t arena;                  // Scratch memory of the command being handled
+};
+
+// Struct for a range of message numbers
+typedef struct {
+    int first;
+    int last;
+} range_t;
+
+// Struct for the messages of a multi-message retrieve
+typedef struct {
+    char* output_dir;               // Directory for one file per message, or NULL for an mbox stream
+    int written;
+} retrieve_t;
+
+// Struct for the chunks of work owned by one worker, the owner takes from the head and thieves from the tail
+typedef struct {
+    pthread_mutex_t lock;
+    int head;
+    int tail;
+} work_queue_t;
+
+// Struct for a parallel retrieve shared by the workers
+typedef struct {
+    client_t* client;               // Main session holding the connection settings
+    int* uids;                      // UIDs of the messages in sequence order
+    int message_count;
+    int chunk_size;                 // Messages per chunk, small enough for every worker to get several
+    work_queue_t* queues;
+    int worker_count;
+    pthread_mutex_t written_lock;
+    int written;
+} scheduler_t;
+
+// Struct for a worker thread with its own session
+typedef struct {
+    scheduler_t* scheduler;
+    int index;
+    pthread_t thread;
+} worker_t;
+
+// Struct for a session the daemon keeps open in a process of its own
+typedef struct {
+    pid_t pid;
+    int channel;                    // Daemon end of the socket pair to the process
+    char* key;                      // Server, account and folder the session was opened for
+    int request_fd;                 // Connection of the client being served, or -1 while idle
+} pooled_session_t;
+
+// Struct for a server of the accounts file
+typedef struct {
+    char* name;
+    struct addrinfo* addresses;     // Resolved once for all of its accounts, NULL if that failed
+    int active;                     // Accounts with a connection right now
+    int first_waiting;              // Queue of the accounts not started yet, -1 when it is empty
+    int last_waiting;
+} server_t;
+
+// Struct for an account of the accounts file, driven one step at a time by the event loop
+typedef struct {
+    char* username;
+    char* password;
+    char* folder;
+    int server;                     // Index of its server
+    int next_waiting;               // Account after it in the queue of the server, or -1
+    int state;                      // ACCOUNT_* step the session is at
+    unsigned int events;            // Events being watched on the connection, 0 before it is added
+    client_t* client;               // Session while the account is active, NULL otherwise
+    struct addrinfo* address;       // Address being connected to
+    long long deadline;             // Time the server has to answer by
+    char* output;                   // Commands the socket did not take yet, NULL when everything is sent
+    int output_len;
+    int output_sent;
+} account_t;
+
+// Struct for polling every account of the accounts file from one event loop
+typedef struct {
+    client_t* settings;             // Options from the command line
+    int epoll_fd;
+    char* file_data;                // Accounts file, the fields of the accounts point into it
+    account_t* accounts;
+    int account_count;
+    server_t* servers;
+    int server_count;
+    int finished;
+    int status;                     // Highest exit code of the accounts
+} poll_engine_t;
+
+// Struct for what an idle session leaves to the one after it, shared with the session processes
+typedef struct {
+    unsigned long uid_validity;     // UIDVALIDITY the next UID belongs to
+    unsigned long next_uid;         // First UID not printed yet, 0 before the first session
+    int idled;                      // Whether the last session got as far as idling
+} idle_state_t;
+
+// Struct for a message retrieved in partial FETCH windows
+typedef struct {
+    int message_num;
+    long uid;
+    long size;                      // RFC822.SIZE, the windows stop there
+} partial_message_t;
+
+// Struct for the messages of a partial retrieve
+typedef struct {
+    partial_message_t* messages;
+    int count;
+    int size;
+} partial_list_t;
+
+// Struct for a partial FETCH window in flight
+typedef struct {
+    int tag_num;
+    char item[PARTIAL_ITEM_SIZE];   // Name the server gives the window, such as BODY[]<4096>
+    FILE* output;
+    long expected;                  // Bytes asked for
+    long received;                  // Bytes written so far
+} partial_window_t;
+
+// Struct for the committed size of a partial file
+typedef struct {
+    long uid;
+    long offset;
+} journal_record_t;
+
+// Struct for the resume journal of an output directory, records are appended as windows are written
+typedef struct {
+    char path[PATH_MAX];
+    FILE* file;
+    unsigned long uid_validity;     // Records of another UIDVALIDITY are dropped when it is opened
+    journal_record_t* records;
+    int count;
+    int size;
+} resume_journal_t;
+
+// Struct for quoting the From lines of a message in an mbox stream
+typedef struct {
+    int line_start;                 // Whether the next byte starts a line
+    int quote_count;                // Number of '>' seen at the start of the line
+    int from_matched;               // Number of "From " characters matched after them
+} mbox_state_t;
+
+// Struct for a literal read into memory
+typedef struct {
+    char* data;
+    int size;
+} literal_t;
+
+// Struct for a node of the MIME part tree
+typedef struct mime_part mime_part_t;
+struct mime_part {
+    char media_type[MIME_FIELD_SIZE];   // Lower case type and subtype such as text/plain
+    char charset[MIME_FIELD_SIZE];
+    char encoding[MIME_FIELD_SIZE];     // Content-Transfer-Encoding, 7bit if missing
+    char boundary[MIME_FIELD_SIZE];     // Boundary parameter of a multipart, empty otherwise
+    char filename[MIME_FIELD_SIZE];     // File name from Content-Disposition, or the name of the Content-Type
+    int attachment;                     // Whether Content-Disposition says attachment
+    int depth;
+    mime_part_t* parent;
+    mime_part_t* first_child;
+    mime_part_t* last_child;
+    mime_part_t* next;
+};
+
+// Struct for the streaming MIME parser, the message is fed in pieces of any size
+typedef struct {
+    int state;
+    mime_part_t* root;
+    mime_part_t* current;           // Part whose header or body is being read
+    mime_part_t* container;         // Innermost open multipart, its boundary ends the current part
+    mime_part_t* selected;          // First UTF-8 text/plain part, NULL until it is found
+    char* header;                   // Header block of the current part
+    int header_len;
+    int header_size;
+    char line[MIME_LINE_SIZE];      // Body line so far, long enough to recognise any delimiter
+    int line_len;
+    int long_line;                  // Whether the line outgrew the buffer and is passed on as it arrives
+    int held_cr;                    // Whether a \r ended the last piece of a long line
+    char held_end[2];               // Line ending held back until the next line shows it is not a delimiter
+    int held_end_len;
+    arena_t* arena;                 // Memory of the part tree
+    int decode;                     // Whether the transfer encoding of the selected part is undone
+    int transfer_encoding;          // TRANSFER_BASE64 or TRANSFER_QUOTED_PRINTABLE when decoding the selected part
+    char decode_buffer[DECODE_BUFFER_SIZE];  // Unfinished =XX escape, or base64 characters not decoded yet
+    int decode_len;
+    int decode_finished;            // Whether base64 padding has ended the data
+    FILE* output;
+    char* attachment_dir;           // Directory every attachment is written to, NULL to print the selected part
+    char attachment_path[PATH_MAX]; // File of the attachment being written
+    int attachment_count;           // Attachments opened so far, numbering the ones without a name
+    char** attachment_names;        // Names written for this message
+    int attachment_names_size;
+} mime_parser_t;
+
+// Struct for a file name put together from the parameters of a MIME field
+typedef struct {
+    char value[MIME_FIELD_SIZE];
+    int extended;                   // Whether it came from RFC 2231 parameters, which win over a plain one
+} mime_filename_t;
+
+// Struct for what the server says about a message before mime fetches one part of it
+typedef struct {
+    char* structure;                // BODYSTRUCTURE from its opening parenthesis, NULL if the server sent none
+    literal_t version;              // MIME-Version header field
+    long size;                      // RFC822.SIZE, the bytes a full fetch would take
+    long fetched;                   // Bytes of the responses so far
+    mime_parser_t* parser;          // Parser the selected part is written through
+} mime_structure_t;
+
+// Visitor of the single parts of a BODYSTRUCTURE, returning 1 to stop the walk at the part
+typedef int (*structure_visitor_t)(mime_part_t* part, char* section, void* context);
+
+// Struct for an attachment fetched by section
+typedef struct {
+    char section[MIME_SECTION_SIZE];
+    char item[MIME_SECTION_SIZE + 8];   // Name the server gives the section, such as BODY[2]
+    mime_part_t* part;
+    mime_parser_t* parser;
+    int tag_num;
+} structure_attachment_t;
+
+// Struct for the attachments found in a BODYSTRUCTURE
+typedef struct {
+    structure_attachment_t* attachments;
+    int count;
+    int size;
+    mime_parser_t* parser;
+} attachment_list_t;
+
+// Base64 kernel decoding whole blocks until one holds a byte outside the alphabet, returning the bytes written
+typedef int (*base64_kernel_t)(unsigned char* input, int input_len, unsigned char* output, int* input_used);
+
+// Struct for the start of the message store index
+typedef struct {
+    char magic[8];
+    uint64_t uid_validity;
+} store_header_t;
+
+// Struct for one message of the store, records are only ever appended
+typedef struct {
+    uint32_t uid;
+    uint32_t reserved;
+    uint64_t offset;                // Position of the message in the segment file
+    uint64_t length;                // Length without the NUL written after the message
+} store_record_t;
+
+// Struct for the append-only message store of a folder and its read-only mappings
+typedef struct {
+    int index_fd;
+    int segment_fd;
+    char* index_map;
+    size_t index_size;
+    char* segment_map;
+    size_t segment_size;
+    long fetch_uid;                 // UID of the message being appended
+} message_store_t;
+
+// Struct for matching the UID and the header of each FETCH response for the list cache
+typedef struct {
+    list_cache_t* cache;
+    arena_t* arena;                 // Memory of the header until its UID arrives
+    unsigned long first_uid;        // UIDs below it are cached already
+    int message_num;
+    int uid;
+    char* header;
+} cache_fetch_t;
+
+// Struct for the numbers of a SEARCH response
+typedef struct {
+    int* numbers;
+    int count;
+    int size;
+} number_list_t;
+
+// Struct for the messages an update of the text index fetches, by sequence number and UID
+typedef struct {
+    number_list_t message_nums;
+    number_list_t uids;             // UIDs after last_uid, in increasing order
+    uint32_t last_uid;              // Highest UID the index holds already
+    message_store_t* store;
+} index_fetch_t;
+
+// Struct for bytes that grow as they are appended
+typedef struct {
+    unsigned char* data;
+    int len;
+    int size;
+} byte_buffer_t;
+
+// Struct for the start of the text index of a folder
+typedef struct {
+    char magic[8];
+    uint64_t uid_validity;
+    uint32_t last_uid;              // Highest UID looked at, the next update starts after it
+    uint32_t document_count;
+    uint32_t term_count;
+    uint32_t reserved;
+    uint64_t documents_offset;      // Document records sorted by UID
+    uint64_t terms_offset;          // Term records sorted by term
+    uint64_t strings_offset;        // Subjects and terms the records point into
+    uint64_t strings_size;
+} text_index_header_t;
+
+// Struct for an indexed message, which keeps its subject so search needs nothing else
+typedef struct {
+    uint32_t uid;
+    int32_t subject_len;            // -1 if the message has no Subject field
+    uint64_t subject_offset;
+} text_index_document_t;
+
+// Struct for a term of the text index and its postings, which hold for each message the UID delta, the position count and the position deltas as varints
+typedef struct {
+    uint64_t postings_offset;
+    uint32_t postings_len;
+    uint32_t document_count;
+    uint32_t last_uid;              // UID the postings of the next update are a delta from
+    uint32_t term_len;
+    uint64_t term_offset;
+} text_index_term_t;
+
+// Struct for the mapped text index of a folder
+typedef struct {
+    int fd;
+    unsigned char* map;
+    size_t size;                    // 0 if the folder has no index yet
+    text_index_header_t* header;
+    text_index_document_t* documents;
+    text_index_term_t* terms;
+    char* strings;
+} text_index_t;
+
+// Struct for a term added by this update
+typedef struct {
+    char* term;
+    int term_len;
+    uint32_t hash;
+    byte_buffer_t postings;         // Postings of the new messages, the first UID is a delta from 0
+    uint32_t last_uid;
+    uint32_t document_count;
+    int* positions;                 // Positions in the current message
+    int position_count;
+    int position_size;
+} index_term_t;
+
+// Struct for the postings of the messages added by an update, kept in a hash table of the terms
+typedef struct {
+    index_term_t** table;           // Open addressing, the size is a power of two
+    int table_size;
+    int term_count;
+    index_term_t** touched;         // Terms of the current message
+    int touched_count;
+    int touched_size;
+    int position;                   // Next position in the current message
+    text_index_document_t* documents;
+    int document_count;
+    int document_size;
+    byte_buffer_t subjects;
+    arena_t terms;                  // Memory of the terms and their entries
+} index_builder_t;
+
+// Struct for reading the postings of a term one message at a time
+typedef struct {
+    unsigned char* current;
+    unsigned char* end;
+    uint32_t uid;                   // 0 once the postings are used up
+    uint32_t position_count;
+    unsigned char* positions;       // Position deltas of the current message
+} postings_cursor_t;
+
+// Struct for the query of the search command being parsed
+typedef struct {
+    char* current;
+    text_index_t* index;
+} query_t;
 
 // Initializing a client
 client_t* init_client();
 
+// Allocating memory, counting the allocation and exiting on failure
+void* allocate(size_t size);
+
+// Resizing allocated memory, counting the allocation and exiting on failure
+void* reallocate(void* memory, size_t size);
+
+// Counting heap allocations, returning the total so far
+unsigned long count_allocations(int allocations);
+
+// Printing the allocation count when the program exits
+void print_allocation_stats();
+
+// Initializing an arena, with a first block of the size if it is not 0
+void init_arena(arena_t* arena, size_t size);
+
+// Taking memory from the arena, it stays valid until the arena is reset
+void* arena_alloc(arena_t* arena, size_t size);
+
+// Giving back everything taken from the arena, merging its blocks so the next use fits in one
+void reset_arena(arena_t* arena);
+
+// Freeing the blocks of the arena
+void free_arena(arena_t* arena);
+
 // Parsing the command line argument
 void parse_command_line(int argc, char* argv[], client_t* client);
 
-// Connecting with the server either IPv6 or IPv4
+// Running the command of the client on the selected folder
+void run_command(client_t* client);
+
+// Connecting with the server, racing its IPv6 and IPv4 addresses
 void connect_server(client_t* client);
 
+// Ordering the addresses so the families take turns, starting with the preferred one, returning the count
+int interleave_addresses(struct addrinfo* list, struct addrinfo** ordered, int max_count);
+
+// Starting a non-blocking connect to the address, returning the socket or -1
+int start_connect(struct addrinfo* address);
+
+// Returning the time of the monotonic clock in milliseconds
+long long get_time_ms();
+
+// Starting TLS on the connected socket, resuming the saved session when there is one
+void start_tls(client_t* client);
+
+// Creating the TLS state of the connected socket with the saved session of the server, before the handshake
+SSL* create_tls(client_t* client);
+
+// Returning the TLS context shared by every session, creating it on first use
+SSL_CTX* get_tls_context();
+
+// Finding the file of the saved TLS session for the server, returning 0 if there is nowhere to keep it
+int get_tls_session_path(client_t* client, char* path, int path_size);
+
+// Loading the saved TLS session for the server, returning NULL if there is none
+SSL_SESSION* load_tls_session(client_t* client);
+
+// Callback saving each new TLS session so the next run can resume it
+int save_tls_session(SSL* tls, SSL_SESSION* session);
+
+// Receiving from the plain socket
+int plain_receive(client_t* client, char* buffer, int len);
+
+// Sending on the plain socket
+int plain_send(client_t* client, char* buffer, int len);
+
+// Closing the plain socket
+void plain_close(client_t* client);
+
+// Receiving decrypted bytes from the TLS connection
+int tls_receive(client_t* client, char* buffer, int len);
+
+// Sending bytes over the TLS connection
+int tls_send(client_t* client, char* buffer, int len);
+
+// Closing the TLS connection and its socket
+void tls_close(client_t* client);
+
+// Starting COMPRESS=DEFLATE once the login is done, if the server offers it
+void start_compress(client_t* client);
+
+// Receiving inflated bytes from the compressed connection
+int compress_receive(client_t* client, char* buffer, int len);
+
+// Sending bytes deflated and flushed over the compressed connection
+int compress_send(client_t* client, char* buffer, int len);
+
+// Ending compression and closing the transport under it
+void compress_close(client_t* client);
+
+// Sending all of the bytes through the transport, returning -1 on failure
+int send_data(client_t* client, char* data, int len);
+
 // Checking the established connection
 void check_connection(client_t* client);
 
@@ -50,970 +784,7719 @@ void select_folder(client_t* client);
 // To escape special char for folder
 void escape_special_char(char* input, char* output, int output_size);
 
+// Receiving more bytes from the server into the read buffer
+void fill_buffer(client_t* client);
+
+// Reading the next response line from the server
+char* read_line(client_t* client);
+
+// Returning the size of the literal that ends the line, -1 if there is none or LITERAL_TOO_LARGE
+int get_literal_size(char* line);
+
+// Reading the announced literal into the destination
+void read_literal(client_t* client, char* destination, int literal_size);
+
+// Writing the announced literal to the output
+void write_literal(client_t* client, FILE* output, int literal_size);
+
+// Reading the next chunk of the announced literal, returning its length
+int read_literal_chunk(client_t* client, char* chunk, int max_len);
+
+// Discarding the rest of the announced literal
+void skip_literal(client_t* client);
+
+// Returning the status of a tagged response line, or -1 if the line is not tagged with the tag
+int get_tagged_status(char* line, char* tag);
+
+// Sending a command without waiting for it, returning its tag number
+int send_command(client_t* client, char* command, completion_handler_t completion_handler, void* context);
+
+// Sending a FETCH command whose item literals go to the literal handler
+int send_fetch(client_t* client, char* sequence_set, char* items, char* item, literal_handler_t literal_handler, void* context);
+
+// Sending a FETCH or UID FETCH command with handlers for its literals and its lines
+int send_fetch_command(client_t* client, char* fetch_command, char* sequence_set, char* items, char* item,
+        literal_handler_t literal_handler, fetch_handler_t fetch_handler, void* context);
+
+// Sending a SEARCH or UID SEARCH command whose result numbers go to the search handler
+int send_search(client_t* client, char* search_command, char* criteria, search_handler_t search_handler, void* context);
+
+// Returning the lowest and highest message numbers of a sequence set
+void get_sequence_bounds(char* sequence_set, int* first_message, int* last_message);
+
+// Finding the command in flight that an untagged FETCH belongs to
+pending_t* find_fetch_command(client_t* client, int message_num);
+
+// Finding the oldest SEARCH command in flight
+pending_t* find_search_command(client_t* client);
+
+// Reading one response from the server and routing it to its command
+void dispatch_response(client_t* client);
+
+// Keeping track of the untagged responses that describe the mailbox
+void handle_untagged(client_t* client, char* line);
+
+// Saving the capabilities of a CAPABILITY response or response code
+void save_capabilities(client_t* client, char* line);
+
+// Checking whether the server advertised the capability
+int has_capability(client_t* client, char* name);
+
+// Returning the number of a response code such as UIDNEXT in the line, or 0
+unsigned long long get_response_code(char* line, char* name);
+
+// Waiting for the tagged response of the command, returning its status
+int wait_command(client_t* client, int tag_num);
+
+// Waiting for a FETCH command, returning the number of literals handled or -1
+int wait_fetch(client_t* client, int tag_num);
+
+// Waiting until no command is in flight
+void wait_all_commands(client_t* client);
+
+// Completion of the login command
+void login_complete(client_t* client, int status, void* context);
+
+// Completion of the select command
+void select_complete(client_t* client, int status, void* context);
+
+// Returning the message number of an untagged FETCH response line, or -1
+int get_fetch_number(char* line);
+
+// Checking whether the literal ending the line belongs to the FETCH item
+int is_fetch_item(char* line, char* item);
+
+// Returning the number after a FETCH attribute such as UID, or -1
+long get_fetch_attribute(char* line, char* name);
+
+// Handler printing the fetched literal
+void print_literal_handler(client_t* client, int message_num, int literal_size, void* context);
+
+// Handler saving the fetched literal into the arena
+void save_literal_handler(client_t* client, int message_num, int literal_size, void* context);
+
+// Fetching a single literal item of the message into the arena of the client
+char* fetch_literal(client_t* client, char* items, char* item, int* literal_size);
+
+// Parsing a sequence set into ranges with * as the last message, returning the count or -1
+int parse_sequence_set(char* sequence_set, int last_message, range_t** ranges);
+
+// Checking whether the sequence set names a single message
+int is_single_message(char* sequence_set);
+
 // Fetching the whole raw email
 void fetch_email(client_t* client);
 
-// Printing the response
-void print_response(int connfd, int print_index, int print_size);
+// Fetching every message of the sequence set in batches
+void fetch_email_set(client_t* client);
 
-// Receiving the remaining response from server
-void receive_remaining_response(int connfd);
+// Fetching the messages in partial FETCH windows, resuming partial files recorded in the journal
+void fetch_email_partial(client_t* client);
 
-// Parsing the header fields
-void parse_header_fields(client_t* client);
+// Handler saving the UID and size of each message of a partial retrieve
+void partial_size_handler(client_t* client, int message_num, char* line, void* context);
 
-// Parsing "from" field
-void parse_from(client_t* client);
+// Fetching one message window by window into the output directory or stdout
+void fetch_partial_message(client_t* client, partial_message_t* message, resume_journal_t* journal);
 
-// Parsing "to" field
-void parse_to(client_t* client);
+// Handler writing a partial FETCH window to its output
+void partial_literal_handler(client_t* client, int message_num, int literal_size, void* context);
 
-// Parsing "date" field
-void parse_date(client_t* client);
+// Loading the resume journal of the output directory and writing it back with only the unfinished files
+void open_resume_journal(resume_journal_t* journal, char* output_dir, unsigned long uid_validity);
 
-// Parsing "subject" field
-void parse_subject(client_t* client);
+// Returning the journal record of the UID, or NULL
+journal_record_t* find_journal_record(resume_journal_t* journal, long uid);
 
-// Removing \r\n for unfolding
-void remove_cr_newline(char* input);
+// Recording the committed size of the partial file of the UID, -1 once the message is complete
+void record_journal_offset(resume_journal_t* journal, long uid, long offset);
 
-// Printing the parsed header fields
-void print_parsed_fields(int connfd, int print_index, int output_size);
+// Closing the resume journal
+void close_resume_journal(resume_journal_t* journal);
 
-// Reading the mime body
-void read_mime(client_t* client);
+// Handler writing a fetched message to its own file
+void file_message_handler(client_t* client, int message_num, int literal_size, void* context);
 
-// Returning the full body given body size
-char* get_full_body(int connfd, int body_size);
+// Fetching the messages of the sequence set over several sessions at once
+void fetch_email_parallel(client_t* client, range_t* ranges, int range_count);
 
-// Printing the mime parts of the email
-void print_mime(char* body_buffer);
+// Handler saving the UID of each message in sequence order
+void uid_fetch_handler(client_t* client, int message_num, char* line, void* context);
 
-// Case insensitive strstr for the mime parameters
-char* insensitive_strstr(char* search, char* target);
+// Worker thread downloading chunks of messages over its own session
+void* retrieve_worker(void* argument);
 
-// Getting the boundary parameter
-char* get_boundary(char* content);
+// Opening, logging in and selecting a new session with the settings of the client
+client_t* open_session(client_t* client);
 
-// Checking the starting boundary of the mime
-char* check_starting_boundary(char* content, char* boundary);
+// Closing a session opened for a worker
+void close_session(client_t* client);
 
-// Checking the content type and charset
-char* check_content_type_charset(char* content);
+// Handing the command to the daemon, returning its exit status or DAEMON_BUSY to run it here
+int forward_request(client_t* client, int argc, char* argv[]);
 
-// Checking the content-type-encoding
-char* check_encoding_parameter(char* content);
+// Writing the server, account and folder that a pooled session has to match
+void get_session_key(client_t* client, char* key, int key_size);
 
-// Checking the end boundary of the mime
-char* check_end_boundary(char* content, char* boundary);
+// Serving commands from the UNIX socket with a pool of open sessions, it never returns
+void run_daemon(client_t* client);
 
-// Listing all of the email 
-void list_email(client_t* client);
+// Creating the listening UNIX socket, exiting if a daemon already serves it
+int open_daemon_socket(char* path);
 
-// Parsing the list and print them
-int parse_list_response(int connfd, char* response);
+// Passing a request to an idle session opened for the same key, starting one if there is none
+void handle_daemon_request(pooled_session_t* pool, int* pool_count, int request_fd);
 
+// Starting the process of a new pooled session, returning -1 on failure
+int start_pooled_session(pooled_session_t* session, char* key);
 
-int main(int argc, char* argv[]) {
-    client_t* client = init_client();
-    parse_command_line(argc, argv, client);
-    connect_server(client);
-    check_connection(client);
-    login_imap(client);
-    select_folder(client);
+// Reporting the outcome of the request of a session, removing the session if its process ended
+void finish_daemon_request(pooled_session_t* pool, int* pool_count, int index);
 
-    if (strcmp(client->command, "retrieve") == 0) {
-        fetch_email(client);
-    } else if (strcmp(client->command, "parse") == 0) {
-        parse_header_fields(client);
-    } else if (strcmp(client->command, "mime") == 0) {
-        read_mime(client);
-    } else if (strcmp(client->command, "list") == 0) {
-        list_email(client);
-    } else {
-        fprintf(stderr, "Command is not given\n");
-        exit(EXIT_FAILURE);
-    }
-    free(client);
+// Ending the process of a session and removing it from the pool, closing the connection of its client if it has one
+void remove_pooled_session(pooled_session_t* pool, int* pool_count, int index);
 
-    return 0;
-}
+// Process holding one session open and running each request it is handed, it never returns
+void run_session_process(int channel);
 
-void parse_command_line(int argc, char* argv[], client_t* client) {
-    int opt;
+// Sending a request with the output descriptors of its client, returning -1 on failure
+int send_request(int socket_fd, char* request, int request_len, int* output_fds);
 
-    while ((opt = getopt(argc, argv, "u:p:f:n:t")) != -1) {
-        switch (opt) {
-            case 'u':
-                client->username = optarg;
-                break;
-            case 'p':
-                client->password = optarg;
-                break;
-            case 'f':
-                client->folder = optarg;
-                break;
-            case 'n':
-                client->message_num = atoi(optarg);
-                break;
-            case 't':
-                client->use_tls = 1;
-                break;
-            default:
-                fprintf(stderr, "Invalid command line input\n");
-                exit(EXIT_FAILURE);
-        }
-    }
+// Receiving a request with the output descriptors of its client, returning its length or -1
+int receive_request(int socket_fd, char* buffer, int buffer_size, int* output_fds);
 
-    if (client->username == NULL || client->password == NULL) {
-        fprintf(stderr, "Username or Password not found\n");
-        exit(EXIT_FAILURE);
-    }
+// Splitting the NUL terminated strings of a request, returning the count or -1
+int split_request(char* request, int request_len, char** args, int max_args);
 
-    if (argc - optind != 2) {
-        fprintf(stderr, "Invalid command line input\n");
-        exit(EXIT_FAILURE); 
-    }
+// Listing the subjects of every account of the accounts file from one event loop
+void poll_accounts(client_t* client);
 
-    client->command = argv[optind];
-    client->server_name = argv[optind + 1];
+// Reading the accounts file and queueing each account on its server
+void load_accounts(poll_engine_t* engine, char* path);
 
-}
+// Returning the index of the server, resolving it the first time it appears
+int find_server(poll_engine_t* engine, char* name);
 
-client_t* init_client() {
-    client_t* client = (client_t*)malloc(sizeof(client_t));
-    if (client == NULL) {
-        fprintf(stderr, "Malloc failure\n");
-        exit(EXIT_FAILURE);
-    }
-    client->username = NULL;
-    client->password = NULL;
-    client->folder = DEFAULT_FOLDER;
-    client->message_num = 1;
-    client->use_tls = 0;
-    client->command = NULL;
-    client->server_name = NULL;
-    client->connfd = -1;
-    client->tag_counter = 1;
-    return client;
-}
+// Raising the descriptor limit as far as allowed
+void raise_file_limit();
 
-void connect_server(client_t* client) {
-    int connfd, s;
-    struct addrinfo hints, *res, *rp;
-    const char* port = client->use_tls ? "993" : "143";
+// Starting the accounts waiting on the server while it is below the connection limit
+void start_waiting_accounts(poll_engine_t* engine, int server_index);
 
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_INET6;         // Request IPv6
-    hints.ai_socktype = SOCK_STREAM;
+// Creating the session of the account and starting to connect it
+void start_account(poll_engine_t* engine, account_t* account);
 
-    s = getaddrinfo(client->server_name, port, &hints, &res);
-    if (s != 0) {
+// Starting a connect to the address of the account or the ones after it
+void connect_account(poll_engine_t* engine, account_t* account);
 
-        memset(&hints, 0, sizeof(hints));
-        hints.ai_family = AF_INET;      // Request IPv4
+// Watching the connection of the account for the events
+void watch_account(poll_engine_t* engine, account_t* account, unsigned int events);
 
-        s = getaddrinfo(client->server_name, port, &hints, &res);
-        if (s != 0) {
-            fprintf(stderr, "Error in getaddrinfo\n");
-            exit(2);
-        }
-    }
+// Moving the account on after its connection became ready
+void drive_account(poll_engine_t* engine, account_t* account);
 
-    if (res == NULL) {
-        fprintf(stderr, "Server address not found\n");
-        exit(EXIT_FAILURE);
-    }
+// Reading everything the server has sent to the account without blocking
+void read_account(poll_engine_t* engine, account_t* account);
 
-    for(rp = res; rp != NULL; rp = rp->ai_next) {
-        connfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-        
-        if (connfd == -1) continue;
-        if (connect(connfd, rp->ai_addr, rp->ai_addrlen) != -1) {
-            client->connfd = connfd;
-            freeaddrinfo(res);
-            return;                     // Connection established
-        }
-        close(connfd);
-    }
+// Receiving without blocking, returning RECEIVE_AGAIN if nothing has arrived
+int receive_nonblocking(client_t* client, char* buffer, int len);
 
-    freeaddrinfo(res);
-    fprintf(stderr, "Failed to connect using both IPv6 and IPv4\n");
-    exit(2);
+// Sending without blocking, returning SEND_AGAIN if the socket cannot take anything yet
+int send_nonblocking(client_t* client, char* buffer, int len);
 
-}
+// Adding commands to the output of the account and sending as much of it as the socket takes
+void queue_account_output(poll_engine_t* engine, account_t* account, char* data, int len);
 
-void check_connection(client_t* client) {
-    char receive_buffer[BUFFER_SIZE];
-    int bytes_received;
-    
-    bytes_received = recv(client->connfd, receive_buffer, sizeof(receive_buffer) - 1, 0);
-    if (bytes_received < 0) {
-        fprintf(stderr, "Failed to receive connect response");
-        exit(EXIT_FAILURE);
-    }
+// Sending the output of the account the socket did not take before, returning -1 if the account failed
+int flush_account_output(poll_engine_t* engine, account_t* account);
 
-    receive_buffer[bytes_received] = '\0';
-    if (strstr(receive_buffer, CONNECT_RESPONSE) == NULL) {
-        fprintf(stderr, "Connect failure\n");
-        exit(EXIT_FAILURE);
+// Handling each complete response line and literal in the read buffer of the account
+void handle_account_data(poll_engine_t* engine, account_t* account);
+
+// Handling a response line of the account
+void handle_account_line(poll_engine_t* engine, account_t* account, char* line);
+
+// Sending the login, select and fetch of the account at once
+void send_account_commands(poll_engine_t* engine, account_t* account);
+
+// Printing the subject of a message of the account
+void print_account_subject(account_t* account, int message_num, char* literal, int literal_size);
+
+// Reporting the error of the account and finishing it
+void fail_account(poll_engine_t* engine, account_t* account, int status, char* message);
+
+// Closing the session of the account and recording its exit code
+void finish_account(poll_engine_t* engine, account_t* account, int status);
+
+// Failing the accounts whose server stopped answering
+void check_account_deadlines(poll_engine_t* engine);
+
+// Taking the next chunk for the worker, stealing from the busiest worker when it runs out
+int take_chunk(scheduler_t* scheduler, int index);
+
+// Handler writing a fetched message to the mbox stream on stdout
+void mbox_message_handler(client_t* client, int message_num, int literal_size, void* context);
+
+// Writing message bytes with lines matching >*From quoted by one more '>'
+void write_mbox_quoted(mbox_state_t* state, char* data, int data_len, FILE* output);
+
+// Writing the start of a line held back while matching >*From
+void flush_mbox_state(mbox_state_t* state, FILE* output);
+
+// Streaming a literal from the connection to the output in fixed size chunks
+void stream_literal(client_t* client, FILE* output, int literal_size);
+
+// Moving part of a literal to the output inside the kernel, returns bytes moved or -1
+int splice_literal(int connfd, int out_fd, int literal_size);
+
+// Parsing the header fields
+void parse_header_fields(client_t* client);
+
+// Finding a header field in the header block, returning a view of its value
+view_t find_header_field(char* header, char* name);
+
+// Writing a field value without the \r\n of its folded lines
+void write_unfolded(view_t value, FILE* output);
+
+// Copying a field value without the \r\n of its folded lines into the arena, or NULL if it is missing
+char* copy_unfolded(view_t value, arena_t* arena);
+
+// Writing a field value unfolded, with its RFC 2047 encoded words decoded to UTF-8
+void write_decoded_header(view_t value, FILE* output);
+
+// Decoding the encoded word at the start of the text to UTF-8, returning the length or -1 if it is not one
+int decode_encoded_word(char* word, char* end, char* output, char** word_end);
+
+// Checking whether the text holds only whitespace and line breaks
+int is_blank_text(view_t text);
+
+// Returning the CHARSET_* of a charset name, or CHARSET_UNKNOWN
+int get_charset(char* name, int name_len);
+
+// Converting text in the charset to UTF-8, returning the output length
+int transcode_to_utf8(int charset, unsigned char* input, int input_len, char* output);
+
+// Writing a code point as UTF-8, returning its length
+int encode_utf8(unsigned long code_point, char* output);
+
+// Printing the parsed header field, or the missing output if it is not in the header block
+void print_parsed_fields(char* header, char* name, char* missing, int decode);
+
+// Reading the mime body
+void read_mime(client_t* client);
+
+// Handler feeding the fetched message to the MIME parser
+void mime_literal_handler(client_t* client, int message_num, int literal_size, void* context);
+
+// Writing every attachment of the message to its own file in the output directory
+void save_attachments(client_t* client);
+
+// Fetching each attachment by its section from the BODYSTRUCTURE, returning 0 if the server gave none to use
+int save_structure_attachments(client_t* client, mime_parser_t* parser);
+
+// Visitor adding each attachment to the list
+int collect_structure_attachment(mime_part_t* part, char* section, void* context);
+
+// Handler decoding a fetched section into the file of its attachment
+void attachment_literal_handler(client_t* client, int message_num, int literal_size, void* context);
+
+// Checking whether a single part is saved by the attachments command
+int is_attachment_part(mime_part_t* part);
+
+// Opening the file of the attachment and selecting its part for decoding
+void open_attachment(mime_parser_t* parser, mime_part_t* part);
+
+// Finishing the decoding and closing the file of the attachment
+void close_attachment(mime_parser_t* parser);
+
+// Making the file name of an attachment safe to create in the output directory and unique within the message
+void get_attachment_name(mime_parser_t* parser, mime_part_t* part, char* name, int name_size);
+
+// Reading the named parameter of a MIME field value into the file name
+void get_mime_filename(char* field, char* wanted, mime_filename_t* filename);
+
+// Adding a parameter to the file name if it is the wanted one, or an RFC 2231 section or encoded form of it
+void add_filename_parameter(mime_filename_t* filename, char* parameter, char* value, char* wanted);
+
+// Printing the selected part fetched on its own from the BODYSTRUCTURE, returning 0 if the server gave none to use
+int read_mime_structure(client_t* client, mime_parser_t* parser);
+
+// Fetching the size, BODYSTRUCTURE and MIME-Version of the message, returning 0 if the server gave no structure to use
+int fetch_mime_structure(client_t* client, mime_parser_t* parser, mime_structure_t* structure);
+
+// Visitor stopping at the part the parser would select
+int select_structure_part(mime_part_t* part, char* section, void* context);
+
+// Handler saving the size and BODYSTRUCTURE of the message
+void structure_fetch_handler(client_t* client, int message_num, char* line, void* context);
+
+// Handler saving the MIME-Version header field of the message
+void structure_literal_handler(client_t* client, int message_num, int literal_size, void* context);
+
+// Handler writing the fetched body of the selected part
+void section_literal_handler(client_t* client, int message_num, int literal_size, void* context);
+
+// Walking a body of the BODYSTRUCTURE, returning 1 if the visitor stopped at a part, 0 if not, -1 if it cannot be read
+int walk_structure_part(char** current, char* section, int section_size, mime_part_t* part, structure_visitor_t visit, void* context, int depth);
+
+// Reading the parameter list of a BODYSTRUCTURE into the charset if given and the file name, returning -1 if it cannot be read
+int read_structure_parameters(char** current, char* charset, mime_filename_t* filename, char* filename_parameter);
+
+// Reading a string or atom of the BODYSTRUCTURE, returning 0 for NIL and -1 if it cannot be read
+int read_structure_string(char** current, char* value, int value_size);
+
+// Skipping a value of the BODYSTRUCTURE with any lists in it, returning -1 if it cannot be read
+int skip_structure_value(char** current, int depth);
+
+// Selecting the part whose body is printed
+void select_mime_part(mime_parser_t* parser, mime_part_t* part);
+
+// Initializing the MIME parser for a new message
+void init_mime_parser(mime_parser_t* parser, FILE* output, arena_t* arena, int decode);
+
+// Adding a part to the MIME part tree
+mime_part_t* new_mime_part(arena_t* arena, mime_part_t* parent);
+
+// Feeding the next piece of the message to the MIME parser
+void feed_mime_parser(mime_parser_t* parser, char* data, int data_len);
+
+// Collecting a piece of a part header
+void feed_mime_header(mime_parser_t* parser, char* data, int data_len, int complete);
+
+// Choosing what to do with the part once its header is complete
+void end_mime_header(mime_parser_t* parser);
+
+// Reading the content fields of a part header
+void parse_mime_header(char* header, mime_part_t* part);
+
+// Checking whether the part is a UTF-8 text/plain part to print, base64 parts only when decoding
+int is_selected_mime_part(mime_part_t* part, int decode);
+
+// Copying a header field without the surrounding whitespace, returning 0 if it is missing
+int get_mime_header_value(char* header, char* name, char* value, int value_size);
+
+// Copying a parameter of a Content-Type value, returning 0 if it is missing
+int get_mime_parameter(char* content_type, char* name, char* value, int value_size);
+
+// Collecting a piece of a body line
+void feed_mime_line(mime_parser_t* parser, char* data, int data_len, int complete);
+
+// Handling a complete body line, which is either a delimiter or content
+void process_mime_line(mime_parser_t* parser, int content_len, int ending_len);
+
+// Returning the multipart whose delimiter the line is, or NULL
+mime_part_t* find_mime_delimiter(mime_parser_t* parser, char* line, int line_len, int* closing);
+
+// Moving on to the next part or the end of the multipart after a delimiter
+void end_mime_part(mime_parser_t* parser, mime_part_t* container, int closing);
+
+// Printing body bytes if they belong to the selected part
+void write_mime_body(mime_parser_t* parser, char* data, int data_len);
+
+// Finishing the message, failing if no part was printed in full
+void finish_mime_parser(mime_parser_t* parser);
+
+// Handling the last line of the message, which may end without a line break
+void end_mime_input(mime_parser_t* parser);
+
+// Printing quoted-printable body bytes decoded, an escape may be split over several calls
+void decode_quoted_printable(mime_parser_t* parser, char* data, int data_len);
+
+// Printing the escape collected so far once it is known to be a byte, a soft line break or neither
+void resolve_qp_escape(mime_parser_t* parser);
+
+// Returning the value of a hexadecimal digit, or -1
+int get_hex_value(char c);
+
+// Collecting base64 body bytes and decoding them a buffer at a time
+void decode_base64(mime_parser_t* parser, char* data, int data_len);
+
+// Printing the collected base64 characters decoded, keeping an unfinished group unless the part ended
+void flush_base64(mime_parser_t* parser, int final);
+
+// Decoding every complete group of base64 characters, skipping bytes outside the alphabet
+int decode_base64_data(unsigned char* input, int input_len, unsigned char* output, int* input_used);
+
+// Decoding the next group of four base64 characters, returning the input used or 0 if the group is incomplete
+int decode_base64_group(unsigned char* input, int input_len, unsigned char* output);
+
+// Returning the value of a base64 character, or -1
+int get_base64_value(unsigned char c);
+
+// Printing what the decoder still holds once the selected part has ended
+void finish_decoding(mime_parser_t* parser);
+
+// Choosing the widest base64 kernel the processor supports
+base64_kernel_t select_base64_kernel();
+
+// Base64 kernel decoding four characters at a time
+int decode_base64_scalar(unsigned char* input, int input_len, unsigned char* output, int* input_used);
+
+#ifdef HAVE_X86_SIMD
+// Base64 kernel translating 16 characters at a time with byte shuffle lookups
+int decode_base64_ssse3(unsigned char* input, int input_len, unsigned char* output, int* input_used);
+
+// Base64 kernel translating 32 characters at a time with byte shuffle lookups
+int decode_base64_avx2(unsigned char* input, int input_len, unsigned char* output, int* input_used);
+#endif
+
+// Case insensitive strstr for the mime parameters
+char* insensitive_strstr(char* search, char* target);
+
+// Listing all of the email 
+void list_email(client_t* client);
+
+// Checking whether the list has to search for its messages
+int has_list_filter(client_t* client);
+
+// Listing only the messages matching the filters, fetching them in batches
+void list_filtered(client_t* client);
+
+// Building the SEARCH criteria of the filters
+void get_search_criteria(list_filter_t* filter, char* criteria, int criteria_size);
+
+// Writing a text search key, quoted for ASCII and as a literal otherwise, returning the length written
+int append_search_text(char* criteria, int criteria_size, char* key, char* text);
+
+// Converting a date given as YYYY-MM-DD or DD-Mon-YYYY to an IMAP date, returning -1 if it is neither
+int format_search_date(char* input, char* output, int output_size);
+
+// Checking whether the text has bytes outside ASCII
+int has_non_ascii(char* text);
+
+// Writing sorted UIDs from the first index on as a UID set of ranges, returning the index after the last one written
+int build_uid_set(int* uids, int first, int last, char* uid_set, int uid_set_size);
+
+// Handler printing the subject of each message as it arrives
+void list_literal_handler(client_t* client, int message_num, int literal_size, void* context);
+
+// Printing the subject of the header block for the list, or a placeholder if it has none
+void print_list_subject(char* header, int decode);
+
+// Printing a subject as list does, or <No subject> if it is missing
+void print_subject(view_t subject, int decode);
+
+// Finding the subject for the list without its leading whitespace
+view_t find_list_subject(char* header);
+
+// Loading the list cache of the folder and choosing the SELECT options to resynchronize it
+void open_list_cache(client_t* client);
+
+// Building the cache file name from the user, server, folder and extension
+void get_cache_path(client_t* client, char* extension, char* path, int path_size);
+
+// Escaping the characters that cannot go into a file name
+void escape_file_name(char* input, char* output, int output_size);
+
+// Loading the list cache from its file, leaving it empty if the file is missing or unreadable
+void load_list_cache(list_cache_t* cache);
+
+// Reading one length prefixed field of the cache file into the arena of the cache
+int read_cache_field(FILE* file, int field_len, arena_t* strings, char** field);
+
+// Writing the list cache to its file
+void save_list_cache(list_cache_t* cache);
+
+// Discarding every entry of the list cache
+void clear_list_cache(list_cache_t* cache);
+
+// Returning the index of the first cache entry with a UID not below the given one
+int find_cache_entry(list_cache_t* cache, int uid);
+
+// Removing the cached messages whose UIDs are in the set
+void remove_cached_uids(list_cache_t* cache, char* uid_set);
+
+// Bringing the list cache up to date with the selected folder
+void sync_list_cache(client_t* client);
+
+// Fetching the envelope fields of the messages from the UID onwards into the cache
+void fetch_cache_entries(client_t* client, unsigned long first_uid);
+
+// Handler taking the UID from each line of a FETCH response
+void cache_fetch_handler(client_t* client, int message_num, char* line, void* context);
+
+// Handler reading the header of a FETCH response
+void cache_literal_handler(client_t* client, int message_num, int literal_size, void* context);
+
+// Adding the message to the cache once both its UID and its header have arrived
+void add_cache_entry(cache_fetch_t* fetch);
+
+// Keeping only the cached messages whose UIDs are still in the folder
+void retain_cached_uids(client_t* client);
+
+// Handler collecting the numbers of a SEARCH response
+void number_search_handler(client_t* client, long number, void* context);
+
+// Comparing two numbers for qsort and bsearch
+int compare_numbers(const void* a, const void* b);
+
+// Comparing two cache entries by UID for qsort
+int compare_cache_entries(const void* a, const void* b);
+
+// Printing the list from the cache
+void print_list_cache(list_cache_t* cache, int decode);
+
+// Printing a subject kept by the list cache with its message number
+void print_cached_subject(int message_num, char* subject, int decode);
+
+// Printing new messages as they arrive, reconnecting with backoff whenever the session ends, it never returns
+void idle_folder(client_t* client);
+
+// Process connecting a session and idling on the folder until the session fails
+void run_idle_session(client_t* client, idle_state_t* state);
+
+// Waiting until a response can be read or the time is up, returning whether one can
+int wait_readable(client_t* client, long long timeout_ms);
+
+// Printing the messages from the next UID of the idle state onwards
+void print_new_messages(client_t* client, idle_state_t* state);
+
+// Getting the message from the store, fetching it into the store first if needed
+char* load_stored_message(client_t* client, message_store_t* store, int* message_size);
+
+// Handler saving the UID of the message
+void message_uid_handler(client_t* client, int message_num, char* line, void* context);
+
+// Opening the message store of the folder, emptying it if the UIDVALIDITY changed
+void open_message_store(client_t* client, message_store_t* store);
+
+// Putting empty files in place of the store, leaving the old ones to the runs that still map them
+void replace_message_store(client_t* client, message_store_t* store);
+
+// Mapping the current contents of the store files
+void map_message_store(message_store_t* store);
+
+// Removing the mappings of the store files
+void unmap_message_store(message_store_t* store);
+
+// Closing the message store
+void close_message_store(message_store_t* store);
+
+// Finding the mapped message with the UID, or NULL
+char* find_stored_message(message_store_t* store, long uid, int* message_size);
+
+// Handler appending the fetched message to the store
+void store_message_handler(client_t* client, int message_num, int literal_size, void* context);
+
+// Adding the messages after the last indexed UID to the text index of the folder
+void index_folder(client_t* client);
+
+// Handler saving the sequence number and UID of each message to index
+void index_uid_handler(client_t* client, int message_num, char* line, void* context);
+
+// Handler appending a message fetched for the index to the store under its UID
+void index_store_handler(client_t* client, int message_num, int literal_size, void* context);
+
+// Listing the newest record of each stored UID sorted by UID, the caller frees the list
+store_record_t* sort_store_records(message_store_t* store, int* record_count);
+
+// Comparing store records by UID, newest first for the same UID
+int compare_store_records(const void* first, const void* second);
+
+// Finding the record of the UID in the sorted records, or NULL
+store_record_t* find_store_record(store_record_t* records, int record_count, uint32_t uid);
+
+// Tokenizing the header fields and the text of a message into the builder
+void index_message(index_builder_t* builder, uint32_t uid, char* message, int message_size, arena_t* arena);
+
+// Writing the text/plain part mime would print, decoded, or the body of a plain text message
+void write_message_text(char* message, int message_size, FILE* output, arena_t* arena);
+
+// Adding each token of the text to the builder at the next positions
+void index_text(index_builder_t* builder, char* text, int text_len);
+
+// Reading the next token in lower case, returning its length or 0 at the end of the text
+int next_token(char** current, char* end, char* token);
+
+// Finding the term in the builder, adding it if it is new
+index_term_t* find_index_term(index_builder_t* builder, char* term, int term_len);
+
+// Writing the positions of the current message to the postings of its terms
+void end_index_document(index_builder_t* builder, uint32_t uid);
+
+// Freeing the memory of the builder
+void free_index_builder(index_builder_t* builder);
+
+// Mapping the text index of the folder, returning 0 if there is none
+int open_text_index(client_t* client, text_index_t* index);
+
+// Removing the mapping of the text index
+void close_text_index(text_index_t* index);
+
+// Finding the term in the sorted terms of the index, or NULL
+text_index_term_t* find_text_index_term(text_index_t* index, char* term, int term_len);
+
+// Writing the old index and the new postings into a new file and putting it in place of the old one
+void write_text_index(client_t* client, text_index_t* index, index_builder_t* builder, uint32_t last_uid);
+
+// Comparing the terms of the builder by their bytes
+int compare_index_terms(const void* first, const void* second);
+
+// Comparing two terms by their bytes, the shorter first when one starts the other
+int compare_terms(char* first, int first_len, char* second, int second_len);
+
+// Appending the postings with their first UID delta made relative to base_uid
+void append_postings(byte_buffer_t* output, unsigned char* postings, int postings_len, uint32_t base_uid);
+
+// Appending bytes to the buffer
+void append_bytes(byte_buffer_t* buffer, void* data, int data_len);
+
+// Appending a number as a varint of 7 bit groups, lowest first
+void append_varint(byte_buffer_t* buffer, uint32_t value);
+
+// Reading a varint, returning 0 if it runs past the end
+int read_varint(unsigned char** current, unsigned char* end, uint32_t* value);
+
+// Printing the subject of each message matching the query, from the text index alone
+void search_index(client_t* client);
+
+// Parsing and evaluating terms joined by OR
+number_list_t parse_query_or(query_t* query);
+
+// Parsing and evaluating terms joined by AND or nothing
+number_list_t parse_query_and(query_t* query);
+
+// Parsing and evaluating a word, a quoted phrase, a group in brackets or a negated one of them
+number_list_t parse_query_term(query_t* query);
+
+// Skipping whitespace and checking whether the query continues with the operator word
+int match_query_operator(query_t* query, char* operator);
+
+// Listing the UIDs of the messages holding the tokens of the text one after another
+number_list_t match_phrase(text_index_t* index, char* text, int text_len);
+
+// Starting a cursor on the postings of the term
+void start_postings_cursor(postings_cursor_t* cursor, text_index_t* index, text_index_term_t* term);
+
+// Moving the cursor to the next message, leaving its UID 0 at the end
+void next_postings_document(postings_cursor_t* cursor);
+
+// Checking whether the messages has the tokens at consecutive positions
+int match_positions(postings_cursor_t* cursors, int cursor_count, number_list_t* positions);
+
+// Listing the UIDs in both lists
+number_list_t intersect_uids(number_list_t first, number_list_t second);
+
+// Listing the UIDs in either list
+number_list_t unite_uids(number_list_t first, number_list_t second);
+
+// Listing the indexed UIDs missing from the list
+number_list_t complement_uids(text_index_t* index, number_list_t uids);
+
+// Adding a number to the end of the list
+void append_number(number_list_t* list, int number);
+
+static const transport_t plain_transport = {plain_receive, plain_send, plain_close, 1};
+static const transport_t tls_transport = {tls_receive, tls_send, tls_close, 0};
+static const transport_t compress_transport = {compress_receive, compress_send, compress_close, 0};
+
+int main(int argc, char* argv[]) {
+    client_t* client = init_client();
+    if (getenv(ALLOC_STATS_VARIABLE) != NULL) {
+        atexit(print_allocation_stats);
+    }
+    parse_command_line(argc, argv, client);
+    if (strcmp(client->command, DAEMON_COMMAND) == 0) {
+        run_daemon(client);
+    }
+    if (strcmp(client->command, POLL_COMMAND) == 0) {
+        poll_accounts(client);
+        free(client);
+        return 0;
+    }
+    if (strcmp(client->command, IDLE_COMMAND) == 0) {
+        idle_folder(client);
+    }
+    if (strcmp(client->command, SEARCH_COMMAND) == 0) {
+        search_index(client);
+        free(client);
+        return 0;
+    }
+
+    // A running daemon already holds the connection, the login and the folder
+    if (client->socket_path != NULL) {
+        int status = forward_request(client, argc, argv);
+        if (status != DAEMON_BUSY) {
+            exit(status);
+        }
+    }
+
+    connect_server(client);
+    check_connection(client);
+    login_imap(client);
+    if (client->use_compress) {
+        start_compress(client);
+    }
+    if (client->cache_dir != NULL && strcmp(client->command, "list") == 0 && !has_list_filter(client)) {
+        open_list_cache(client);
+    }
+    select_folder(client);
+    run_command(client);
+    close_session(client);
+
+    return 0;
+}
+
+void run_command(client_t* client) {
+    if (strcmp(client->command, "retrieve") == 0) {
+        fetch_email(client);
+    } else if (strcmp(client->command, "parse") == 0) {
+        parse_header_fields(client);
+    } else if (strcmp(client->command, "mime") == 0) {
+        read_mime(client);
+    } else if (strcmp(client->command, ATTACHMENTS_COMMAND) == 0) {
+        save_attachments(client);
+    } else if (strcmp(client->command, "list") == 0) {
+        list_email(client);
+    } else if (strcmp(client->command, INDEX_COMMAND) == 0) {
+        index_folder(client);
+    } else {
+        fprintf(stderr, "Command is not given\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void parse_command_line(int argc, char* argv[], client_t* client) {
+    static const struct option long_options[] = {
+        {"since", required_argument, NULL, OPTION_SINCE},
+        {"from", required_argument, NULL, OPTION_FROM},
+        {"subject", required_argument, NULL, OPTION_SUBJECT},
+        {"unseen", no_argument, NULL, OPTION_UNSEEN},
+        {"larger", required_argument, NULL, OPTION_LARGER},
+        {"limit", required_argument, NULL, OPTION_LIMIT},
+        {"offset", required_argument, NULL, OPTION_OFFSET},
+        {"chunk-size", required_argument, NULL, OPTION_CHUNK_SIZE},
+        {"head-bytes", required_argument, NULL, OPTION_HEAD_BYTES},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "u:p:f:n:o:c:j:w:s:a:m:tdz", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'u':
+                client->username = optarg;
+                break;
+            case 'p':
+                client->password = optarg;
+                break;
+            case 'f':
+                client->folder = optarg;
+                break;
+            case 'n':
+                client->message_set = optarg;
+                break;
+            case 'o':
+                client->output_dir = optarg;
+                break;
+            case 'c':
+                client->cache_dir = optarg;
+                break;
+            case 's':
+                client->socket_path = optarg;
+                break;
+            case 'a':
+                client->accounts_path = optarg;
+                break;
+            case 'm':
+                client->server_limit = atoi(optarg);
+                if (client->server_limit < 1) {
+                    fprintf(stderr, "Invalid connection limit\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'j':
+                client->jobs = atoi(optarg);
+                if (client->jobs < 1 || client->jobs > MAX_JOBS) {
+                    fprintf(stderr, "Invalid number of jobs\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'w':
+                client->connect_timeout = atof(optarg) * 1000;
+                if (client->connect_timeout <= 0) {
+                    fprintf(stderr, "Invalid connect timeout\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 't':
+                client->use_tls = 1;
+                break;
+            case 'd':
+                client->decode = 1;
+                break;
+            case 'z':
+                client->use_compress = 1;
+                break;
+            case OPTION_SINCE:
+                if (format_search_date(optarg, client->filter.since, sizeof(client->filter.since)) < 0) {
+                    fprintf(stderr, "Invalid date\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPTION_FROM:
+                client->filter.from = optarg;
+                break;
+            case OPTION_SUBJECT:
+                client->filter.subject = optarg;
+                break;
+            case OPTION_UNSEEN:
+                client->filter.unseen = 1;
+                break;
+            case OPTION_LARGER:
+                client->filter.larger = atol(optarg);
+                if (client->filter.larger < 0) {
+                    fprintf(stderr, "Invalid size\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPTION_LIMIT:
+                client->filter.limit = atoi(optarg);
+                if (client->filter.limit < 0) {
+                    fprintf(stderr, "Invalid limit\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPTION_CHUNK_SIZE:
+                client->chunk_size = atol(optarg);
+                if (client->chunk_size <= 0) {
+                    fprintf(stderr, "Invalid chunk size\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPTION_HEAD_BYTES:
+                client->head_bytes = atol(optarg);
+                if (client->head_bytes <= 0) {
+                    fprintf(stderr, "Invalid head size\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPTION_OFFSET:
+                client->filter.offset = atoi(optarg);
+                if (client->filter.offset < 0) {
+                    fprintf(stderr, "Invalid offset\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                fprintf(stderr, "Invalid command line input\n");
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    // The daemon only needs its socket, the sessions come with the requests
+    if (argc - optind == 1 && strcmp(argv[optind], DAEMON_COMMAND) == 0) {
+        if (client->socket_path == NULL) {
+            fprintf(stderr, "Daemon needs a socket path\n");
+            exit(EXIT_FAILURE);
+        }
+        client->command = argv[optind];
+        return;
+    }
+
+    // Polling takes its servers and accounts from the accounts file
+    if (argc - optind == 1 && strcmp(argv[optind], POLL_COMMAND) == 0) {
+        if (client->accounts_path == NULL) {
+            fprintf(stderr, "Poll needs an accounts file\n");
+            exit(EXIT_FAILURE);
+        }
+        client->command = argv[optind];
+        return;
+    }
+
+    // Search reads only the index in the cache directory, so it needs no password
+    if (argc - optind == 3 && strcmp(argv[optind], SEARCH_COMMAND) == 0) {
+        if (client->username == NULL || client->cache_dir == NULL) {
+            fprintf(stderr, "Search needs a username and a cache directory\n");
+            exit(EXIT_FAILURE);
+        }
+        client->command = argv[optind];
+        client->server_name = argv[optind + 1];
+        client->query = argv[optind + 2];
+        return;
+    }
+
+    if (client->username == NULL || client->password == NULL) {
+        fprintf(stderr, "Username or Password not found\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (argc - optind != 2) {
+        fprintf(stderr, "Invalid command line input\n");
+        exit(EXIT_FAILURE); 
+    }
+
+    client->command = argv[optind];
+    client->server_name = argv[optind + 1];
+
+    // Only numbers, ranges and * may reach the server
+    range_t* ranges;
+    if (parse_sequence_set(client->message_set, INT_MAX, &ranges) < 0) {
+        fprintf(stderr, "Invalid message number\n");
+        exit(EXIT_FAILURE);
+    }
+    free(ranges);
+
+    if (!is_single_message(client->message_set) && strcmp(client->command, RETRIEVE_COMMAND) != 0) {
+        fprintf(stderr, "Only retrieve accepts more than one message\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (has_list_filter(client) && strcmp(client->command, "list") != 0) {
+        fprintf(stderr, "Only list accepts filters\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((client->chunk_size > 0 || client->head_bytes > 0) && strcmp(client->command, RETRIEVE_COMMAND) != 0) {
+        fprintf(stderr, "Only retrieve fetches partially\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (strcmp(client->command, INDEX_COMMAND) == 0 && client->cache_dir == NULL) {
+        fprintf(stderr, "Index needs a cache directory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (strcmp(client->command, ATTACHMENTS_COMMAND) == 0 && client->output_dir == NULL) {
+        fprintf(stderr, "Attachments need an output directory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (client->jobs > 1 && client->output_dir == NULL) {
+        fprintf(stderr, "Parallel retrieve needs an output directory\n");
+        exit(EXIT_FAILURE);
+    }
+
+}
+
+client_t* init_client() {
+    client_t* client = (client_t*)allocate(sizeof(client_t));
+    client->username = NULL;
+    client->password = NULL;
+    client->folder = DEFAULT_FOLDER;
+    client->message_set = DEFAULT_MESSAGE_SET;
+    client->output_dir = NULL;
+    client->cache_dir = NULL;
+    client->socket_path = NULL;
+    client->accounts_path = NULL;
+    client->jobs = 1;
+    client->server_limit = DEFAULT_SERVER_LIMIT;
+    client->connect_timeout = DEFAULT_CONNECT_TIMEOUT_MS;
+    client->use_tls = 0;
+    client->use_compress = 0;
+    client->query = NULL;
+    client->decode = 0;
+    client->filter.since[0] = '\0';
+    client->filter.from = NULL;
+    client->filter.subject = NULL;
+    client->filter.unseen = 0;
+    client->filter.larger = -1;
+    client->filter.limit = -1;
+    client->filter.offset = 0;
+    client->chunk_size = 0;
+    client->head_bytes = 0;
+    client->command = NULL;
+    client->server_name = NULL;
+    client->connfd = -1;
+    client->transport = &plain_transport;
+    client->tls = NULL;
+    client->compress = NULL;
+    client->tag_counter = 1;
+    client->pending_count = 0;
+    client->exists = -1;
+    client->uid_validity = 0;
+    client->uid_next = 0;
+    client->highest_modseq = 0;
+    client->capabilities = NULL;
+    client->select_options = NULL;
+    client->list_cache = NULL;
+    client->continued = 0;
+    init_arena(&client->arena, 0);
+    for (int i = 0; i < MAX_PENDING; i++) {
+        client->pending[i].tag_num = 0;
+        client->pending[i].status = RESPONSE_OK;
+    }
+    client->reader.start = 0;
+    client->reader.end = 0;
+    client->reader.line = NULL;
+    client->reader.line_size = 0;
+    client->reader.literal_remaining = 0;
+    client->reader.literal_announced = 0;
+    client->reader.continued = 0;
+    return client;
+}
+
+void* allocate(size_t size) {
+    void* memory = malloc(size);
+    if (memory == NULL) {
+        fprintf(stderr, "Malloc failure\n");
+        exit(EXIT_FAILURE);
+    }
+    count_allocations(1);
+    return memory;
+}
+
+void* reallocate(void* memory, size_t size) {
+    memory = realloc(memory, size);
+    if (memory == NULL) {
+        fprintf(stderr, "Malloc failure\n");
+        exit(EXIT_FAILURE);
+    }
+    count_allocations(1);
+    return memory;
+}
+
+unsigned long count_allocations(int allocations) {
+    static unsigned long total = 0;
+
+    // Worker threads allocate too
+    return __atomic_add_fetch(&total, allocations, __ATOMIC_RELAXED);
+}
+
+void print_allocation_stats() {
+    fprintf(stderr, "Allocations: %lu\n", count_allocations(0));
+}
+
+void init_arena(arena_t* arena, size_t size) {
+    arena->block = NULL;
+    arena->total = 0;
+    if (size > 0) {
+        arena->block = (arena_block_t*)allocate(sizeof(arena_block_t) + size);
+        arena->block->next = NULL;
+        arena->block->used = 0;
+        arena->block->size = size;
+        arena->total = size;
+    }
+}
+
+void* arena_alloc(arena_t* arena, size_t size) {
+    arena_block_t* block = arena->block;
+
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+    // A full block is kept, so everything handed out stays where it is until the reset
+    if (block == NULL || block->size - block->used < size) {
+        size_t block_size = block != NULL ? block->size * 2 : ARENA_BLOCK_SIZE;
+        while (block_size < size) {
+            block_size *= 2;
+        }
+        block = (arena_block_t*)allocate(sizeof(arena_block_t) + block_size);
+        block->next = arena->block;
+        block->used = 0;
+        block->size = block_size;
+        arena->block = block;
+        arena->total += block_size;
+    }
+
+    void* memory = block->data + block->used;
+    block->used += size;
+    return memory;
+}
+
+void reset_arena(arena_t* arena) {
+    if (arena->block == NULL) {
+        return;
+    }
+
+    // One block as large as all of them together serves the next command without allocating
+    if (arena->block->next != NULL) {
+        size_t total = arena->total;
+        free_arena(arena);
+        init_arena(arena, total);
+        return;
+    }
+    arena->block->used = 0;
+}
+
+void free_arena(arena_t* arena) {
+    while (arena->block != NULL) {
+        arena_block_t* next = arena->block->next;
+        free(arena->block);
+        arena->block = next;
+    }
+    arena->total = 0;
+}
+
+void connect_server(client_t* client) {
+    struct addrinfo hints, *res;
+    struct addrinfo* addresses[MAX_CONNECT_ATTEMPTS];
+    struct pollfd attempts[MAX_CONNECT_ATTEMPTS];
+    int address_count, attempt_count = 0, next = 0, s;
+    int connfd = -1;
+    const char* port = client->use_tls ? "993" : "143";
+
+    // Both families are resolved at once, in the order the system prefers
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+
+    s = getaddrinfo(client->server_name, port, &hints, &res);
+    if (s != 0) {
+        fprintf(stderr, "Error in getaddrinfo\n");
+        exit(2);
+    }
+
+    if (res == NULL) {
+        fprintf(stderr, "Server address not found\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Attempts start one delay apart, or as soon as the last one failed, and the first to connect wins
+    address_count = interleave_addresses(res, addresses, MAX_CONNECT_ATTEMPTS);
+    long long now = get_time_ms();
+    long long deadline = now + client->connect_timeout;
+    long long next_start = now;
+    while (connfd < 0 && (next < address_count || attempt_count > 0) && (now = get_time_ms()) < deadline) {
+        if (next < address_count && (now >= next_start || attempt_count == 0)) {
+            int attempt = start_connect(addresses[next++]);
+            if (attempt >= 0) {
+                attempts[attempt_count].fd = attempt;
+                attempts[attempt_count].events = POLLOUT;
+                attempt_count++;
+                next_start = now + CONNECT_ATTEMPT_DELAY_MS;
+            }
+            continue;
+        }
+
+        long long wait = deadline - now;
+        if (next < address_count && next_start - now < wait) {
+            wait = next_start - now;
+        }
+        if (poll(attempts, attempt_count, wait) < 0 && errno != EINTR) {
+            break;
+        }
+
+        for (int i = 0; i < attempt_count; i++) {
+            int error = 0;
+            socklen_t error_len = sizeof(error);
+
+            if (attempts[i].revents == 0) {
+                continue;
+            }
+            if (getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == 0 && error == 0) {
+                connfd = attempts[i].fd;
+                attempts[i] = attempts[--attempt_count];
+                break;
+            }
+            close(attempts[i].fd);
+            attempts[i--] = attempts[--attempt_count];
+            next_start = now;
+        }
+    }
+
+    for (int i = 0; i < attempt_count; i++) {
+        close(attempts[i].fd);
+    }
+    freeaddrinfo(res);
+
+    if (connfd < 0) {
+        if (get_time_ms() >= deadline) {
+            fprintf(stderr, "Connection timed out\n");
+        } else {
+            fprintf(stderr, "Failed to connect using both IPv6 and IPv4\n");
+        }
+        exit(2);
+    }
+
+    // The rest of the client expects blocking I/O
+    fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL) & ~O_NONBLOCK);
+
+    // Pipelined commands are small, so do not let Nagle hold them back
+    int no_delay = 1;
+    setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+    client->connfd = connfd;
+    if (client->use_tls) {
+        start_tls(client);
+    }
+}
+
+int interleave_addresses(struct addrinfo* list, struct addrinfo** ordered, int max_count) {
+    struct addrinfo* preferred = list;
+    struct addrinfo* other = list;
+    int count = 0;
+
+    // RFC 8305 alternates the families so a broken one costs at most one delay per address
+    while (count < max_count && (preferred != NULL || other != NULL)) {
+        while (preferred != NULL && preferred->ai_family != list->ai_family) {
+            preferred = preferred->ai_next;
+        }
+        if (preferred != NULL) {
+            ordered[count++] = preferred;
+            preferred = preferred->ai_next;
+        }
+
+        while (other != NULL && other->ai_family == list->ai_family) {
+            other = other->ai_next;
+        }
+        if (other != NULL && count < max_count) {
+            ordered[count++] = other;
+            other = other->ai_next;
+        }
+    }
+    return count;
+}
+
+int start_connect(struct addrinfo* address) {
+    int connfd = socket(address->ai_family, address->ai_socktype | SOCK_NONBLOCK, address->ai_protocol);
+
+    if (connfd < 0) {
+        return -1;
+    }
+    if (connect(connfd, address->ai_addr, address->ai_addrlen) < 0 && errno != EINPROGRESS) {
+        close(connfd);
+        return -1;
+    }
+    return connfd;
+}
+
+long long get_time_ms() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void start_tls(client_t* client) {
+    SSL* tls = create_tls(client);
+
+    if (SSL_connect(tls) != 1) {
+        long verify_result = SSL_get_verify_result(tls);
+        if (verify_result != X509_V_OK) {
+            fprintf(stderr, "TLS handshake failure: %s\n", X509_verify_cert_error_string(verify_result));
+        } else {
+            fprintf(stderr, "TLS handshake failure\n");
+        }
+        exit(2);
+    }
+
+    client->tls = tls;
+    client->transport = &tls_transport;
+}
+
+SSL* create_tls(client_t* client) {
+    SSL* tls = SSL_new(get_tls_context());
+    struct in6_addr address;
+
+    if (tls == NULL || SSL_set_fd(tls, client->connfd) != 1) {
+        fprintf(stderr, "Failed to set up TLS\n");
+        exit(2);
+    }
+
+    // The certificate has to name the server, SNI is only sent for host names
+    if (inet_pton(AF_INET, client->server_name, &address) != 1 && inet_pton(AF_INET6, client->server_name, &address) != 1) {
+        SSL_set_tlsext_host_name(tls, client->server_name);
+    }
+    SSL_set_hostflags(tls, X509_CHECK_FLAG_NO_PARTIAL_WILDCARDS);
+    SSL_set1_host(tls, client->server_name);
+    SSL_set_app_data(tls, client);
+
+    // A saved session skips the certificate exchange, the server falls back to a full handshake if it forgot it
+    SSL_SESSION* session = load_tls_session(client);
+    if (session != NULL) {
+        SSL_set_session(tls, session);
+        SSL_SESSION_free(session);
+    }
+    return tls;
+}
+
+SSL_CTX* get_tls_context() {
+    static SSL_CTX* context = NULL;
+
+    // The main session connects before any worker starts, so the context is made before there are threads
+    if (context != NULL) {
+        return context;
+    }
+
+    context = SSL_CTX_new(TLS_client_method());
+    if (context == NULL) {
+        fprintf(stderr, "Failed to set up TLS\n");
+        exit(2);
+    }
+    SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+    SSL_CTX_set_verify(context, SSL_VERIFY_PEER, NULL);
+    SSL_CTX_set_default_verify_paths(context);
+
+    // A server closing without close_notify reads as a plain disconnect
+    SSL_CTX_set_options(context, SSL_OP_IGNORE_UNEXPECTED_EOF);
+
+    // Sessions are only kept on disk, each one reaches the callback as the server issues it
+    SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(context, save_tls_session);
+    return context;
+}
+
+int get_tls_session_path(client_t* client, char* path, int path_size) {
+    char directory[PATH_MAX];
+    char server_name[FOLDER_SIZE];
+
+    // Sessions go with the other caches, or in the home directory when there is no cache directory
+    if (client->cache_dir != NULL) {
+        snprintf(directory, sizeof(directory), "%s", client->cache_dir);
+    } else if (getenv("HOME") != NULL) {
+        snprintf(directory, sizeof(directory), "%s/%s", getenv("HOME"), TLS_SESSION_DIR);
+    } else {
+        return 0;
+    }
+    if (mkdir(directory, 0700) < 0 && errno != EEXIST) {
+        return 0;
+    }
+
+    escape_file_name(client->server_name, server_name, sizeof(server_name));
+    snprintf(path, path_size, "%s/%s%s", directory, server_name, TLS_SESSION_EXTENSION);
+    return 1;
+}
+
+SSL_SESSION* load_tls_session(client_t* client) {
+    unsigned char buffer[TLS_SESSION_MAX_SIZE];
+    char path[PATH_MAX];
+    FILE* file;
+
+    if (!get_tls_session_path(client, path, sizeof(path)) || (file = fopen(path, "rb")) == NULL) {
+        return NULL;
+    }
+    int size = fread(buffer, 1, sizeof(buffer), file);
+    fclose(file);
+
+    // A damaged or expired session is ignored and replaced after the full handshake
+    const unsigned char* data = buffer;
+    SSL_SESSION* session = d2i_SSL_SESSION(NULL, &data, size);
+    if (session != NULL && !SSL_SESSION_is_resumable(session)) {
+        SSL_SESSION_free(session);
+        session = NULL;
+    }
+    return session;
+}
+
+int save_tls_session(SSL* tls, SSL_SESSION* session) {
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    unsigned char buffer[TLS_SESSION_MAX_SIZE];
+    unsigned char* data = buffer;
+    char path[PATH_MAX];
+    char temp_path[PATH_MAX + 16];
+    client_t* client = (client_t*)SSL_get_app_data(tls);
+
+    int size = i2d_SSL_SESSION(session, NULL);
+    if (size <= 0 || size > (int)sizeof(buffer) || !get_tls_session_path(client, path, sizeof(path))) {
+        return 0;
+    }
+    i2d_SSL_SESSION(session, &data);
+
+    // The session holds key material, and is renamed into place so other runs never read half of it
+    pthread_mutex_lock(&lock);
+    snprintf(temp_path, sizeof(temp_path), "%s.%d", path, (int)getpid());
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd >= 0) {
+        if (write(fd, buffer, size) == size && close(fd) == 0) {
+            rename(temp_path, path);
+        } else {
+            close(fd);
+            unlink(temp_path);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    // The library keeps its own reference
+    return 0;
+}
+
+int plain_receive(client_t* client, char* buffer, int len) {
+    return recv(client->connfd, buffer, len, 0);
+}
+
+int plain_send(client_t* client, char* buffer, int len) {
+    return send(client->connfd, buffer, len, 0);
+}
+
+void plain_close(client_t* client) {
+    close(client->connfd);
+}
+
+int tls_receive(client_t* client, char* buffer, int len) {
+    int received = SSL_read(client->tls, buffer, len);
+
+    if (received > 0) {
+        return received;
+    }
+    return SSL_get_error(client->tls, received) == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+}
+
+int tls_send(client_t* client, char* buffer, int len) {
+    int sent = SSL_write(client->tls, buffer, len);
+    return sent > 0 ? sent : -1;
+}
+
+void tls_close(client_t* client) {
+    SSL_shutdown(client->tls);
+    SSL_free(client->tls);
+    client->tls = NULL;
+    close(client->connfd);
+}
+
+void start_compress(client_t* client) {
+    reader_t* reader = &client->reader;
+
+    // COMPRESS has to be the only command in flight, and the capabilities after login are the ones that count
+    wait_all_commands(client);
+    if (client->capabilities == NULL) {
+        send_command(client, "CAPABILITY", NULL, NULL);
+        wait_all_commands(client);
+    }
+    if (!has_capability(client, "COMPRESS=DEFLATE")) {
+        return;
+    }
+
+    // A refusal, such as compression already done by TLS, leaves the connection as it is
+    if (wait_command(client, send_command(client, "COMPRESS DEFLATE", NULL, NULL)) != RESPONSE_OK) {
+        return;
+    }
+
+    compress_t* compress = (compress_t*)allocate(sizeof(compress_t));
+    memset(&compress->inflater, 0, sizeof(z_stream));
+    memset(&compress->deflater, 0, sizeof(z_stream));
+    if (inflateInit2(&compress->inflater, -MAX_WBITS) != Z_OK
+            || deflateInit2(&compress->deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        fprintf(stderr, "Failed to set up compression\n");
+        exit(EXIT_FAILURE);
+    }
+    compress->carrier = client->transport;
+    compress->wire_received = 0;
+    compress->decoded_received = 0;
+    compress->wire_sent = 0;
+    compress->encoded_sent = 0;
+
+    // Everything after the tagged OK is compressed, including what was read along with it
+    int buffered = reader->end - reader->start;
+    memcpy(compress->input, reader->buffer + reader->start, buffered);
+    compress->inflater.next_in = compress->input;
+    compress->inflater.avail_in = buffered;
+    compress->wire_received = buffered;
+    reader->start = reader->end;
+
+    client->compress = compress;
+    client->transport = &compress_transport;
+}
+
+int compress_receive(client_t* client, char* buffer, int len) {
+    compress_t* compress = client->compress;
+    z_stream* inflater = &compress->inflater;
+
+    inflater->next_out = (unsigned char*)buffer;
+    inflater->avail_out = len;
+
+    // Inflate goes first as it may hold output from the last call, and a packet may carry no output at all
+    while (1) {
+        int status = inflate(inflater, Z_SYNC_FLUSH);
+        if (status != Z_OK && status != Z_BUF_ERROR) {
+            return -1;
+        }
+        if (inflater->avail_out < (unsigned int)len) {
+            break;
+        }
+        if (inflater->avail_in > 0) {
+            return -1;
+        }
+
+        int received = compress->carrier->receive(client, (char*)compress->input, sizeof(compress->input));
+        if (received <= 0) {
+            return received;
+        }
+        compress->wire_received += received;
+        inflater->next_in = compress->input;
+        inflater->avail_in = received;
+    }
+
+    int produced = len - inflater->avail_out;
+    compress->decoded_received += produced;
+    return produced;
+}
+
+int compress_send(client_t* client, char* buffer, int len) {
+    compress_t* compress = client->compress;
+    z_stream* deflater = &compress->deflater;
+
+    deflater->next_in = (unsigned char*)buffer;
+    deflater->avail_in = len;
+
+    // Each send is flushed, as the server has to see the whole command before it answers
+    do {
+        deflater->next_out = compress->output;
+        deflater->avail_out = sizeof(compress->output);
+        if (deflate(deflater, Z_SYNC_FLUSH) == Z_STREAM_ERROR) {
+            return -1;
+        }
+
+        int produced = sizeof(compress->output) - deflater->avail_out;
+        for (int sent_total = 0; sent_total < produced; ) {
+            int sent = compress->carrier->send(client, (char*)compress->output + sent_total, produced - sent_total);
+            if (sent <= 0) {
+                return -1;
+            }
+            sent_total += sent;
+        }
+        compress->wire_sent += produced;
+    } while (deflater->avail_out == 0);
+
+    compress->encoded_sent += len;
+    return len;
+}
+
+void compress_close(client_t* client) {
+    compress_t* compress = client->compress;
+
+    if (getenv(COMPRESS_STATS_VARIABLE) != NULL) {
+        fprintf(stderr, "Compression: received %llu bytes for %llu decoded, sent %llu bytes for %llu\n",
+                compress->wire_received, compress->decoded_received, compress->wire_sent, compress->encoded_sent);
+    }
+    inflateEnd(&compress->inflater);
+    deflateEnd(&compress->deflater);
+    client->transport = compress->carrier;
+    client->compress = NULL;
+    free(compress);
+    client->transport->close(client);
+}
+
+int send_data(client_t* client, char* data, int len) {
+    int total_sent = 0;
+
+    // A socket may take only part of the bytes at once
+    while (total_sent < len) {
+        int sent = client->transport->send(client, data + total_sent, len - total_sent);
+        if (sent <= 0) {
+            return -1;
+        }
+        total_sent += sent;
+    }
+    return 0;
+}
+
+void check_connection(client_t* client) {
+    char* line = read_line(client);
+
+    if (strncasecmp(line, CONNECT_RESPONSE, strlen(CONNECT_RESPONSE)) != 0) {
+        fprintf(stderr, "Connect failure\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // The greeting may already list the capabilities
+    handle_untagged(client, line);
+}
+
+void login_imap(client_t* client) {
+    char command[BUFFER_SIZE];
+
+    // Generate login command, the result is checked once the response arrives
+    snprintf(command, sizeof(command), "LOGIN %s %s", client->username, client->password);
+    send_command(client, command, login_complete, NULL);
+}
+
+void login_complete(client_t* client, int status, void* context) {
+    if (status != RESPONSE_OK) {
+        printf("Login failure\n");
+        exit(3);
+    }
+}
+
+void select_folder(client_t* client) {
+    char command[BUFFER_SIZE];
+    char escaped_folder[FOLDER_SIZE];
+
+    // Generate select command
+    escape_special_char(client->folder, escaped_folder, FOLDER_SIZE);
+    if (strchr(client->folder, ' ') != NULL || strchr(client->folder, '"') != NULL) {
+        snprintf(command, sizeof(command), "SELECT \"%s\"", escaped_folder);
+    } else {
+        snprintf(command, sizeof(command), "SELECT %s", escaped_folder);
+    }
+    if (client->select_options != NULL) {
+        snprintf(command + strlen(command), sizeof(command) - strlen(command), " %s", client->select_options);
+    }
+
+    // Send select command, it may overlap with the login and the command after it
+    send_command(client, command, select_complete, NULL);
+}
+
+void select_complete(client_t* client, int status, void* context) {
+    if (status != RESPONSE_OK) {
+        printf("Folder not found\n");
+        exit(3);
+    }
+}
+
+void escape_special_char(char *input, char *output, int output_size) {
+    int j = 0;
+
+    for (int i = 0; i < strlen(input) && j < output_size - 1; i++) {
+        if (input[i] == '"' || input[i] == '\\') {
+            if (j < output_size - 2) {
+                output[j++] = '\\';
+            } else {
+                break;
+            }
+        }
+        output[j++] = input[i];
+    }
+    output[j] = '\0'; // Null-terminate
+}
+
+void fill_buffer(client_t* client) {
+    reader_t* reader = &client->reader;
+    int bytes_received;
+
+    // Only refill once every buffered byte has been consumed
+    if (reader->start < reader->end) {
+        return;
+    }
+
+    bytes_received = client->transport->receive(client, reader->buffer, sizeof(reader->buffer));
+    if (bytes_received < 0) {
+        fprintf(stderr, "Failed to receive response\n");
+        exit(3);
+    }
+    if (bytes_received == 0) {
+        fprintf(stderr, "Unexpected disconnect from server\n");
+        exit(3);
+    }
+
+    reader->start = 0;
+    reader->end = bytes_received;
+}
+
+char* read_line(client_t* client) {
+    reader_t* reader = &client->reader;
+    int line_len = 0;
+    int literal_size;
+
+    // The previous handler did not want its literal
+    if (reader->literal_remaining > 0) {
+        skip_literal(client);
+    }
+    reader->continued = reader->literal_announced;
+
+    while (1) {
+        fill_buffer(client);
+
+        char* chunk_start = reader->buffer + reader->start;
+        int available = reader->end - reader->start;
+        char* newline = memchr(chunk_start, '\n', available);
+        int chunk_len = newline ? newline - chunk_start + 1 : available;
+
+        // Grow the line so long responses are never truncated
+        if (line_len + chunk_len + 1 > reader->line_size) {
+            int new_size = reader->line_size ? reader->line_size : LINE_INITIAL_SIZE;
+            while (new_size < line_len + chunk_len + 1) {
+                new_size *= 2;
+            }
+            reader->line = (char*)reallocate(reader->line, new_size);
+            reader->line_size = new_size;
+        }
+
+        memcpy(reader->line + line_len, chunk_start, chunk_len);
+        line_len += chunk_len;
+        reader->start += chunk_len;
+        if (newline) {
+            break;
+        }
+    }
+
+    // Remove the \r\n
+    while (line_len > 0 && (reader->line[line_len - 1] == '\n' || reader->line[line_len - 1] == '\r')) {
+        line_len--;
+    }
+    reader->line[line_len] = '\0';
+
+    literal_size = get_literal_size(reader->line);
+    if (literal_size == LITERAL_TOO_LARGE) {
+        fprintf(stderr, "Literal too large\n");
+        exit(3);
+    }
+    reader->literal_announced = literal_size >= 0;
+    reader->literal_remaining = literal_size > 0 ? literal_size : 0;
+    return reader->line;
+}
+
+int get_literal_size(char* line) {
+    int line_len = strlen(line);
+    int literal_size = 0;
+    int i = line_len - 1;
+
+    if (i < 0 || line[i] != '}') {
+        return -1;
+    }
+    i--;
+
+    // Non-synchronizing literals end with {N+}
+    if (i >= 0 && line[i] == '+') {
+        i--;
+    }
+
+    if (i < 0 || line[i] < '0' || line[i] > '9') {
+        return -1;
+    }
+    while (i >= 0 && line[i] >= '0' && line[i] <= '9') {
+        i--;
+    }
+    if (i < 0 || line[i] != '{') {
+        return -1;
+    }
+
+    // A size that does not fit an int can only come from a broken or hostile server
+    for (char* digit = line + i + 1; *digit >= '0' && *digit <= '9'; digit++) {
+        if (literal_size > (INT_MAX - (*digit - '0')) / 10) {
+            return LITERAL_TOO_LARGE;
+        }
+        literal_size = literal_size * 10 + (*digit - '0');
+    }
+    return literal_size;
+}
+
+void read_literal(client_t* client, char* destination, int literal_size) {
+    reader_t* reader = &client->reader;
+    int total_received = 0;
+
+    while (total_received < literal_size) {
+        fill_buffer(client);
+
+        int chunk_len = reader->end - reader->start;
+        if (chunk_len > literal_size - total_received) {
+            chunk_len = literal_size - total_received;
+        }
+        memcpy(destination + total_received, reader->buffer + reader->start, chunk_len);
+        reader->start += chunk_len;
+        total_received += chunk_len;
+    }
+    reader->literal_remaining -= literal_size;
+}
+
+void write_literal(client_t* client, FILE* output, int literal_size) {
+    reader_t* reader = &client->reader;
+    int buffered_len = reader->end - reader->start;
+
+    // Write what is already buffered, then stream the rest straight from the socket
+    if (buffered_len > literal_size) {
+        buffered_len = literal_size;
+    }
+    if (fwrite(reader->buffer + reader->start, 1, buffered_len, output) != (size_t)buffered_len) {
+        fprintf(stderr, "Failed to write body content\n");
+        exit(EXIT_FAILURE);
+    }
+    reader->start += buffered_len;
+
+    stream_literal(client, output, literal_size - buffered_len);
+    reader->literal_remaining -= literal_size;
+}
+
+int read_literal_chunk(client_t* client, char* chunk, int max_len) {
+    reader_t* reader = &client->reader;
+    int chunk_len = reader->literal_remaining < max_len ? reader->literal_remaining : max_len;
+
+    if (chunk_len <= 0) {
+        return 0;
+    }
+
+    // Serve the buffered bytes first, larger chunks come straight from the socket
+    if (reader->start < reader->end) {
+        if (chunk_len > reader->end - reader->start) {
+            chunk_len = reader->end - reader->start;
+        }
+        memcpy(chunk, reader->buffer + reader->start, chunk_len);
+        reader->start += chunk_len;
+    } else {
+        chunk_len = client->transport->receive(client, chunk, chunk_len);
+        if (chunk_len <= 0) {
+            fprintf(stderr, "Failed to receive body content\n");
+            exit(3);
+        }
+    }
+
+    reader->literal_remaining -= chunk_len;
+    return chunk_len;
+}
+
+void skip_literal(client_t* client) {
+    reader_t* reader = &client->reader;
+
+    while (reader->literal_remaining > 0) {
+        fill_buffer(client);
+
+        int chunk_len = reader->end - reader->start;
+        if (chunk_len > reader->literal_remaining) {
+            chunk_len = reader->literal_remaining;
+        }
+        reader->start += chunk_len;
+        reader->literal_remaining -= chunk_len;
+    }
+}
+
+int get_tagged_status(char* line, char* tag) {
+    int tag_len = strlen(tag);
+
+    if (strncmp(line, tag, tag_len) != 0 || line[tag_len] != ' ') {
+        return -1;
+    }
+
+    line += tag_len + 1;
+    if (strncasecmp(line, "OK", 2) == 0 && (line[2] == ' ' || line[2] == '\0')) {
+        return RESPONSE_OK;
+    } else if (strncasecmp(line, "NO", 2) == 0 && (line[2] == ' ' || line[2] == '\0')) {
+        return RESPONSE_NO;
+    }
+    return RESPONSE_BAD;
+}
+
+int send_command(client_t* client, char* command, completion_handler_t completion_handler, void* context) {
+    char send_buffer[BUFFER_SIZE];
+    int tag_num = client->tag_counter++;
+    pending_t* pending = &client->pending[tag_num % MAX_PENDING];
+
+    // The slot of the tag is still taken by an old command, so let it finish first
+    if (pending->status == RESPONSE_PENDING) {
+        wait_command(client, pending->tag_num);
+    }
+
+    // Generate tagged command
+    int command_len = snprintf(send_buffer, sizeof(send_buffer), "A%04d %s\r\n", tag_num, command);
+    if (command_len >= (int)sizeof(send_buffer)) {
+        fprintf(stderr, "Command too long\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pending->tag_num = tag_num;
+    pending->status = RESPONSE_PENDING;
+    pending->first_message = 0;
+    pending->last_message = -1;
+    pending->item = NULL;
+    pending->literal_handler = NULL;
+    pending->fetch_handler = NULL;
+    pending->completion_handler = completion_handler;
+    pending->search_handler = NULL;
+    pending->context = context;
+    pending->handled = 0;
+    client->pending_count++;
+
+    // Send command, a literal is only sent once the server asks for it, RFC 3501 7.5
+    char* start = send_buffer;
+    char* end = send_buffer + command_len;
+    while (start < end) {
+        char* literal = strstr(start, "}\r\n");
+        if (literal != NULL && literal + strlen("}\r\n") == end) {
+            literal = NULL;
+        }
+        char* piece_end = literal != NULL ? literal + strlen("}\r\n") : end;
+        if (send_data(client, start, piece_end - start) < 0) {
+            fprintf(stderr, "Failed to send %.*s command\n", (int)strcspn(command, " "), command);
+            exit(EXIT_FAILURE);
+        }
+        start = piece_end;
+
+        // A command the server refused before its literal is complete, the caller sees the tagged response
+        if (literal != NULL) {
+            client->continued = 0;
+            while (!client->continued && pending->tag_num == tag_num && pending->status == RESPONSE_PENDING) {
+                dispatch_response(client);
+            }
+            if (!client->continued) {
+                break;
+            }
+        }
+    }
+    return tag_num;
+}
+
+int send_fetch(client_t* client, char* sequence_set, char* items, char* item, literal_handler_t literal_handler, void* context) {
+    return send_fetch_command(client, "FETCH", sequence_set, items, item, literal_handler, NULL, context);
+}
+
+int send_fetch_command(client_t* client, char* fetch_command, char* sequence_set, char* items, char* item,
+        literal_handler_t literal_handler, fetch_handler_t fetch_handler, void* context) {
+    char command[BUFFER_SIZE];
+
+    // Generate fetch command
+    snprintf(command, sizeof(command), "%s %s %s", fetch_command, sequence_set, items);
+
+    int tag_num = send_command(client, command, NULL, context);
+    pending_t* pending = &client->pending[tag_num % MAX_PENDING];
+
+    // Untagged FETCH responses in this range are routed to the handlers, UIDs can match any message
+    if (strncasecmp(fetch_command, "UID ", strlen("UID ")) == 0) {
+        pending->first_message = 1;
+        pending->last_message = INT_MAX;
+    } else {
+        get_sequence_bounds(sequence_set, &pending->first_message, &pending->last_message);
+    }
+    pending->item = item;
+    pending->literal_handler = literal_handler;
+    pending->fetch_handler = fetch_handler;
+    return tag_num;
+}
+
+int send_search(client_t* client, char* search_command, char* criteria, search_handler_t search_handler, void* context) {
+    char command[BUFFER_SIZE];
+
+    // Generate search command
+    snprintf(command, sizeof(command), "%s %s", search_command, criteria);
+
+    int tag_num = send_command(client, command, NULL, context);
+    client->pending[tag_num % MAX_PENDING].search_handler = search_handler;
+    return tag_num;
+}
+
+void get_sequence_bounds(char* sequence_set, int* first_message, int* last_message) {
+    char* current = sequence_set;
+
+    *first_message = INT_MAX;
+    *last_message = 0;
+
+    while (*current) {
+        int message_num;
+
+        if (*current == '*') {
+            // The last message may be any number, so cover all of them
+            *first_message = 1;
+            message_num = INT_MAX;
+            current++;
+        } else if (*current >= '0' && *current <= '9') {
+            message_num = strtol(current, &current, 10);
+        } else {
+            current++;
+            continue;
+        }
+
+        if (message_num < *first_message) {
+            *first_message = message_num;
+        }
+        if (message_num > *last_message) {
+            *last_message = message_num;
+        }
+    }
+}
+
+pending_t* find_fetch_command(client_t* client, int message_num) {
+    pending_t* oldest = NULL;
+
+    // Servers answer in order, so the oldest matching command owns the response
+    for (int i = 0; i < MAX_PENDING; i++) {
+        pending_t* pending = &client->pending[i];
+        if (pending->status == RESPONSE_PENDING
+                && message_num >= pending->first_message && message_num <= pending->last_message
+                && (oldest == NULL || pending->tag_num < oldest->tag_num)) {
+            oldest = pending;
+        }
+    }
+    return oldest;
+}
+
+pending_t* find_search_command(client_t* client) {
+    pending_t* oldest = NULL;
+
+    for (int i = 0; i < MAX_PENDING; i++) {
+        pending_t* pending = &client->pending[i];
+        if (pending->status == RESPONSE_PENDING && pending->search_handler != NULL
+                && (oldest == NULL || pending->tag_num < oldest->tag_num)) {
+            oldest = pending;
+        }
+    }
+    return oldest;
+}
+
+void dispatch_response(client_t* client) {
+    char* line = read_line(client);
+    int tag_num;
+
+    // Tagged response completes the command in its slot
+    if (sscanf(line, "A%d ", &tag_num) == 1) {
+        pending_t* pending = &client->pending[tag_num % MAX_PENDING];
+        char tag[TAG_SIZE];
+
+        snprintf(tag, sizeof(tag), "A%04d", tag_num);
+        if (pending->tag_num != tag_num || pending->status != RESPONSE_PENDING) {
+            fprintf(stderr, "Unexpected tagged response\n");
+            exit(3);
+        }
+
+        pending->status = get_tagged_status(line, tag);
+        client->pending_count--;
+        save_capabilities(client, line);
+        if (pending->completion_handler != NULL) {
+            pending->completion_handler(client, pending->status, pending->context);
+        }
+        return;
+    }
+
+    // Untagged FETCH data goes to the command that asked for the message
+    int message_num = get_fetch_number(line);
+    pending_t* pending = message_num > 0 ? find_fetch_command(client, message_num) : NULL;
+    if (message_num <= 0) {
+        handle_untagged(client, line);
+    }
+
+    // Lines after a literal continue the same response
+    while (1) {
+        if (pending != NULL && pending->fetch_handler != NULL) {
+            pending->fetch_handler(client, message_num, line, pending->context);
+        }
+        if (pending != NULL && pending->item != NULL && client->reader.literal_announced
+                && client->reader.literal_remaining > 0 && is_fetch_item(line, pending->item)) {
+            pending->literal_handler(client, message_num, client->reader.literal_remaining, pending->context);
+            pending->handled++;
+        }
+        if (!client->reader.literal_announced) {
+            break;
+        }
+        line = read_line(client);
+    }
+}
+
+void handle_untagged(client_t* client, char* line) {
+    int number, keyword_index = 0;
+
+    // A continuation request accepts IDLE or asks for the literal of the command being sent
+    if (line[0] == '+') {
+        client->continued = 1;
+        return;
+    }
+
+    if (sscanf(line, "* %d %n", &number, &keyword_index) == 1 && keyword_index > 0) {
+        if (strncasecmp(line + keyword_index, "EXISTS", strlen("EXISTS")) == 0) {
+            client->exists = number;
+        } else if (strncasecmp(line + keyword_index, "EXPUNGE", strlen("EXPUNGE")) == 0 && client->exists > 0) {
+            client->exists--;
+        }
+        return;
+    }
+
+    if (strncasecmp(line, "* OK [", strlen("* OK [")) == 0) {
+        if (get_response_code(line, "UIDVALIDITY")) {
+            client->uid_validity = get_response_code(line, "UIDVALIDITY");
+        } else if (get_response_code(line, "UIDNEXT")) {
+            client->uid_next = get_response_code(line, "UIDNEXT");
+        } else if (get_response_code(line, "HIGHESTMODSEQ")) {
+            client->highest_modseq = get_response_code(line, "HIGHESTMODSEQ");
+        }
+    }
+
+    // Numbers of a SEARCH response go to the oldest search in flight
+    if (strncasecmp(line, "* SEARCH", strlen("* SEARCH")) == 0) {
+        pending_t* pending = find_search_command(client);
+        char* current = line + strlen("* SEARCH");
+
+        while (pending != NULL && *current == ' ' && current[1] >= '0' && current[1] <= '9') {
+            long search_number = strtol(current + 1, &current, 10);
+            pending->search_handler(client, search_number, pending->context);
+        }
+    }
+
+    // Messages expunged while the client was away, reported because of QRESYNC
+    if (strncasecmp(line, "* VANISHED ", strlen("* VANISHED ")) == 0 && client->list_cache != NULL) {
+        char* uid_set = line + strlen("* VANISHED ");
+        if (strncasecmp(uid_set, "(EARLIER) ", strlen("(EARLIER) ")) == 0) {
+            uid_set += strlen("(EARLIER) ");
+        }
+        remove_cached_uids(client->list_cache, uid_set);
+    }
+
+    save_capabilities(client, line);
+}
+
+void save_capabilities(client_t* client, char* line) {
+    char* start = strcasestr(line, "[CAPABILITY ");
+    int capabilities_len;
+
+    if (start != NULL) {
+        start += strlen("[CAPABILITY ");
+        capabilities_len = strcspn(start, "]");
+    } else if (strncasecmp(line, "* CAPABILITY ", strlen("* CAPABILITY ")) == 0) {
+        start = line + strlen("* CAPABILITY ");
+        capabilities_len = strlen(start);
+    } else {
+        return;
+    }
+
+    free(client->capabilities);
+    client->capabilities = (char*)allocate(capabilities_len + 1);
+    memcpy(client->capabilities, start, capabilities_len);
+    client->capabilities[capabilities_len] = '\0';
+}
+
+int has_capability(client_t* client, char* name) {
+    int name_len = strlen(name);
+    char* current = client->capabilities;
+
+    // The capability must be a whole word, so QRESYNC does not match QRESYNC2
+    while (current != NULL && (current = strcasestr(current, name)) != NULL) {
+        if ((current == client->capabilities || current[-1] == ' ') && (current[name_len] == ' ' || current[name_len] == '\0')) {
+            return 1;
+        }
+        current += name_len;
+    }
+    return 0;
+}
+
+unsigned long long get_response_code(char* line, char* name) {
+    char code[BUFFER_SIZE];
+
+    snprintf(code, sizeof(code), "[%s ", name);
+    char* start = strcasestr(line, code);
+    if (start == NULL) {
+        return 0;
+    }
+    return strtoull(start + strlen(code), NULL, 10);
+}
+
+int wait_command(client_t* client, int tag_num) {
+    pending_t* pending = &client->pending[tag_num % MAX_PENDING];
+
+    while (pending->tag_num == tag_num && pending->status == RESPONSE_PENDING) {
+        dispatch_response(client);
+    }
+    return pending->status;
+}
+
+int wait_fetch(client_t* client, int tag_num) {
+    pending_t* pending = &client->pending[tag_num % MAX_PENDING];
+
+    if (wait_command(client, tag_num) != RESPONSE_OK) {
+        return -1;
+    }
+    return pending->handled;
+}
+
+void wait_all_commands(client_t* client) {
+    while (client->pending_count > 0) {
+        dispatch_response(client);
+    }
+}
+
+int get_fetch_number(char* line) {
+    int message_num, fetch_index = 0;
+
+    // The FETCH keyword is case-insensitive
+    if (sscanf(line, "* %d %n", &message_num, &fetch_index) == 1 && fetch_index > 0
+            && strncasecmp(line + fetch_index, "FETCH (", strlen("FETCH (")) == 0) {
+        return message_num;
+    }
+    return -1;
+}
+
+int is_fetch_item(char* line, char* item) {
+    char* literal_start = strrchr(line, '{');
+    int item_len = strlen(item);
+
+    if (literal_start == NULL || literal_start - line < item_len + 1 || literal_start[-1] != ' ') {
+        return 0;
+    }
+
+    char* item_start = literal_start - 1 - item_len;
+    if (item_start > line && item_start[-1] != ' ' && item_start[-1] != '(') {
+        return 0;
+    }
+    return strncasecmp(item_start, item, item_len) == 0;
+}
+
+long get_fetch_attribute(char* line, char* name) {
+    int name_len = strlen(name);
+    char* current = line;
+
+    // The attribute name is a whole word followed by its number
+    while ((current = strcasestr(current, name)) != NULL) {
+        if (current > line && (current[-1] == ' ' || current[-1] == '(') && current[name_len] == ' '
+                && current[name_len + 1] >= '0' && current[name_len + 1] <= '9') {
+            return strtol(current + name_len + 1, NULL, 10);
+        }
+        current += name_len;
+    }
+    return -1;
+}
+
+void print_literal_handler(client_t* client, int message_num, int literal_size, void* context) {
+    write_literal(client, stdout, literal_size);
+}
+
+void save_literal_handler(client_t* client, int message_num, int literal_size, void* context) {
+    literal_t* literal = (literal_t*)context;
+
+    // Only the first matching literal is kept
+    if (literal->data != NULL) {
+        return;
+    }
+
+    literal->data = (char*)arena_alloc(&client->arena, literal_size + 1);
+    read_literal(client, literal->data, literal_size);
+    literal->data[literal_size] = '\0';
+    literal->size = literal_size;
+}
+
+char* fetch_literal(client_t* client, char* items, char* item, int* literal_size) {
+    literal_t literal = {NULL, 0};
+
+    int tag_num = send_fetch(client, client->message_set, items, item, save_literal_handler, &literal);
+
+    if (wait_fetch(client, tag_num) <= 0) {
+        return NULL;
+    }
+
+    *literal_size = literal.size;
+    return literal.data;
+}
+
+int parse_sequence_set(char* sequence_set, int last_message, range_t** ranges) {
+    int range_count = 0;
+    int range_size = 1;
+    char* current = sequence_set;
+
+    *ranges = (range_t*)allocate(sizeof(range_t) * range_size);
+
+    while (1) {
+        int bounds[2];
+        int bound_count = 0;
+
+        // Read one number or a range of two numbers
+        while (bound_count < 2) {
+            if (*current == '*') {
+                bounds[bound_count++] = last_message;
+                current++;
+            } else if (*current >= '1' && *current <= '9') {
+                long number = strtol(current, &current, 10);
+                bounds[bound_count++] = number > INT_MAX ? INT_MAX : number;
+            } else {
+                return -1;
+            }
+
+            if (*current != ':' || bound_count == 2) {
+                break;
+            }
+            current++;
+        }
+        if (bound_count == 1) {
+            bounds[1] = bounds[0];
+        }
+
+        if (range_count == range_size) {
+            range_size *= 2;
+            *ranges = (range_t*)reallocate(*ranges, sizeof(range_t) * range_size);
+        }
+
+        // A range may be given in either order
+        (*ranges)[range_count].first = bounds[0] < bounds[1] ? bounds[0] : bounds[1];
+        (*ranges)[range_count].last = bounds[0] < bounds[1] ? bounds[1] : bounds[0];
+        range_count++;
+
+        if (*current == '\0') {
+            return range_count;
+        }
+        if (*current != ',') {
+            return -1;
+        }
+        current++;
+    }
+}
+
+int is_single_message(char* sequence_set) {
+    return strchr(sequence_set, ',') == NULL && strchr(sequence_set, ':') == NULL;
+}
+
+void fetch_email(client_t* client) {
+
+    if (client->chunk_size > 0 || client->head_bytes > 0) {
+        fetch_email_partial(client);
+        return;
+    }
+
+    if (!is_single_message(client->message_set)) {
+        fetch_email_set(client);
+        return;
+    }
+
+    if (client->cache_dir != NULL) {
+        message_store_t store;
+        int message_size;
+        char* message = load_stored_message(client, &store, &message_size);
+        if (message == NULL) {
+            printf("Message not found\n");
+            exit(3);
+        }
+        fwrite(message, 1, message_size, stdout);
+        close_message_store(&store);
+        return;
+    }
+
+    // Print the body as it arrives
+    int tag_num = send_fetch(client, client->message_set, "BODY.PEEK[]", "BODY[]", print_literal_handler, NULL);
+
+    if (wait_fetch(client, tag_num) <= 0) {
+        printf("Message not found\n");
+        exit(3);
+    }
+}
+
+void fetch_email_set(client_t* client) {
+    char batch[BUFFER_SIZE / 2];
+    int batch_len = 0;
+    int batch_count = 0;
+    range_t* ranges;
+    retrieve_t retrieve = {client->output_dir, 0};
+    literal_handler_t handler = client->output_dir ? file_message_handler : mbox_message_handler;
+
+    // The number of messages is needed to resolve * and leave out missing messages
+    wait_all_commands(client);
+    int range_count = parse_sequence_set(client->message_set, client->exists > 0 ? client->exists : 1, &ranges);
+
+    if (client->jobs > 1) {
+        fetch_email_parallel(client, ranges, range_count);
+        free(ranges);
+        return;
+    }
+
+    if (client->output_dir && mkdir(client->output_dir, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create output directory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Split the ranges into batches, every batch is one FETCH and many are in flight at once
+    for (int i = 0; i < range_count; i++) {
+        int first = ranges[i].first;
+        int last = ranges[i].last < client->exists ? ranges[i].last : client->exists;
+
+        while (first <= last) {
+            int count = last - first + 1;
+            if (count > RETRIEVE_BATCH_SIZE - batch_count) {
+                count = RETRIEVE_BATCH_SIZE - batch_count;
+            }
+
+            if (count == 1) {
+                batch_len += snprintf(batch + batch_len, sizeof(batch) - batch_len, "%s%d", batch_len ? "," : "", first);
+            } else {
+                batch_len += snprintf(batch + batch_len, sizeof(batch) - batch_len, "%s%d:%d", batch_len ? "," : "", first, first + count - 1);
+            }
+            batch_count += count;
+            first += count;
+
+            // Send the batch once it is full or its sequence set is getting long
+            if (batch_count == RETRIEVE_BATCH_SIZE || batch_len > (int)sizeof(batch) - 2 * MSG_NUM_STR_SIZE - 2) {
+                send_fetch(client, batch, "BODY.PEEK[]", "BODY[]", handler, &retrieve);
+                batch_len = 0;
+                batch_count = 0;
+            }
+        }
+    }
+    if (batch_count > 0) {
+        send_fetch(client, batch, "BODY.PEEK[]", "BODY[]", handler, &retrieve);
+    }
+    free(ranges);
+
+    wait_all_commands(client);
+    fflush(stdout);
+    if (retrieve.written == 0) {
+        printf("Message not found\n");
+        exit(3);
+    }
+}
+
+void fetch_email_partial(client_t* client) {
+    char sequence_set[BUFFER_SIZE / 2];
+    int set_len = 0;
+    range_t* ranges;
+    partial_list_t list = {NULL, 0, 0};
+    resume_journal_t journal;
+
+    if (!is_single_message(client->message_set) && client->output_dir == NULL) {
+        fprintf(stderr, "Partial retrieve of several messages needs an output directory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Missing messages are left out of the set as they are for a whole retrieve
+    wait_all_commands(client);
+    int range_count = parse_sequence_set(client->message_set, client->exists > 0 ? client->exists : 1, &ranges);
+
+    // The UID names the partial file and the size bounds the windows, a long set goes out as several FETCH commands in flight at once
+    for (int i = 0; i < range_count; i++) {
+        int last = ranges[i].last < client->exists ? ranges[i].last : client->exists;
+        if (ranges[i].first > last) {
+            continue;
+        }
+        if (set_len > (int)sizeof(sequence_set) - 2 * MSG_NUM_STR_SIZE - 2) {
+            send_fetch_command(client, "FETCH", sequence_set, "(UID RFC822.SIZE)", NULL, NULL, partial_size_handler, &list);
+            set_len = 0;
+        }
+        set_len += snprintf(sequence_set + set_len, sizeof(sequence_set) - set_len, "%s%d:%d", set_len ? "," : "", ranges[i].first, last);
+    }
+    if (set_len > 0) {
+        send_fetch_command(client, "FETCH", sequence_set, "(UID RFC822.SIZE)", NULL, NULL, partial_size_handler, &list);
+    }
+    free(ranges);
+    wait_all_commands(client);
+
+    if (list.count == 0) {
+        printf("Message not found\n");
+        exit(3);
+    }
+
+    // A preview is not worth resuming
+    int resumable = client->output_dir != NULL && client->head_bytes == 0;
+    if (client->output_dir != NULL && mkdir(client->output_dir, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create output directory\n");
+        exit(EXIT_FAILURE);
+    }
+    if (resumable) {
+        open_resume_journal(&journal, client->output_dir, client->uid_validity);
+    }
+
+    for (int i = 0; i < list.count; i++) {
+        fetch_partial_message(client, &list.messages[i], resumable ? &journal : NULL);
+    }
+
+    if (resumable) {
+        close_resume_journal(&journal);
+    }
+    free(list.messages);
+    fflush(stdout);
+}
+
+void partial_size_handler(client_t* client, int message_num, char* line, void* context) {
+    partial_list_t* list = (partial_list_t*)context;
+    long uid = get_fetch_attribute(line, "UID");
+    long size = get_fetch_attribute(line, "RFC822.SIZE");
+
+    if (uid <= 0 || size < 0) {
+        return;
+    }
+    if (list->count == list->size) {
+        list->size = list->size > 0 ? list->size * 2 : RETRIEVE_BATCH_SIZE;
+        list->messages = (partial_message_t*)reallocate(list->messages, sizeof(partial_message_t) * list->size);
+    }
+    list->messages[list->count].message_num = message_num;
+    list->messages[list->count].uid = uid;
+    list->messages[list->count].size = size;
+    list->count++;
+}
+
+void fetch_partial_message(client_t* client, partial_message_t* message, resume_journal_t* journal) {
+    partial_window_t windows[WORKER_PIPELINE_DEPTH];
+    char path[PATH_MAX], partial_path[PATH_MAX];
+    char items[PARTIAL_ITEM_SIZE * 2];
+    char message_num[MSG_NUM_STR_SIZE + 1];
+    FILE* output = stdout;
+    long offset = 0;
+    long end = client->head_bytes > 0 && client->head_bytes < message->size ? client->head_bytes : message->size;
+    long chunk_size = client->chunk_size > 0 ? client->chunk_size : end;
+
+    snprintf(message_num, sizeof(message_num), "%d", message->message_num);
+    if (client->output_dir != NULL) {
+        snprintf(path, sizeof(path), "%s/%d.eml", client->output_dir, message->message_num);
+        snprintf(partial_path, sizeof(partial_path), "%s/%ld%s", client->output_dir, message->uid, PARTIAL_EXTENSION);
+    }
+
+    // Only the committed part of the file counts, whatever was written after the last record is cut off
+    if (journal != NULL) {
+        journal_record_t* record = find_journal_record(journal, message->uid);
+        struct stat file_stat;
+
+        offset = record != NULL ? record->offset : 0;
+        if (offset > 0 && (stat(partial_path, &file_stat) < 0 || file_stat.st_size < offset)) {
+            offset = 0;
+        }
+        output = fopen(partial_path, offset > 0 ? "r+b" : "wb");
+        if (output == NULL || ftruncate(fileno(output), offset) < 0 || fseek(output, offset, SEEK_SET) < 0) {
+            fprintf(stderr, "Failed to open output file\n");
+            exit(EXIT_FAILURE);
+        }
+    } else if (client->output_dir != NULL) {
+        output = fopen(path, "wb");
+        if (output == NULL) {
+            fprintf(stderr, "Failed to open output file\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Several windows are in flight at once, each one is committed to the journal once it is on disk
+    long next = offset;
+    int sent = 0, done = 0, short_window = 0;
+    while (done < sent || (next < end && !short_window)) {
+        while (sent - done < WORKER_PIPELINE_DEPTH && next < end && !short_window) {
+            partial_window_t* window = &windows[sent % WORKER_PIPELINE_DEPTH];
+            long window_len = end - next < chunk_size ? end - next : chunk_size;
+
+            snprintf(items, sizeof(items), "(BODY.PEEK[]<%ld.%ld>)", next, window_len);
+            snprintf(window->item, sizeof(window->item), "BODY[]<%ld>", next);
+            window->output = output;
+            window->expected = window_len;
+            window->received = 0;
+            window->tag_num = send_fetch(client, message_num, items, window->item, partial_literal_handler, window);
+            next += window_len;
+            sent++;
+        }
+
+        partial_window_t* window = &windows[done++ % WORKER_PIPELINE_DEPTH];
+        if (wait_fetch(client, window->tag_num) < 0) {
+            printf("Message not found\n");
+            exit(3);
+        }
+        if (short_window) {
+            continue;
+        }
+        offset += window->received;
+        if (journal != NULL) {
+            if (fflush(output) != 0 || fdatasync(fileno(output)) < 0) {
+                fprintf(stderr, "Failed to write output file\n");
+                exit(EXIT_FAILURE);
+            }
+            record_journal_offset(journal, message->uid, offset);
+        }
+
+        // The message ended before its RFC822.SIZE, so the windows after it have nothing to add
+        short_window = window->received < window->expected;
+    }
+
+    if (output == stdout) {
+        return;
+    }
+    if (fclose(output) != 0) {
+        fprintf(stderr, "Failed to write output file\n");
+        exit(EXIT_FAILURE);
+    }
+    if (journal != NULL) {
+        if (rename(partial_path, path) < 0) {
+            fprintf(stderr, "Failed to write output file\n");
+            exit(EXIT_FAILURE);
+        }
+        record_journal_offset(journal, message->uid, -1);
+    }
+}
+
+void partial_literal_handler(client_t* client, int message_num, int literal_size, void* context) {
+    partial_window_t* window = (partial_window_t*)context;
+
+    write_literal(client, window->output, literal_size);
+    window->received += literal_size;
+}
+
+void open_resume_journal(resume_journal_t* journal, char* output_dir, unsigned long uid_validity) {
+    char temp_path[PATH_MAX + MSG_NUM_STR_SIZE + 2];
+    char line[BUFFER_SIZE];
+    unsigned long record_validity;
+    long uid, offset;
+
+    snprintf(journal->path, sizeof(journal->path), "%s/%s", output_dir, RESUME_JOURNAL_NAME);
+    journal->uid_validity = uid_validity;
+    journal->records = NULL;
+    journal->count = 0;
+    journal->size = 0;
+
+    // The last record of each UID wins, and the partial files of another UIDVALIDITY can never be resumed
+    FILE* file = fopen(journal->path, "r");
+    while (file != NULL && fgets(line, sizeof(line), file) != NULL) {
+        if (sscanf(line, "%lu %ld %ld", &record_validity, &uid, &offset) != 3) {
+            continue;
+        }
+        if (record_validity != uid_validity) {
+            char partial_path[PATH_MAX];
+            snprintf(partial_path, sizeof(partial_path), "%s/%ld%s", output_dir, uid, PARTIAL_EXTENSION);
+            unlink(partial_path);
+            continue;
+        }
+        record_journal_offset(journal, uid, offset);
+    }
+    if (file != NULL) {
+        fclose(file);
+    }
+
+    // Written back whole so it only grows by the records of the current run
+    snprintf(temp_path, sizeof(temp_path), "%s.%d", journal->path, getpid());
+    file = fopen(temp_path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Failed to write resume journal\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < journal->count; i++) {
+        fprintf(file, "%lu %ld %ld\n", uid_validity, journal->records[i].uid, journal->records[i].offset);
+    }
+    if (fclose(file) != 0 || rename(temp_path, journal->path) < 0) {
+        fprintf(stderr, "Failed to write resume journal\n");
+        exit(EXIT_FAILURE);
+    }
+
+    journal->file = fopen(journal->path, "a");
+    if (journal->file == NULL) {
+        fprintf(stderr, "Failed to write resume journal\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+journal_record_t* find_journal_record(resume_journal_t* journal, long uid) {
+    for (int i = 0; i < journal->count; i++) {
+        if (journal->records[i].uid == uid) {
+            return &journal->records[i];
+        }
+    }
+    return NULL;
+}
+
+void record_journal_offset(resume_journal_t* journal, long uid, long offset) {
+    journal_record_t* record = find_journal_record(journal, uid);
+
+    // Only the partial files still to finish are kept in memory
+    if (offset < 0 && record != NULL) {
+        *record = journal->records[--journal->count];
+    } else if (offset >= 0 && record != NULL) {
+        record->offset = offset;
+    } else if (offset >= 0) {
+        if (journal->count == journal->size) {
+            journal->size = journal->size > 0 ? journal->size * 2 : RETRIEVE_BATCH_SIZE;
+            journal->records = (journal_record_t*)reallocate(journal->records, sizeof(journal_record_t) * journal->size);
+        }
+        journal->records[journal->count].uid = uid;
+        journal->records[journal->count].offset = offset;
+        journal->count++;
+    }
+
+    // A record reaches the disk only after the bytes it counts
+    if (journal->file != NULL) {
+        fprintf(journal->file, "%lu %ld %ld\n", journal->uid_validity, uid, offset);
+        if (fflush(journal->file) != 0 || fdatasync(fileno(journal->file)) < 0) {
+            fprintf(stderr, "Failed to write resume journal\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+void close_resume_journal(resume_journal_t* journal) {
+    fclose(journal->file);
+    free(journal->records);
+}
+
+void file_message_handler(client_t* client, int message_num, int literal_size, void* context) {
+    retrieve_t* retrieve = (retrieve_t*)context;
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/%d.eml", retrieve->output_dir, message_num);
+    FILE* output = fopen(path, "wb");
+    if (output == NULL) {
+        fprintf(stderr, "Failed to open output file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    write_literal(client, output, literal_size);
+    if (fclose(output) != 0) {
+        fprintf(stderr, "Failed to write output file\n");
+        exit(EXIT_FAILURE);
+    }
+    retrieve->written++;
+}
+
+void fetch_email_parallel(client_t* client, range_t* ranges, int range_count) {
+    scheduler_t scheduler;
+    worker_t workers[MAX_JOBS];
+    int tag_num = 0;
+
+    scheduler.client = client;
+    scheduler.worker_count = client->jobs;
+    scheduler.written = 0;
+    scheduler.message_count = client->exists > 0 ? client->exists : 0;
+    scheduler.uids = (int*)allocate(sizeof(int) * (scheduler.message_count + 1));
+    scheduler.queues = (work_queue_t*)allocate(sizeof(work_queue_t) * scheduler.worker_count);
+    memset(scheduler.uids, 0, sizeof(int) * (scheduler.message_count + 1));
+    pthread_mutex_init(&scheduler.written_lock, NULL);
+
+    if (mkdir(client->output_dir, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create output directory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // UIDs keep the workers on the right messages whatever their sessions number them
+    for (int i = 0; i < range_count; i++) {
+        char range[2 * MSG_NUM_STR_SIZE + 2];
+        int last = ranges[i].last < scheduler.message_count ? ranges[i].last : scheduler.message_count;
+
+        if (ranges[i].first <= last) {
+            snprintf(range, sizeof(range), "%d:%d", ranges[i].first, last);
+            tag_num = send_fetch_command(client, "FETCH", range, "(UID)", NULL, NULL, uid_fetch_handler, &scheduler);
+        }
+    }
+    if (tag_num > 0) {
+        wait_fetch(client, tag_num);
+    }
+
+    // Keep only the requested messages, in sequence order
+    int chunk_count = 0;
+    int uid_count = 0;
+    for (int i = 1; i <= scheduler.message_count; i++) {
+        if (scheduler.uids[i] > 0) {
+            scheduler.uids[uid_count++] = scheduler.uids[i];
+        }
+    }
+    scheduler.message_count = uid_count;
+    scheduler.chunk_size = uid_count / (scheduler.worker_count * CHUNKS_PER_WORKER);
+    if (scheduler.chunk_size < 1) {
+        scheduler.chunk_size = 1;
+    } else if (scheduler.chunk_size > MAX_WORK_CHUNK_SIZE) {
+        scheduler.chunk_size = MAX_WORK_CHUNK_SIZE;
+    }
+    chunk_count = (uid_count + scheduler.chunk_size - 1) / scheduler.chunk_size;
+
+    if (uid_count == 0) {
+        printf("Message not found\n");
+        exit(3);
+    }
+
+    // Every worker starts with a contiguous share of the chunks
+    for (int i = 0; i < scheduler.worker_count; i++) {
+        pthread_mutex_init(&scheduler.queues[i].lock, NULL);
+        scheduler.queues[i].head = (long)chunk_count * i / scheduler.worker_count;
+        scheduler.queues[i].tail = (long)chunk_count * (i + 1) / scheduler.worker_count;
+    }
+
+    for (int i = 0; i < scheduler.worker_count; i++) {
+        workers[i].scheduler = &scheduler;
+        workers[i].index = i;
+        if (pthread_create(&workers[i].thread, NULL, retrieve_worker, &workers[i]) != 0) {
+            fprintf(stderr, "Failed to start worker\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < scheduler.worker_count; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    for (int i = 0; i < scheduler.worker_count; i++) {
+        pthread_mutex_destroy(&scheduler.queues[i].lock);
+    }
+    pthread_mutex_destroy(&scheduler.written_lock);
+    free(scheduler.queues);
+    free(scheduler.uids);
+
+    // Messages gone by the time the workers asked for them leave nothing written, as with one session
+    fflush(stdout);
+    if (scheduler.written == 0) {
+        printf("Message not found\n");
+        exit(3);
+    }
+}
+
+void uid_fetch_handler(client_t* client, int message_num, char* line, void* context) {
+    scheduler_t* scheduler = (scheduler_t*)context;
+    long uid = get_fetch_attribute(line, "UID");
+
+    if (uid > 0 && message_num <= scheduler->message_count) {
+        scheduler->uids[message_num] = uid;
+    }
+}
+
+void* retrieve_worker(void* argument) {
+    worker_t* worker = (worker_t*)argument;
+    scheduler_t* scheduler = worker->scheduler;
+    client_t* session = open_session(scheduler->client);
+    retrieve_t retrieve = {scheduler->client->output_dir, 0};
+    int in_flight[WORKER_PIPELINE_DEPTH];
+    int in_flight_count = 0;
+    int chunk;
+
+    // Keep a few chunks in flight so the connection never idles between them
+    while ((chunk = take_chunk(scheduler, worker->index)) >= 0) {
+        char uid_set[BUFFER_SIZE / 2];
+        int first = chunk * scheduler->chunk_size;
+        int last = first + scheduler->chunk_size < scheduler->message_count ? first + scheduler->chunk_size : scheduler->message_count;
+
+        // A chunk of long UIDs may not fit one command, so it goes out in as many sets as it needs
+        for (int i = first; i < last; ) {
+            i = build_uid_set(scheduler->uids, i, last, uid_set, sizeof(uid_set));
+            in_flight[in_flight_count++] = send_fetch_command(session, "UID FETCH", uid_set, "BODY.PEEK[]", "BODY[]", file_message_handler, NULL, &retrieve);
+            if (in_flight_count == WORKER_PIPELINE_DEPTH) {
+                wait_fetch(session, in_flight[0]);
+                memmove(in_flight, in_flight + 1, sizeof(int) * --in_flight_count);
+            }
+        }
+    }
+    wait_all_commands(session);
+
+    pthread_mutex_lock(&scheduler->written_lock);
+    scheduler->written += retrieve.written;
+    pthread_mutex_unlock(&scheduler->written_lock);
+
+    close_session(session);
+    return NULL;
+}
+
+int take_chunk(scheduler_t* scheduler, int index) {
+    work_queue_t* own = &scheduler->queues[index];
+    int chunk = -1;
+
+    pthread_mutex_lock(&own->lock);
+    if (own->head < own->tail) {
+        chunk = own->head++;
+    }
+    pthread_mutex_unlock(&own->lock);
+    if (chunk >= 0) {
+        return chunk;
+    }
+
+    // Steal from the far end of the queue with the most work left
+    while (1) {
+        int victim = -1;
+        int most_left = 0;
+
+        for (int i = 0; i < scheduler->worker_count; i++) {
+            if (i == index) {
+                continue;
+            }
+            pthread_mutex_lock(&scheduler->queues[i].lock);
+            int left = scheduler->queues[i].tail - scheduler->queues[i].head;
+            pthread_mutex_unlock(&scheduler->queues[i].lock);
+            if (left > most_left) {
+                victim = i;
+                most_left = left;
+            }
+        }
+        if (victim < 0) {
+            return -1;
+        }
+
+        work_queue_t* queue = &scheduler->queues[victim];
+        pthread_mutex_lock(&queue->lock);
+        if (queue->head < queue->tail) {
+            chunk = --queue->tail;
+        }
+        pthread_mutex_unlock(&queue->lock);
+        if (chunk >= 0) {
+            return chunk;
+        }
+    }
+}
+
+client_t* open_session(client_t* client) {
+    client_t* session = init_client();
+
+    session->username = client->username;
+    session->password = client->password;
+    session->folder = client->folder;
+    session->use_tls = client->use_tls;
+    session->use_compress = client->use_compress;
+    session->connect_timeout = client->connect_timeout;
+    session->cache_dir = client->cache_dir;
+    session->command = client->command;
+    session->server_name = client->server_name;
+    session->output_dir = client->output_dir;
+
+    connect_server(session);
+    check_connection(session);
+    login_imap(session);
+    if (session->use_compress) {
+        start_compress(session);
+    }
+    select_folder(session);
+    return session;
+}
+
+void close_session(client_t* client) {
+    client->transport->close(client);
+    free(client->reader.line);
+    free(client->capabilities);
+    free_arena(&client->arena);
+    free(client);
+}
+
+int forward_request(client_t* client, int argc, char* argv[]) {
+    char request[DAEMON_REQUEST_SIZE];
+    struct sockaddr_un address;
+    int output_fds[2] = {STDOUT_FILENO, STDERR_FILENO};
+    int status;
+
+    // The key leads the request, then come the arguments, each ending with a NUL
+    get_session_key(client, request, sizeof(request));
+    int request_len = strlen(request) + 1;
+    for (int i = 0; i < argc; i++) {
+        int arg_len = strlen(argv[i]) + 1;
+        if (request_len + arg_len > (int)sizeof(request)) {
+            return DAEMON_BUSY;
+        }
+        memcpy(request + request_len, argv[i], arg_len);
+        request_len += arg_len;
+    }
+
+    // Without a daemon the command runs here as usual
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", client->socket_path);
+    int daemon_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (daemon_fd < 0) {
+        return DAEMON_BUSY;
+    }
+    if (connect(daemon_fd, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+            send_request(daemon_fd, request, request_len, output_fds) < 0) {
+        close(daemon_fd);
+        return DAEMON_BUSY;
+    }
+
+    // The session writes to our stdout and stderr itself, only the exit status comes back
+    // A session that is stuck gives up its client after a deadline, the command then runs here
+    struct pollfd reply = {daemon_fd, POLLIN, 0};
+    int ready;
+    while ((ready = poll(&reply, 1, DAEMON_REPLY_TIMEOUT_MS)) < 0 && errno == EINTR) {
+    }
+    if (ready == 0) {
+        fprintf(stderr, "Daemon did not answer, connecting directly\n");
+        close(daemon_fd);
+        return DAEMON_BUSY;
+    }
+    if (ready < 0 || recv(daemon_fd, &status, sizeof(status), 0) != sizeof(status)) {
+        fprintf(stderr, "Lost connection to the daemon\n");
+        exit(2);
+    }
+    close(daemon_fd);
+    return status;
+}
+
+void get_session_key(client_t* client, char* key, int key_size) {
+
+    // Lengths keep fields with separators in them from running together
+    snprintf(key, key_size, "%d:%zu:%s:%zu:%s:%zu:%s:%zu:%s", client->use_tls, strlen(client->server_name), client->server_name,
+            strlen(client->username), client->username, strlen(client->password), client->password,
+            strlen(client->folder), client->folder);
+}
+
+void run_daemon(client_t* client) {
+    pooled_session_t pool[MAX_POOLED_SESSIONS];
+    struct pollfd fds[2 * MAX_POOLED_SESSIONS + 1];
+    int pool_count = 0;
+    int listen_fd = open_daemon_socket(client->socket_path);
+
+    // A client that went away must not end the daemon
+    signal(SIGPIPE, SIG_IGN);
+
+    while (1) {
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        for (int i = 0; i < pool_count; i++) {
+            fds[i + 1].fd = pool[i].channel;
+            fds[i + 1].events = POLLIN;
+
+            // Only a hang up is watched for on the client, an idle session has none
+            fds[pool_count + i + 1].fd = pool[i].request_fd;
+            fds[pool_count + i + 1].events = 0;
+        }
+        int polled_count = pool_count;
+        if (poll(fds, 2 * polled_count + 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Failed to wait for requests\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // Finished sessions first so the next request can have them, going down keeps removal safe
+        // A client that gave up on its session before it answered leaves it stuck, so it is ended
+        for (int i = polled_count - 1; i >= 0; i--) {
+            if (fds[i + 1].revents != 0) {
+                finish_daemon_request(pool, &pool_count, i);
+            } else if (fds[polled_count + i + 1].revents != 0) {
+                remove_pooled_session(pool, &pool_count, i);
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            int request_fd = accept(listen_fd, NULL, NULL);
+            if (request_fd >= 0) {
+                handle_daemon_request(pool, &pool_count, request_fd);
+            }
+        }
+    }
+}
+
+int open_daemon_socket(char* path) {
+    struct sockaddr_un address;
+
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path too long\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    // A socket left behind by a daemon that is gone is replaced, one that still answers is not
+    int probe_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (probe_fd >= 0 && connect(probe_fd, (struct sockaddr*)&address, sizeof(address)) == 0) {
+        fprintf(stderr, "Daemon already running\n");
+        exit(EXIT_FAILURE);
+    }
+    if (probe_fd >= 0) {
+        close(probe_fd);
+    }
+    unlink(path);
+
+    // Requests carry passwords, so only the owner may connect
+    int listen_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    mode_t old_mask = umask(0077);
+    int bound = listen_fd >= 0 && bind(listen_fd, (struct sockaddr*)&address, sizeof(address)) == 0;
+    umask(old_mask);
+    if (!bound || listen(listen_fd, SOMAXCONN) < 0) {
+        fprintf(stderr, "Failed to open daemon socket\n");
+        exit(EXIT_FAILURE);
+    }
+    return listen_fd;
+}
+
+void handle_daemon_request(pooled_session_t* pool, int* pool_count, int request_fd) {
+    char request[DAEMON_REQUEST_SIZE];
+    int output_fds[2];
+    int status = DAEMON_BUSY;
+    pooled_session_t* session = NULL;
+
+    int request_len = receive_request(request_fd, request, sizeof(request), output_fds);
+    if (request_len < 0) {
+        close(request_fd);
+        return;
+    }
+
+    // The key is the first string of the request
+    for (int i = 0; i < *pool_count && session == NULL; i++) {
+        if (pool[i].request_fd < 0 && strcmp(pool[i].key, request) == 0) {
+            session = &pool[i];
+        }
+    }
+
+    // A full pool gives up an idle session of another key, with none idle the client runs the command itself
+    for (int i = 0; i < *pool_count && session == NULL && *pool_count == MAX_POOLED_SESSIONS; i++) {
+        if (pool[i].request_fd < 0) {
+            remove_pooled_session(pool, pool_count, i);
+        }
+    }
+    if (session == NULL && *pool_count < MAX_POOLED_SESSIONS && start_pooled_session(&pool[*pool_count], request) == 0) {
+        session = &pool[(*pool_count)++];
+    }
+
+    if (session != NULL && send_request(session->channel, request, request_len, output_fds) == 0) {
+        session->request_fd = request_fd;
+    } else {
+        send(request_fd, &status, sizeof(status), MSG_NOSIGNAL);
+        close(request_fd);
+    }
+    close(output_fds[0]);
+    close(output_fds[1]);
+}
+
+int start_pooled_session(pooled_session_t* session, char* key) {
+    int channels[2];
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, channels) < 0) {
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(channels[0]);
+        close(channels[1]);
+        return -1;
+    }
+    if (pid == 0) {
+
+        // Descriptors of other clients would keep their output open, only the channel is kept
+        close_range(3, channels[1] - 1, 0);
+        close_range(channels[1] + 1, ~0U, 0);
+        run_session_process(channels[1]);
+    }
+
+    close(channels[1]);
+    session->pid = pid;
+    session->channel = channels[0];
+    session->key = (char*)allocate(strlen(key) + 1);
+    strcpy(session->key, key);
+    session->request_fd = -1;
+    return 0;
+}
+
+void finish_daemon_request(pooled_session_t* pool, int* pool_count, int index) {
+    pooled_session_t* session = &pool[index];
+    int status;
+
+    // A process that ended took its session with it, its exit code is the outcome of the request
+    if (recv(session->channel, &status, sizeof(status), 0) != sizeof(status)) {
+        int process_status;
+        waitpid(session->pid, &process_status, 0);
+        status = WIFEXITED(process_status) ? WEXITSTATUS(process_status) : 128 + WTERMSIG(process_status);
+        close(session->channel);
+        free(session->key);
+        if (session->request_fd >= 0) {
+            send(session->request_fd, &status, sizeof(status), MSG_NOSIGNAL);
+            close(session->request_fd);
+        }
+        *session = pool[--*pool_count];
+        return;
+    }
+
+    if (session->request_fd >= 0) {
+        send(session->request_fd, &status, sizeof(status), MSG_NOSIGNAL);
+        close(session->request_fd);
+        session->request_fd = -1;
+    }
+}
+
+void remove_pooled_session(pooled_session_t* pool, int* pool_count, int index) {
+    pooled_session_t* session = &pool[index];
+
+    // A session given up while busy may be stopped, only SIGKILL is sure to end it and release the output of its client
+    kill(session->pid, session->request_fd >= 0 ? SIGKILL : SIGTERM);
+    waitpid(session->pid, NULL, 0);
+    close(session->channel);
+    if (session->request_fd >= 0) {
+        close(session->request_fd);
+    }
+    free(session->key);
+    *session = pool[--*pool_count];
+}
+
+void run_session_process(int channel) {
+    client_t* session = NULL;
+    char* session_request = NULL;           // Request the session took its key fields from
+    int null_fd = open("/dev/null", O_WRONLY);
+
+    // The commands behave as they would in a process of their own
+    signal(SIGPIPE, SIG_DFL);
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+
+    while (1) {
+        struct pollfd fds[2] = {{channel, POLLIN, 0}, {session != NULL ? session->connfd : -1, POLLIN, 0}};
+        int ready = poll(fds, 2, session != NULL ? KEEPALIVE_INTERVAL_MS : -1);
+        if (ready < 0 && errno != EINTR) {
+            exit(EXIT_FAILURE);
+        }
+
+        // A NOOP keeps the server from logging the session out
+        if (session != NULL && ready == 0) {
+            send_command(session, "NOOP", NULL, NULL);
+            wait_all_commands(session);
+            continue;
+        }
+
+        // An idle server only speaks to say goodbye or to close, so the next request gets a new session
+        if (session != NULL && fds[1].revents != 0) {
+            signal(SIGPIPE, SIG_IGN);
+            close_session(session);
+            signal(SIGPIPE, SIG_DFL);
+            free(session_request);
+            session = NULL;
+            session_request = NULL;
+            continue;
+        }
+        if (ready <= 0 || fds[0].revents == 0) {
+            continue;
+        }
+
+        char* request = (char*)allocate(DAEMON_REQUEST_SIZE);
+        char* args[DAEMON_MAX_ARGS];
+        int output_fds[2];
+        int request_len = receive_request(channel, request, DAEMON_REQUEST_SIZE, output_fds);
+        if (request_len < 0) {
+            exit(EXIT_SUCCESS);
+        }
+        dup2(output_fds[0], STDOUT_FILENO);
+        dup2(output_fds[1], STDERR_FILENO);
+        close(output_fds[0]);
+        close(output_fds[1]);
+
+        // Every failure reaches the client as it would without the daemon and ends this process with its
+        // session, the daemon relays the exit status and the next request for the key opens a fresh one
+        int arg_count = split_request(request, request_len, args, DAEMON_MAX_ARGS);
+        if (arg_count < 2) {
+            fprintf(stderr, "Invalid command line input\n");
+            exit(EXIT_FAILURE);
+        }
+        client_t* settings = init_client();
+        optind = 0;
+        parse_command_line(arg_count - 1, args + 1, settings);
+
+        int list_cache = settings->cache_dir != NULL && strcmp(settings->command, "list") == 0 && !has_list_filter(settings);
+        if (session == NULL) {
+            session = settings;
+            session_request = request;
+            connect_server(session);
+            check_connection(session);
+            login_imap(session);
+            if (session->use_compress) {
+                start_compress(session);
+            }
+        } else {
+            session->command = settings->command;
+            session->message_set = settings->message_set;
+            session->output_dir = settings->output_dir;
+            session->cache_dir = settings->cache_dir;
+            session->jobs = settings->jobs;
+            session->decode = settings->decode;
+            session->filter = settings->filter;
+            session->chunk_size = settings->chunk_size;
+            session->head_bytes = settings->head_bytes;
+            session->connect_timeout = settings->connect_timeout;
+            free(settings);
+        }
+
+        // The list cache needs its own SELECT, anything else only has to see the changes since the last request
+        if (list_cache) {
+            open_list_cache(session);
+        }
+        if (list_cache || session_request == request) {
+            select_folder(session);
+        } else {
+            send_command(session, "NOOP", NULL, NULL);
+        }
+        run_command(session);
+        wait_all_commands(session);
+
+        fflush(stdout);
+        fflush(stderr);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        if (request != session_request) {
+            free(request);
+        }
+
+        int status = EXIT_SUCCESS;
+        if (send(channel, &status, sizeof(status), 0) != sizeof(status)) {
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+int send_request(int socket_fd, char* request, int request_len, int* output_fds) {
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec data = {request, request_len};
+    struct msghdr message;
+
+    memset(&message, 0, sizeof(message));
+    memset(control, 0, sizeof(control));
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    // The descriptors travel with the request, so the session writes straight to the client
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(2 * sizeof(int));
+    memcpy(CMSG_DATA(header), output_fds, 2 * sizeof(int));
+    return sendmsg(socket_fd, &message, MSG_NOSIGNAL) == request_len ? 0 : -1;
+}
+
+int receive_request(int socket_fd, char* buffer, int buffer_size, int* output_fds) {
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec data = {buffer, buffer_size};
+    struct msghdr message;
+
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    int request_len = recvmsg(socket_fd, &message, MSG_CMSG_CLOEXEC);
+    struct cmsghdr* header = request_len > 0 ? CMSG_FIRSTHDR(&message) : NULL;
+    int has_fds = header != NULL && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS &&
+            header->cmsg_len == CMSG_LEN(2 * sizeof(int));
+    if (has_fds) {
+        memcpy(output_fds, CMSG_DATA(header), 2 * sizeof(int));
+    }
+
+    // A request must be whole, end with a NUL and come with both descriptors
+    if (!has_fds || (message.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || buffer[request_len - 1] != '\0') {
+        if (has_fds) {
+            close(output_fds[0]);
+            close(output_fds[1]);
+        }
+        return -1;
+    }
+    return request_len;
+}
+
+int split_request(char* request, int request_len, char** args, int max_args) {
+    int count = 0;
+
+    for (char* arg = request; arg < request + request_len; arg += strlen(arg) + 1) {
+        if (count == max_args) {
+            return -1;
+        }
+        args[count++] = arg;
+    }
+    return count;
+}
+
+void poll_accounts(client_t* client) {
+    poll_engine_t engine;
+    struct epoll_event events[POLL_MAX_EVENTS];
+
+    engine.settings = client;
+    engine.finished = 0;
+    engine.status = 0;
+    load_accounts(&engine, client->accounts_path);
+    raise_file_limit();
+
+    // A server closing early must not end the run for every other account
+    signal(SIGPIPE, SIG_IGN);
+
+    engine.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (engine.epoll_fd < 0) {
+        fprintf(stderr, "Failed to create event loop\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Only the connection limit of each server is active at once, so memory follows the limit and not the account count
+    for (int i = 0; i < engine.server_count; i++) {
+        start_waiting_accounts(&engine, i);
+    }
+
+    long long next_check = get_time_ms() + POLL_TICK_MS;
+    while (engine.finished < engine.account_count) {
+        int ready = epoll_wait(engine.epoll_fd, events, POLL_MAX_EVENTS, POLL_TICK_MS);
+        if (ready < 0 && errno != EINTR) {
+            fprintf(stderr, "Failed to wait for events\n");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < ready; i++) {
+            account_t* account = (account_t*)events[i].data.ptr;
+
+            // An account finished earlier in the batch may still have events in it
+            if (account->client == NULL) {
+                continue;
+            }
+            drive_account(&engine, account);
+            if (account->client == NULL) {
+                start_waiting_accounts(&engine, account->server);
+            }
+        }
+
+        if (get_time_ms() >= next_check) {
+            check_account_deadlines(&engine);
+            next_check = get_time_ms() + POLL_TICK_MS;
+        }
+    }
+
+    fflush(stdout);
+    close(engine.epoll_fd);
+    for (int i = 0; i < engine.server_count; i++) {
+        if (engine.servers[i].addresses != NULL) {
+            freeaddrinfo(engine.servers[i].addresses);
+        }
+    }
+    free(engine.servers);
+    free(engine.accounts);
+    free(engine.file_data);
+    if (engine.status != 0) {
+        exit(engine.status);
+    }
+}
+
+void load_accounts(poll_engine_t* engine, char* path) {
+    struct stat file_stat;
+    int line_count = 1, line_num = 0;
+    FILE* file = fopen(path, "r");
+
+    if (file == NULL || fstat(fileno(file), &file_stat) < 0) {
+        fprintf(stderr, "Failed to open accounts file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // The whole file stays in memory and the fields are cut out of it in place
+    engine->file_data = (char*)allocate(file_stat.st_size + 1);
+    size_t file_size = fread(engine->file_data, 1, file_stat.st_size, file);
+    engine->file_data[file_size] = '\0';
+    fclose(file);
+
+    for (size_t i = 0; i < file_size; i++) {
+        line_count += engine->file_data[i] == '\n';
+    }
+    engine->accounts = (account_t*)allocate(line_count * sizeof(account_t));
+    engine->servers = (server_t*)allocate(line_count * sizeof(server_t));
+    engine->account_count = 0;
+    engine->server_count = 0;
+
+    // Each line is server, username, password and an optional folder, blank lines and # comments are skipped
+    char* line = engine->file_data;
+    while (line != NULL) {
+        char* fields[5];
+        int field_count = 0;
+        char* line_end = strchr(line, '\n');
+        char* save;
+
+        if (line_end != NULL) {
+            *line_end = '\0';
+        }
+        line_num++;
+        for (char* field = strtok_r(line, " \t\r", &save); field != NULL && field_count < 5; field = strtok_r(NULL, " \t\r", &save)) {
+            fields[field_count++] = field;
+        }
+        line = line_end != NULL ? line_end + 1 : NULL;
+        if (field_count == 0 || fields[0][0] == '#') {
+            continue;
+        }
+        if (field_count < 3 || field_count > 4) {
+            fprintf(stderr, "Invalid account on line %d\n", line_num);
+            exit(EXIT_FAILURE);
+        }
+
+        int index = engine->account_count++;
+        account_t* account = &engine->accounts[index];
+        account->server = find_server(engine, fields[0]);
+        account->username = fields[1];
+        account->password = fields[2];
+        account->folder = field_count == 4 ? fields[3] : engine->settings->folder;
+        account->next_waiting = -1;
+        account->state = ACCOUNT_WAITING;
+        account->events = 0;
+        account->client = NULL;
+        account->output = NULL;
+        account->output_len = 0;
+        account->output_sent = 0;
+
+        // Accounts start in the order of the file
+        server_t* server = &engine->servers[account->server];
+        if (server->last_waiting >= 0) {
+            engine->accounts[server->last_waiting].next_waiting = index;
+        } else {
+            server->first_waiting = index;
+        }
+        server->last_waiting = index;
+    }
+
+    if (engine->account_count == 0) {
+        fprintf(stderr, "No accounts found\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+int find_server(poll_engine_t* engine, char* name) {
+    struct addrinfo hints;
+
+    for (int i = 0; i < engine->server_count; i++) {
+        if (strcmp(engine->servers[i].name, name) == 0) {
+            return i;
+        }
+    }
+
+    // Every account of the server connects to the same addresses, so it is resolved once before the loop starts
+    server_t* server = &engine->servers[engine->server_count];
+    server->name = name;
+    server->active = 0;
+    server->first_waiting = -1;
+    server->last_waiting = -1;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+    if (getaddrinfo(name, engine->settings->use_tls ? "993" : "143", &hints, &server->addresses) != 0) {
+        server->addresses = NULL;
+    }
+    return engine->server_count++;
+}
+
+void raise_file_limit() {
+    struct rlimit limit;
+
+    // Each active account holds a socket
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+void start_waiting_accounts(poll_engine_t* engine, int server_index) {
+    server_t* server = &engine->servers[server_index];
+
+    // An account failing at once gives its place straight to the next one
+    while (server->first_waiting >= 0 && server->active < engine->settings->server_limit) {
+        account_t* account = &engine->accounts[server->first_waiting];
+        server->first_waiting = account->next_waiting;
+        server->active++;
+        start_account(engine, account);
+    }
+}
+
+void start_account(poll_engine_t* engine, account_t* account) {
+    client_t* settings = engine->settings;
+    server_t* server = &engine->servers[account->server];
+    client_t* client = init_client();
+
+    client->username = account->username;
+    client->password = account->password;
+    client->folder = account->folder;
+    client->server_name = server->name;
+    client->use_tls = settings->use_tls;
+    client->cache_dir = settings->cache_dir;
+    client->decode = settings->decode;
+    client->connect_timeout = settings->connect_timeout;
+    account->client = client;
+    account->address = server->addresses;
+    account->deadline = get_time_ms() + client->connect_timeout;
+    if (server->addresses == NULL) {
+        fail_account(engine, account, 2, "Error in getaddrinfo");
+        return;
+    }
+    connect_account(engine, account);
+}
+
+void connect_account(poll_engine_t* engine, account_t* account) {
+    // The addresses are tried one after the other, each one gets a new socket
+    while (account->address != NULL) {
+        int connfd = start_connect(account->address);
+        if (connfd >= 0) {
+            account->client->connfd = connfd;
+            account->state = ACCOUNT_CONNECTING;
+            account->events = 0;
+            watch_account(engine, account, EPOLLOUT);
+            return;
+        }
+        account->address = account->address->ai_next;
+    }
+    fail_account(engine, account, 2, "Failed to connect");
+}
+
+void watch_account(poll_engine_t* engine, account_t* account, unsigned int events) {
+    struct epoll_event event;
+
+    if (account->events == events) {
+        return;
+    }
+    event.events = events;
+    event.data.ptr = account;
+    if (epoll_ctl(engine->epoll_fd, account->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, account->client->connfd, &event) < 0) {
+        fprintf(stderr, "Failed to watch connection\n");
+        exit(EXIT_FAILURE);
+    }
+    account->events = events;
+}
+
+void drive_account(poll_engine_t* engine, account_t* account) {
+    client_t* client = account->client;
+
+    if (account->state == ACCOUNT_CONNECTING) {
+        int error = 0;
+        socklen_t error_len = sizeof(error);
+
+        // A refused address closes its socket, which also takes it out of the event loop
+        if (getsockopt(client->connfd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0 || error != 0) {
+            close(client->connfd);
+            client->connfd = -1;
+            account->address = account->address->ai_next;
+            connect_account(engine, account);
+            return;
+        }
+
+        int no_delay = 1;
+        setsockopt(client->connfd, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+        if (client->use_tls) {
+            client->tls = create_tls(client);
+            client->transport = &tls_transport;
+            account->state = ACCOUNT_HANDSHAKE;
+        } else {
+            account->state = ACCOUNT_GREETING;
+        }
+    }
+
+    // The handshake goes on whenever the socket is ready in the direction it asked for
+    if (account->state == ACCOUNT_HANDSHAKE) {
+        ERR_clear_error();
+        int result = SSL_connect(client->tls);
+        if (result != 1) {
+            int error = SSL_get_error(client->tls, result);
+            if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+                watch_account(engine, account, error == SSL_ERROR_WANT_READ ? EPOLLIN : EPOLLOUT);
+                return;
+            }
+            char message[BUFFER_SIZE];
+            long verify_result = SSL_get_verify_result(client->tls);
+            if (verify_result != X509_V_OK) {
+                snprintf(message, sizeof(message), "TLS handshake failure: %s", X509_verify_cert_error_string(verify_result));
+            } else {
+                snprintf(message, sizeof(message), "TLS handshake failure");
+            }
+            fail_account(engine, account, 2, message);
+            return;
+        }
+        account->state = ACCOUNT_GREETING;
+    }
+
+    // Output left over from a full socket goes first, it also picks the events to watch
+    if (flush_account_output(engine, account) < 0) {
+        return;
+    }
+    read_account(engine, account);
+}
+
+void read_account(poll_engine_t* engine, account_t* account) {
+    reader_t* reader = &account->client->reader;
+
+    // Reading goes on until the socket is empty, as the loop is only told about new data
+    while (account->client != NULL) {
+        if (reader->start > 0) {
+            memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+            reader->end -= reader->start;
+            reader->start = 0;
+        }
+
+        int received = receive_nonblocking(account->client, reader->buffer + reader->end, sizeof(reader->buffer) - reader->end);
+        if (received == RECEIVE_AGAIN) {
+            return;
+        }
+        if (received <= 0) {
+            fail_account(engine, account, 3, "Unexpected disconnect from server");
+            return;
+        }
+        reader->end += received;
+        account->deadline = get_time_ms() + account->client->connect_timeout;
+        handle_account_data(engine, account);
+    }
+}
+
+int receive_nonblocking(client_t* client, char* buffer, int len) {
+    if (client->tls != NULL) {
+        // The error queue is shared by every connection, so an error left by another one must not be read as this one's
+        ERR_clear_error();
+        int received = SSL_read(client->tls, buffer, len);
+        if (received > 0) {
+            return received;
+        }
+
+        int error = SSL_get_error(client->tls, received);
+        if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+            return RECEIVE_AGAIN;
+        }
+        return error == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+    }
+
+    int received = recv(client->connfd, buffer, len, 0);
+    if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return RECEIVE_AGAIN;
+    }
+    return received;
+}
+
+int send_nonblocking(client_t* client, char* buffer, int len) {
+    if (client->tls != NULL) {
+        // A write that asked to be retried is repeated with the same bytes, which stay in the output of the account
+        ERR_clear_error();
+        int sent = SSL_write(client->tls, buffer, len);
+        if (sent > 0) {
+            return sent;
+        }
+
+        int error = SSL_get_error(client->tls, sent);
+        return error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE ? SEND_AGAIN : -1;
+    }
+
+    int sent = send(client->connfd, buffer, len, 0);
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return SEND_AGAIN;
+    }
+    return sent;
+}
+
+void queue_account_output(poll_engine_t* engine, account_t* account, char* data, int len) {
+    account->output = (char*)reallocate(account->output, account->output_len + len);
+    memcpy(account->output + account->output_len, data, len);
+    account->output_len += len;
+    flush_account_output(engine, account);
+}
+
+int flush_account_output(poll_engine_t* engine, account_t* account) {
+    while (account->output_sent < account->output_len) {
+        int sent = send_nonblocking(account->client, account->output + account->output_sent, account->output_len - account->output_sent);
+        if (sent == SEND_AGAIN) {
+            // Either direction may let the write go on, TLS can need to read first
+            watch_account(engine, account, EPOLLIN | EPOLLOUT);
+            return 0;
+        }
+        if (sent <= 0) {
+            fail_account(engine, account, 2, "Failed to send command");
+            return -1;
+        }
+        account->output_sent += sent;
+    }
+
+    free(account->output);
+    account->output = NULL;
+    account->output_len = 0;
+    account->output_sent = 0;
+    watch_account(engine, account, EPOLLIN);
+    return 0;
+}
+
+void handle_account_data(poll_engine_t* engine, account_t* account) {
+    reader_t* reader = &account->client->reader;
+
+    while (account->client != NULL) {
+        char* data = reader->buffer + reader->start;
+        int data_len = reader->end - reader->start;
+
+        // The part of a literal that did not fit in the buffer is dropped as it arrives
+        if (reader->literal_remaining > 0) {
+            int skipped = data_len < reader->literal_remaining ? data_len : reader->literal_remaining;
+            reader->start += skipped;
+            reader->literal_remaining -= skipped;
+            if (reader->literal_remaining > 0) {
+                return;
+            }
+            continue;
+        }
+
+        char* line_end = memmem(data, data_len, "\r\n", 2);
+        if (line_end == NULL) {
+            if (data_len == sizeof(reader->buffer)) {
+                fail_account(engine, account, 3, "Response line too long");
+            }
+            return;
+        }
+        *line_end = '\0';
+
+        int literal_size = get_literal_size(data);
+        if (literal_size == LITERAL_TOO_LARGE) {
+            fail_account(engine, account, 3, "Literal too large");
+            return;
+        }
+        if (literal_size < 0) {
+            reader->start += line_end + 2 - data;
+            handle_account_line(engine, account, data);
+            continue;
+        }
+
+        // A literal waits until it is all buffered, unless it fills the buffer and can only be shown in part
+        char* literal = line_end + 2;
+        int buffered = reader->buffer + reader->end - literal;
+        if (buffered < literal_size && data_len < sizeof(reader->buffer)) {
+            *line_end = '\r';
+            return;
+        }
+        int shown = buffered < literal_size ? buffered : literal_size;
+        int message_num = get_fetch_number(data);
+        if (message_num > 0 && is_fetch_item(data, "BODY[HEADER.FIELDS (SUBJECT)]")) {
+            print_account_subject(account, message_num, literal, shown);
+        }
+        reader->start = literal + shown - reader->buffer;
+        reader->literal_remaining = literal_size - shown;
+    }
+}
+
+void handle_account_line(poll_engine_t* engine, account_t* account, char* line) {
+    static char* step_tags[] = {"A0001", "A0002", "A0003"};
+
+    if (account->state == ACCOUNT_GREETING) {
+        if (strncasecmp(line, CONNECT_RESPONSE, strlen(CONNECT_RESPONSE)) != 0) {
+            fail_account(engine, account, 3, "Connect failure");
+            return;
+        }
+        send_account_commands(engine, account);
+        return;
+    }
+
+    // The commands are tagged with their step, so the tagged response of the current step moves the account on
+    int status = get_tagged_status(line, step_tags[account->state - ACCOUNT_LOGIN]);
+    if (status < 0) {
+        return;
+    }
+    if (status != RESPONSE_OK && account->state == ACCOUNT_LOGIN) {
+        fail_account(engine, account, 3, "Login failure");
+    } else if (status != RESPONSE_OK && account->state == ACCOUNT_SELECT) {
+        fail_account(engine, account, 3, "Folder not found");
+    } else if (status != RESPONSE_OK) {
+        fprintf(stderr, "%s@%s/%s: Mailbox is empty\n", account->username, account->client->server_name, account->folder);
+        finish_account(engine, account, 0);
+    } else if (++account->state == ACCOUNT_DONE) {
+        finish_account(engine, account, 0);
+    }
+}
+
+void send_account_commands(poll_engine_t* engine, account_t* account) {
+    char commands[BUFFER_SIZE * 2];
+    char escaped_folder[FOLDER_SIZE];
+
+    // The server answers the three in order, so none of them waits for a round trip
+    escape_special_char(account->folder, escaped_folder, FOLDER_SIZE);
+    int len = snprintf(commands, sizeof(commands),
+            "A0001 LOGIN %s %s\r\nA0002 SELECT \"%s\"\r\nA0003 FETCH 1:* (BODY[HEADER.FIELDS (SUBJECT)])\r\n",
+            account->username, account->password, escaped_folder);
+    if (len >= sizeof(commands)) {
+        fail_account(engine, account, 2, "Failed to send command");
+        return;
+    }
+
+    // A socket that is not ready takes the rest once the loop says it can
+    account->state = ACCOUNT_LOGIN;
+    queue_account_output(engine, account, commands, len);
+}
+
+void print_account_subject(account_t* account, int message_num, char* literal, int literal_size) {
+    client_t* client = account->client;
+    char* header = (char*)arena_alloc(&client->arena, literal_size + 1);
+
+    memcpy(header, literal, literal_size);
+    header[literal_size] = '\0';
+    printf("%s@%s/%s %d: ", account->username, client->server_name, account->folder, message_num);
+    print_list_subject(header, client->decode);
+    reset_arena(&client->arena);
+}
+
+void fail_account(poll_engine_t* engine, account_t* account, int status, char* message) {
+    fprintf(stderr, "%s@%s/%s: %s\n", account->username, engine->servers[account->server].name, account->folder, message);
+    finish_account(engine, account, status);
+}
+
+void finish_account(poll_engine_t* engine, account_t* account, int status) {
+    client_t* client = account->client;
+
+    // A finished session says goodbye without waiting for the reply
+    if (status == 0) {
+        send_data(client, "A0004 LOGOUT\r\n", strlen("A0004 LOGOUT\r\n"));
+    }
+    close_session(client);
+    free(account->output);
+    account->output = NULL;
+    account->output_len = 0;
+    account->output_sent = 0;
+    account->client = NULL;
+    account->state = ACCOUNT_DONE;
+    engine->servers[account->server].active--;
+    engine->finished++;
+    if (status > engine->status) {
+        engine->status = status;
+    }
+}
+
+void check_account_deadlines(poll_engine_t* engine) {
+    long long now = get_time_ms();
+
+    for (int i = 0; i < engine->account_count; i++) {
+        account_t* account = &engine->accounts[i];
+        if (account->client != NULL && now >= account->deadline) {
+            fail_account(engine, account, 2, "Connection timed out");
+            start_waiting_accounts(engine, account->server);
+        }
+    }
+}
+
+void mbox_message_handler(client_t* client, int message_num, int literal_size, void* context) {
+    static char chunk_buffer[STREAM_CHUNK_SIZE];
+    retrieve_t* retrieve = (retrieve_t*)context;
+    mbox_state_t state = {1, 0, 0};
+    time_t now = time(NULL);
+    int chunk_len;
+    int last_char = '\n';
+
+    // Every message starts with a From line, asctime ends it with \n
+    printf("%sMAILER-DAEMON %s", MBOX_FROM, asctime(gmtime(&now)));
+
+    while ((chunk_len = read_literal_chunk(client, chunk_buffer, sizeof(chunk_buffer))) > 0) {
+        write_mbox_quoted(&state, chunk_buffer, chunk_len, stdout);
+        last_char = chunk_buffer[chunk_len - 1];
+    }
+    flush_mbox_state(&state, stdout);
+
+    // Messages are separated by an empty line
+    printf(last_char == '\n' ? "\n" : "\n\n");
+    retrieve->written++;
+}
+
+void write_mbox_quoted(mbox_state_t* state, char* data, int data_len, FILE* output) {
+    int from_len = strlen(MBOX_FROM);
+    int i = 0;
+
+    while (i < data_len) {
+
+        // Copy up to the end of the line in one go
+        if (!state->line_start) {
+            char* newline = memchr(data + i, '\n', data_len - i);
+            int run_len = newline ? newline - (data + i) + 1 : data_len - i;
+            fwrite(data + i, 1, run_len, output);
+            i += run_len;
+            state->line_start = newline != NULL;
+            continue;
+        }
+
+        // Hold back the start of the line until it is known whether it matches >*From
+        if (state->from_matched == 0 && data[i] == '>') {
+            state->quote_count++;
+            i++;
+        } else if (data[i] == MBOX_FROM[state->from_matched]) {
+            state->from_matched++;
+            i++;
+            if (state->from_matched == from_len) {
+                fputc('>', output);
+                flush_mbox_state(state, output);
+            }
+        } else {
+            flush_mbox_state(state, output);
+        }
+    }
+}
+
+void flush_mbox_state(mbox_state_t* state, FILE* output) {
+    if (!state->line_start) {
+        return;
+    }
+
+    for (int i = 0; i < state->quote_count; i++) {
+        fputc('>', output);
+    }
+    fwrite(MBOX_FROM, 1, state->from_matched, output);
+
+    state->line_start = 0;
+    state->quote_count = 0;
+    state->from_matched = 0;
+}
+
+void stream_literal(client_t* client, FILE* output, int literal_size) {
+    char chunk_buffer[STREAM_CHUNK_SIZE];
+    int total_received = 0;
+    int bytes_received;
+
+    // Let the kernel move the bytes when the output allows it, TLS records have to be decrypted first
+    fflush(output);
+    if (client->transport->raw_socket) {
+        total_received = splice_literal(client->connfd, fileno(output), literal_size);
+    }
+    if (total_received < 0) {
+        total_received = 0;
+    }
+
+    // Copy whatever is left through a fixed size buffer
+    while (total_received < literal_size) {
+        int chunk_size = literal_size - total_received;
+        if (chunk_size > STREAM_CHUNK_SIZE) {
+            chunk_size = STREAM_CHUNK_SIZE;
+        }
+
+        bytes_received = client->transport->receive(client, chunk_buffer, chunk_size);
+        if (bytes_received <= 0) {
+            fprintf(stderr, "Failed to receive body content\n");
+            exit(EXIT_FAILURE);
+        }
+        if (fwrite(chunk_buffer, 1, bytes_received, output) != (size_t)bytes_received) {
+            fprintf(stderr, "Failed to write body content\n");
+            exit(EXIT_FAILURE);
+        }
+        total_received += bytes_received;
+    }
+}
+
+int splice_literal(int connfd, int out_fd, int literal_size) {
+#ifdef __linux__
+    struct stat out_stat;
+    int pipefd[2];
+    int total_moved = 0;
+    ssize_t bytes_moved;
+
+    if (fstat(out_fd, &out_stat) < 0) {
+        return -1;
+    }
+
+    // The output is a pipe so the socket can be spliced straight into it
+    if (S_ISFIFO(out_stat.st_mode)) {
+        while (total_moved < literal_size) {
+            bytes_moved = splice(connfd, NULL, out_fd, NULL, literal_size - total_moved, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (bytes_moved <= 0) {
+                break;
+            }
+            total_moved += bytes_moved;
+        }
+        return total_moved;
+    }
+
+    // Regular files need an intermediate pipe between the socket and the output
+    if (!S_ISREG(out_stat.st_mode) || pipe(pipefd) < 0) {
+        return -1;
+    }
+
+    while (total_moved < literal_size) {
+        bytes_moved = splice(connfd, NULL, pipefd[1], NULL, literal_size - total_moved, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (bytes_moved <= 0) {
+            break;
+        }
+
+        // Drain the pipe into the output, falling back to a plain copy if the file refuses splice
+        ssize_t pending = bytes_moved;
+        while (pending > 0) {
+            ssize_t bytes_written = splice(pipefd[0], NULL, out_fd, NULL, pending, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (bytes_written <= 0) {
+                char drain_buffer[BUFFER_SIZE];
+                ssize_t bytes_read = read(pipefd[0], drain_buffer, pending < BUFFER_SIZE ? pending : BUFFER_SIZE);
+                if (bytes_read <= 0 || write(out_fd, drain_buffer, bytes_read) != bytes_read) {
+                    fprintf(stderr, "Failed to write body content\n");
+                    exit(EXIT_FAILURE);
+                }
+                bytes_written = bytes_read;
+            }
+            pending -= bytes_written;
+        }
+        total_moved += bytes_moved;
+    }
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return total_moved;
+#else
+    (void)connfd;
+    (void)out_fd;
+    (void)literal_size;
+    return -1;
+#endif
+}
+
+void parse_header_fields(client_t* client) {
+    char* header;
+    int header_size;
+    message_store_t store;
+
+    // Fetch all of the fields in one round trip, or read them from the stored message
+    if (client->cache_dir != NULL) {
+        header = load_stored_message(client, &store, &header_size);
+    } else {
+        header = fetch_literal(client, "BODY.PEEK[HEADER.FIELDS (FROM TO DATE SUBJECT)]", "BODY[HEADER.FIELDS (FROM TO DATE SUBJECT)]", &header_size);
+    }
+    if (header == NULL) {
+        printf("Message not found\n");
+        exit(3);
+    }
+
+    print_parsed_fields(header, "From", "From:", client->decode);
+    print_parsed_fields(header, "To", "To:", client->decode);
+    print_parsed_fields(header, "Date", "Date:", client->decode);
+    print_parsed_fields(header, "Subject", "Subject: <No subject>", client->decode);
+    if (client->cache_dir != NULL) {
+        close_message_store(&store);
+    } else {
+        reset_arena(&client->arena);
+    }
+}
+
+view_t find_header_field(char* header, char* name) {
+    int name_len = strlen(name);
+    char* line = header;
+    view_t field = {NULL, 0};
+
+    // The header block ends at the first empty line, the body may hold lines that look like fields
+    while (*line && strncmp(line, "\r\n", 2) != 0) {
+        char* colon = line + name_len;
+
+        // Field names are case insensitive and may be followed by whitespace before the colon
+        if (strncasecmp(line, name, name_len) == 0) {
+            while (*colon == ' ' || *colon == '\t') {
+                colon++;
+            }
+        }
+
+        if (strncasecmp(line, name, name_len) == 0 && *colon == ':') {
+            char* value = colon + 1;
+            char* end = value;
+
+            // Move past the space after the colon
+            if (*value == ' ') {
+                value++;
+            }
+
+            // The field ends at the first line break not followed by folding whitespace
+            while ((end = strstr(end, "\r\n")) != NULL && (end[2] == ' ' || end[2] == '\t')) {
+                end += 2;
+            }
+            if (end == NULL) {
+                end = value + strlen(value);
+            }
+
+            field.data = value;
+            field.len = end > value ? end - value : 0;
+            return field;
+        }
+
+        // Move to the next line
+        line = strstr(line, "\r\n");
+        if (line == NULL) {
+            break;
+        }
+        line += 2;
+    }
+
+    return field;
+}
+
+void write_decoded_header(view_t value, FILE* output) {
+    char decoded[MIME_LINE_SIZE * 3];
+    char* current = value.data;
+    char* end = value.data + value.len;
+    int after_word = 0;
+
+    // Most fields hold no encoded word at all
+    if (value.data == NULL || memmem(value.data, value.len, "=?", 2) == NULL) {
+        write_unfolded(value, output);
+        return;
+    }
+
+    while (current < end) {
+        char* word = memmem(current, end - current, "=?", 2);
+        char* word_end = NULL;
+        view_t text = {current, (word != NULL ? word : end) - current};
+        int decoded_len = word != NULL ? decode_encoded_word(word, end, decoded, &word_end) : -1;
+
+        // Whitespace between two encoded words is left out, so words split by the encoder join up again
+        if (!(after_word && decoded_len >= 0 && is_blank_text(text))) {
+            write_unfolded(text, output);
+        }
+        if (word == NULL) {
+            break;
+        }
+
+        if (decoded_len >= 0) {
+            fwrite(decoded, 1, decoded_len, output);
+            current = word_end;
+            after_word = 1;
+        } else {
+            fwrite(word, 1, 2, output);
+            current = word + 2;
+            after_word = 0;
+        }
+    }
+}
+
+int decode_encoded_word(char* word, char* end, char* output, char** word_end) {
+    unsigned char bytes[MIME_LINE_SIZE];
+    int bytes_len = 0;
+    char* charset = word + 2;
+    char* charset_end = charset;
+
+    // The form is =?charset?encoding?text?= with no whitespace anywhere in it
+    while (charset_end < end && *charset_end != '?' && !isspace((unsigned char)*charset_end)) {
+        charset_end++;
+    }
+    if (end - charset_end < 3 || *charset_end != '?' || charset_end[2] != '?') {
+        return -1;
+    }
+    char encoding = charset_end[1] | 0x20;
+    char* text = charset_end + 3;
+    char* text_end = text;
+    while (text_end + 1 < end && !(text_end[0] == '?' && text_end[1] == '=') && !isspace((unsigned char)*text_end)) {
+        text_end++;
+    }
+    if (text_end + 1 >= end || text_end[0] != '?' || text_end - text > MIME_LINE_SIZE) {
+        return -1;
+    }
+
+    // RFC 2231 lets a language follow the charset after '*'
+    char* language = memchr(charset, '*', charset_end - charset);
+    int charset_id = get_charset(charset, (language != NULL ? language : charset_end) - charset);
+    if (charset_id == CHARSET_UNKNOWN) {
+        return -1;
+    }
+
+    if (encoding == 'b') {
+        int text_len = text_end - text;
+        int used;
+        while (text_len > 0 && text[text_len - 1] == '=') {
+            text_len--;
+        }
+
+        // A word with anything outside the alphabet is left as it was
+        for (int i = 0; i < text_len; i++) {
+            if (get_base64_value(text[i]) < 0) {
+                return -1;
+            }
+        }
+
+        // Encoded words are a few dozen bytes, too short to pay for warming up the vector units
+        bytes_len = decode_base64_scalar((unsigned char*)text, text_len, bytes, &used);
+
+        // A group cut short by the padding still holds one or two bytes
+        if (text_len - used >= 2) {
+            bytes[bytes_len++] = get_base64_value(text[used]) << 2 | get_base64_value(text[used + 1]) >> 4;
+        }
+        if (text_len - used == 3) {
+            bytes[bytes_len++] = get_base64_value(text[used + 1]) << 4 | get_base64_value(text[used + 2]) >> 2;
+        }
+    } else if (encoding == 'q') {
+        for (char* c = text; c < text_end; c++) {
+            if (*c == '_') {
+                bytes[bytes_len++] = ' ';
+            } else if (*c == '=' && text_end - c >= 3 && get_hex_value(c[1]) >= 0 && get_hex_value(c[2]) >= 0) {
+                bytes[bytes_len++] = get_hex_value(c[1]) << 4 | get_hex_value(c[2]);
+                c += 2;
+            } else {
+                bytes[bytes_len++] = *c;
+            }
+        }
+    } else {
+        return -1;
+    }
+
+    *word_end = text_end + 2;
+    return transcode_to_utf8(charset_id, bytes, bytes_len, output);
+}
+
+int is_blank_text(view_t text) {
+    for (int i = 0; i < text.len; i++) {
+        if (text.data[i] != ' ' && text.data[i] != '\t' && text.data[i] != '\r' && text.data[i] != '\n') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int get_charset(char* name, int name_len) {
+    static const char* names[] = {"utf-8", "utf8", "us-ascii", "ascii", "iso-8859-1", "iso_8859-1", "latin1", "l1",
+        "windows-1252", "cp1252", "utf-16", "utf-16be", "utf-16le"};
+    static const int charsets[] = {CHARSET_UTF8, CHARSET_UTF8, CHARSET_UTF8, CHARSET_UTF8, CHARSET_LATIN1, CHARSET_LATIN1,
+        CHARSET_LATIN1, CHARSET_LATIN1, CHARSET_CP1252, CHARSET_CP1252, CHARSET_UTF16, CHARSET_UTF16BE, CHARSET_UTF16LE};
+
+    for (int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+        if ((int)strlen(names[i]) == name_len && strncasecmp(name, names[i], name_len) == 0) {
+            return charsets[i];
+        }
+    }
+    return CHARSET_UNKNOWN;
+}
+
+int transcode_to_utf8(int charset, unsigned char* input, int input_len, char* output) {
+    // Windows-1252 only differs from Latin-1 in 0x80 to 0x9f, the bytes it leaves undefined stay C1 controls
+    static const unsigned short cp1252_high[32] = {
+        0x20ac, 0x0081, 0x201a, 0x0192, 0x201e, 0x2026, 0x2020, 0x2021, 0x02c6, 0x2030, 0x0160, 0x2039, 0x0152, 0x008d, 0x017d, 0x008f,
+        0x0090, 0x2018, 0x2019, 0x201c, 0x201d, 0x2022, 0x2013, 0x2014, 0x02dc, 0x2122, 0x0161, 0x203a, 0x0153, 0x009d, 0x017e, 0x0178};
+    int output_len = 0;
+    int i = 0;
+
+    if (charset == CHARSET_UTF8) {
+        memcpy(output, input, input_len);
+        return input_len;
+    }
+
+    if (charset == CHARSET_LATIN1 || charset == CHARSET_CP1252) {
+        for (; i < input_len; i++) {
+            unsigned long code_point = input[i];
+            if (charset == CHARSET_CP1252 && code_point >= 0x80 && code_point < 0xa0) {
+                code_point = cp1252_high[code_point - 0x80];
+            }
+            output_len += encode_utf8(code_point, output + output_len);
+        }
+        return output_len;
+    }
+
+    // UTF-16 without an order in its name is big endian unless a byte order mark says otherwise
+    int little_endian = charset == CHARSET_UTF16LE;
+    if (charset == CHARSET_UTF16 && input_len >= 2 && ((input[0] == 0xff && input[1] == 0xfe) || (input[0] == 0xfe && input[1] == 0xff))) {
+        little_endian = input[0] == 0xff;
+        i = 2;
+    }
+    for (; i + 1 < input_len; i += 2) {
+        unsigned long unit = little_endian ? input[i] | input[i + 1] << 8 : input[i] << 8 | input[i + 1];
+        if (unit >= 0xd800 && unit < 0xdc00 && i + 3 < input_len) {
+            unsigned long low = little_endian ? input[i + 2] | input[i + 3] << 8 : input[i + 2] << 8 | input[i + 3];
+            if (low >= 0xdc00 && low < 0xe000) {
+                unit = 0x10000 + ((unit - 0xd800) << 10) + (low - 0xdc00);
+                i += 2;
+            }
+        }
+        if (unit >= 0xd800 && unit < 0xe000) {
+            unit = REPLACEMENT_CHARACTER;
+        }
+        output_len += encode_utf8(unit, output + output_len);
+    }
+    if (i < input_len) {
+        output_len += encode_utf8(REPLACEMENT_CHARACTER, output + output_len);
+    }
+    return output_len;
+}
+
+int encode_utf8(unsigned long code_point, char* output) {
+    if (code_point < 0x80) {
+        output[0] = code_point;
+        return 1;
+    }
+    if (code_point < 0x800) {
+        output[0] = 0xc0 | code_point >> 6;
+        output[1] = 0x80 | (code_point & 0x3f);
+        return 2;
+    }
+    if (code_point < 0x10000) {
+        output[0] = 0xe0 | code_point >> 12;
+        output[1] = 0x80 | (code_point >> 6 & 0x3f);
+        output[2] = 0x80 | (code_point & 0x3f);
+        return 3;
+    }
+    output[0] = 0xf0 | code_point >> 18;
+    output[1] = 0x80 | (code_point >> 12 & 0x3f);
+    output[2] = 0x80 | (code_point >> 6 & 0x3f);
+    output[3] = 0x80 | (code_point & 0x3f);
+    return 4;
+}
+
+void print_parsed_fields(char* header, char* name, char* missing, int decode) {
+    view_t value = find_header_field(header, name);
+
+    if (value.data == NULL) {
+        printf("%s\n", missing);
+        return;
+    }
+
+    // Print the parsed content straight from the header block
+    printf("%s: ", name);
+    if (decode) {
+        write_decoded_header(value, stdout);
+    } else {
+        write_unfolded(value, stdout);
+    }
+    printf("\n");
+}
+
+void write_unfolded(view_t value, FILE* output) {
+    char* line = value.data;
+    char* end = value.data + value.len;
+
+    // The value holds no NUL before its end, so each folded line is written up to its \r\n
+    while (line < end) {
+        char* line_end = memmem(line, end - line, "\r\n", 2);
+        if (line_end == NULL) {
+            line_end = end;
+        }
+        fwrite(line, 1, line_end - line, output);
+        line = line_end < end ? line_end + 2 : end;
+    }
+}
+
+char* copy_unfolded(view_t value, arena_t* arena) {
+    if (value.data == NULL) {
+        return NULL;
+    }
+
+    char* copy = (char*)arena_alloc(arena, value.len + 1);
+    int copy_len = 0;
+    for (int i = 0; i < value.len; i++) {
+        if (value.data[i] == '\r' && i + 1 < value.len && value.data[i + 1] == '\n') {
+            i++;
+        } else {
+            copy[copy_len++] = value.data[i];
+        }
+    }
+    copy[copy_len] = '\0';
+    return copy;
+}
+
+void read_mime(client_t* client) {
+    mime_parser_t parser;
+
+    init_mime_parser(&parser, stdout, &client->arena, client->decode);
+
+    // Parse the body as it arrives, or all at once from the store
+    if (client->cache_dir != NULL) {
+        message_store_t store;
+        int message_size;
+        char* message = load_stored_message(client, &store, &message_size);
+        if (message == NULL) {
+            printf("Message not found\n");
+            exit(3);
+        }
+        feed_mime_parser(&parser, message, message_size);
+        close_message_store(&store);
+    } else if (!read_mime_structure(client, &parser)) {
+        int tag_num = send_fetch(client, client->message_set, "BODY.PEEK[]", "BODY[]", mime_literal_handler, &parser);
+        if (wait_fetch(client, tag_num) <= 0) {
+            printf("Message not found\n");
+            exit(3);
+        }
+    }
+    finish_mime_parser(&parser);
+    reset_arena(&client->arena);
+}
+
+void mime_literal_handler(client_t* client, int message_num, int literal_size, void* context) {
+    mime_parser_t* parser = (mime_parser_t*)context;
+    char chunk[STREAM_CHUNK_SIZE];
+    int chunk_len;
+
+    // The rest of the literal is skipped once the part has been printed
+    while (parser->state != MIME_STATE_DONE && (chunk_len = read_literal_chunk(client, chunk, sizeof(chunk))) > 0) {
+        feed_mime_parser(parser, chunk, chunk_len);
+    }
+}
+
+void save_attachments(client_t* client) {
+    mime_parser_t parser;
+
+    // Attachments are always decoded, they are files rather than text for the terminal
+    init_mime_parser(&parser, stdout, &client->arena, 1);
+    parser.attachment_dir = client->output_dir;
+    if (mkdir(client->output_dir, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create output directory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (client->cache_dir != NULL) {
+        message_store_t store;
+        int message_size;
+        char* message = load_stored_message(client, &store, &message_size);
+        if (message == NULL) {
+            printf("Message not found\n");
+            exit(3);
+        }
+        feed_mime_parser(&parser, message, message_size);
+        close_message_store(&store);
+    } else if (!save_structure_attachments(client, &parser)) {
+        int tag_num = send_fetch(client, client->message_set, "BODY.PEEK[]", "BODY[]", mime_literal_handler, &parser);
+        if (wait_fetch(client, tag_num) <= 0) {
+            printf("Message not found\n");
+            exit(3);
+        }
+    }
+    finish_mime_parser(&parser);
+    reset_arena(&client->arena);
+}
+
+int save_structure_attachments(client_t* client, mime_parser_t* parser) {
+    mime_structure_t structure;
+    attachment_list_t list = {NULL, 0, 0, parser};
+    char section[MIME_SECTION_SIZE] = "";
+    char items[MIME_SECTION_SIZE + 16];
+    mime_part_t part;
+
+    if (!fetch_mime_structure(client, parser, &structure)) {
+        return 0;
+    }
+    memset(&part, 0, sizeof(part));
+    char* current = structure.structure;
+    if (walk_structure_part(&current, section, sizeof(section), &part, collect_structure_attachment, &list, 0) < 0) {
+        free(list.attachments);
+        return 0;
+    }
+
+    // A few sections are in flight at once, each is decoded into its file as it arrives
+    int sent = 0, done = 0;
+    while (done < list.count) {
+        while (sent < list.count && sent - done < WORKER_PIPELINE_DEPTH) {
+            structure_attachment_t* attachment = &list.attachments[sent++];
+            snprintf(items, sizeof(items), "BODY.PEEK[%s]", attachment->section);
+            attachment->tag_num = send_fetch(client, client->message_set, items, attachment->item, attachment_literal_handler, attachment);
+        }
+        if (wait_fetch(client, list.attachments[done++].tag_num) < 0) {
+            printf("Message not found\n");
+            exit(3);
+        }
+    }
+    parser->state = MIME_STATE_DONE;
+    free(list.attachments);
+    return 1;
+}
+
+int collect_structure_attachment(mime_part_t* part, char* section, void* context) {
+    attachment_list_t* list = (attachment_list_t*)context;
+
+    if (!is_attachment_part(part)) {
+        return 0;
+    }
+    if (list->count == list->size) {
+        list->size = list->size > 0 ? list->size * 2 : WORKER_PIPELINE_DEPTH;
+        list->attachments = (structure_attachment_t*)reallocate(list->attachments, sizeof(structure_attachment_t) * list->size);
+    }
+
+    // The walk reuses the part for the next one, so the attachment keeps a copy
+    structure_attachment_t* attachment = &list->attachments[list->count++];
+    snprintf(attachment->section, sizeof(attachment->section), "%s", section);
+    snprintf(attachment->item, sizeof(attachment->item), "BODY[%s]", section);
+    attachment->part = (mime_part_t*)arena_alloc(list->parser->arena, sizeof(mime_part_t));
+    memcpy(attachment->part, part, sizeof(mime_part_t));
+    attachment->parser = list->parser;
+    return 0;
+}
+
+void attachment_literal_handler(client_t* client, int message_num, int literal_size, void* context) {
+    structure_attachment_t* attachment = (structure_attachment_t*)context;
+    mime_parser_t* parser = attachment->parser;
+    char chunk[STREAM_CHUNK_SIZE];
+    int chunk_len;
+
+    open_attachment(parser, attachment->part);
+    parser->current = attachment->part;
+    parser->state = MIME_STATE_BODY;
+    while ((chunk_len = read_literal_chunk(client, chunk, sizeof(chunk))) > 0) {
+        write_mime_body(parser, chunk, chunk_len);
+    }
+    close_attachment(parser);
+}
+
+int is_attachment_part(mime_part_t* part) {
+    return part->attachment || (strncmp(part->media_type, "text/", strlen("text/")) != 0
+            && strncmp(part->media_type, "multipart/", strlen("multipart/")) != 0);
+}
+
+void open_attachment(mime_parser_t* parser, mime_part_t* part) {
+    char name[MIME_FIELD_SIZE + MSG_NUM_STR_SIZE + 2];
+
+    parser->attachment_count++;
+    get_attachment_name(parser, part, name, sizeof(name));
+    if (snprintf(parser->attachment_path, sizeof(parser->attachment_path), "%s/%s", parser->attachment_dir, name)
+            >= (int)sizeof(parser->attachment_path)) {
+        fprintf(stderr, "Failed to open output file\n");
+        exit(EXIT_FAILURE);
+    }
+    parser->output = fopen(parser->attachment_path, "wb");
+    if (parser->output == NULL) {
+        fprintf(stderr, "Failed to open output file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    parser->transfer_encoding = TRANSFER_IDENTITY;
+    parser->decode_len = 0;
+    parser->decode_finished = 0;
+    select_mime_part(parser, part);
+}
+
+void close_attachment(mime_parser_t* parser) {
+    finish_decoding(parser);
+    if (fclose(parser->output) != 0) {
+        fprintf(stderr, "Failed to write output file\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("%s\n", parser->attachment_path);
+
+    parser->output = stdout;
+    parser->selected = NULL;
+    parser->transfer_encoding = TRANSFER_IDENTITY;
+}
+
+void get_attachment_name(mime_parser_t* parser, mime_part_t* part, char* name, int name_size) {
+    char clean[MIME_FIELD_SIZE];
+    char* base = part->filename;
+    int clean_len = 0;
+
+    // Only the last path component is kept, so a name from the message cannot leave the directory
+    for (char* c = part->filename; *c; c++) {
+        if (*c == '/' || *c == '\\') {
+            base = c + 1;
+        }
+    }
+    for (char* c = base; *c && clean_len < MIME_FIELD_SIZE - 1; c++) {
+        clean[clean_len++] = (unsigned char)*c < ' ' || *c == 0x7f ? '_' : *c;
+    }
+    clean[clean_len] = '\0';
+    if (clean_len == 0 || strcmp(clean, ".") == 0 || strcmp(clean, "..") == 0) {
+        snprintf(clean, sizeof(clean), "attachment-%d", parser->attachment_count);
+    }
+
+    // A name an earlier attachment of the message took gets the number of this one in front
+    snprintf(name, name_size, "%s", clean);
+    for (int i = 0; i < parser->attachment_count - 1; i++) {
+        if (strcmp(parser->attachment_names[i], clean) == 0) {
+            snprintf(name, name_size, "%d-%s", parser->attachment_count, clean);
+            break;
+        }
+    }
+
+    if (parser->attachment_count > parser->attachment_names_size) {
+        parser->attachment_names_size = parser->attachment_names_size > 0 ? parser->attachment_names_size * 2 : WORKER_PIPELINE_DEPTH;
+        parser->attachment_names = (char**)reallocate(parser->attachment_names, sizeof(char*) * parser->attachment_names_size);
+    }
+    parser->attachment_names[parser->attachment_count - 1] = (char*)arena_alloc(parser->arena, strlen(name) + 1);
+    strcpy(parser->attachment_names[parser->attachment_count - 1], name);
+}
+
+int read_mime_structure(client_t* client, mime_parser_t* parser) {
+    mime_structure_t structure;
+    char section[MIME_SECTION_SIZE] = "";
+    char items[MIME_SECTION_SIZE + 16], item[MIME_SECTION_SIZE + 16];
+    mime_part_t* part = parser->root;
+
+    if (!fetch_mime_structure(client, parser, &structure)) {
+        return 0;
+    }
+
+    char* current = structure.structure;
+    int found = walk_structure_part(&current, section, sizeof(section), part, select_structure_part, parser, 0);
+    if (found < 0) {
+        return 0;
+    }
+    if (found == 0) {
+        fprintf(stderr, "Content-Type text/plain not found\n");
+        exit(4);
+    }
+
+    // The section holds only the body of the part, so it goes straight to the decoder
+    select_mime_part(parser, part);
+    parser->current = part;
+    parser->state = MIME_STATE_BODY;
+    snprintf(items, sizeof(items), "BODY.PEEK[%s]", section);
+    snprintf(item, sizeof(item), "BODY[%s]", section);
+    int tag_num = send_fetch(client, client->message_set, items, item, section_literal_handler, &structure);
+    if (wait_fetch(client, tag_num) < 0) {
+        printf("Message not found\n");
+        exit(3);
+    }
+    finish_decoding(parser);
+    parser->state = MIME_STATE_DONE;
+
+    if (getenv(MIME_STATS_VARIABLE) != NULL) {
+        fprintf(stderr, "MIME: fetched %ld bytes of %ld for section %s, saved %ld\n",
+                structure.fetched, structure.size, section, structure.size > structure.fetched ? structure.size - structure.fetched : 0);
+    }
+    return 1;
+}
+
+int fetch_mime_structure(client_t* client, mime_parser_t* parser, mime_structure_t* structure) {
+    char mime_version[MIME_FIELD_SIZE];
+
+    structure->structure = NULL;
+    structure->version.data = NULL;
+    structure->version.size = 0;
+    structure->size = -1;
+    structure->fetched = 0;
+    structure->parser = parser;
+
+    // The structure says which parts to fetch, a message it cannot describe is parsed whole
+    int tag_num = send_fetch_command(client, "FETCH", client->message_set, MIME_STRUCTURE_ITEMS, MIME_STRUCTURE_ITEM,
+            structure_literal_handler, structure_fetch_handler, structure);
+    if (wait_fetch(client, tag_num) < 0 || structure->structure == NULL) {
+        return 0;
+    }
+
+    // The same checks as the parser makes on the top level header
+    if (structure->version.data == NULL || !get_mime_header_value(structure->version.data, "MIME-Version", mime_version, sizeof(mime_version))
+            || strncmp(mime_version, "1.0", strlen("1.0")) != 0) {
+        fprintf(stderr, "MIME-Version not found\n");
+        exit(4);
+    }
+    if (structure->structure[1] != '(') {
+        fprintf(stderr, "Content-Type multipart not found\n");
+        exit(4);
+    }
+    return 1;
+}
+
+int select_structure_part(mime_part_t* part, char* section, void* context) {
+    mime_parser_t* parser = (mime_parser_t*)context;
+
+    return is_selected_mime_part(part, parser->decode);
+}
+
+void structure_fetch_handler(client_t* client, int message_num, char* line, void* context) {
+    mime_structure_t* structure = (mime_structure_t*)context;
+    char* body = insensitive_strstr(line, "BODYSTRUCTURE (");
+    long size = get_fetch_attribute(line, "RFC822.SIZE");
+
+    structure->fetched += strlen(line);
+    if (size >= 0) {
+        structure->size = size;
+    }
+
+    // A literal inside the structure ends the line, what is kept of it then fails to parse
+    if (body != NULL && structure->structure == NULL) {
+        body += strlen("BODYSTRUCTURE ");
+        int body_len = strlen(body);
+        structure->structure = (char*)arena_alloc(&client->arena, body_len + 1);
+        memcpy(structure->structure, body, body_len + 1);
+    }
+}
+
+void structure_literal_handler(client_t* client, int message_num, int literal_size, void* context) {
+    mime_structure_t* structure = (mime_structure_t*)context;
+
+    structure->fetched += literal_size;
+    save_literal_handler(client, message_num, literal_size, &structure->version);
+}
+
+void section_literal_handler(client_t* client, int message_num, int literal_size, void* context) {
+    mime_structure_t* structure = (mime_structure_t*)context;
+    char chunk[STREAM_CHUNK_SIZE];
+    int chunk_len;
+
+    structure->fetched += literal_size;
+    while ((chunk_len = read_literal_chunk(client, chunk, sizeof(chunk))) > 0) {
+        write_mime_body(structure->parser, chunk, chunk_len);
+    }
+}
+
+int walk_structure_part(char** current, char* section, int section_size, mime_part_t* part, structure_visitor_t visit, void* context, int depth) {
+    char* position = *current;
+    char subtype[MIME_FIELD_SIZE], disposition[MIME_FIELD_SIZE];
+    int section_len = strlen(section);
+
+    if (*position != '(' || depth >= MIME_MAX_DEPTH) {
+        return -1;
+    }
+    position++;
+
+    // A multipart lists its parts first, numbered from 1 below the section of the multipart, in the order the parser meets them
+    if (*position == '(') {
+        for (int index = 1; *position == '('; index++) {
+            if (snprintf(section + section_len, section_size - section_len, "%s%d", section_len > 0 ? "." : "", index) >= section_size - section_len) {
+                return -1;
+            }
+            int found = walk_structure_part(&position, section, section_size, part, visit, context, depth + 1);
+            if (found != 0) {
+                return found;
+            }
+        }
+        section[section_len] = '\0';
+    } else {
+        mime_filename_t type_name = {"", 0}, disposition_name = {"", 0};
+
+        // Type, subtype, parameters, id, description, encoding and size come first in a single part
+        if (read_structure_string(&position, part->media_type, sizeof(part->media_type)) <= 0
+                || read_structure_string(&position, subtype, sizeof(subtype)) <= 0) {
+            return -1;
+        }
+        int type_len = strlen(part->media_type);
+        part->media_type[type_len++] = '/';
+        for (int i = 0; subtype[i] != '\0' && type_len < MIME_FIELD_SIZE - 1; i++) {
+            part->media_type[type_len++] = subtype[i];
+        }
+        part->media_type[type_len] = '\0';
+        for (char* c = part->media_type; *c; c++) {
+            *c = tolower((unsigned char)*c);
+        }
+
+        strcpy(part->charset, "us-ascii");
+        if (read_structure_parameters(&position, part->charset, &type_name, "name") < 0
+                || skip_structure_value(&position, depth) < 0 || skip_structure_value(&position, depth) < 0) {
+            return -1;
+        }
+        int has_encoding = read_structure_string(&position, part->encoding, sizeof(part->encoding));
+        if (has_encoding < 0 || skip_structure_value(&position, depth) < 0) {
+            return -1;
+        }
+        if (has_encoding == 0) {
+            strcpy(part->encoding, "7bit");
+        }
+        for (char* c = part->encoding; *c; c++) {
+            *c = tolower((unsigned char)*c);
+        }
+
+        // Text has its line count next and a message/rfc822 its envelope, body and line count, then come MD5 and the disposition
+        int skipped = strncmp(part->media_type, "text/", strlen("text/")) == 0 ? 2
+                : strcmp(part->media_type, "message/rfc822") == 0 ? 4 : 1;
+        for (int i = 0; i < skipped && *position != ')'; i++) {
+            if (skip_structure_value(&position, depth) < 0) {
+                return -1;
+            }
+        }
+        part->attachment = 0;
+        if (*position == '(') {
+            position += strspn(position + 1, " ") + 1;
+            if (read_structure_string(&position, disposition, sizeof(disposition)) < 0
+                    || read_structure_parameters(&position, NULL, &disposition_name, "filename") < 0) {
+                return -1;
+            }
+            part->attachment = strcasecmp(disposition, "attachment") == 0;
+            while (*position != ')') {
+                if (skip_structure_value(&position, depth) < 0) {
+                    return -1;
+                }
+            }
+            position += strspn(position + 1, " ") + 1;
+        }
+        strcpy(part->filename, disposition_name.value[0] != '\0' ? disposition_name.value : type_name.value);
+
+        // A message/rfc822 part is not looked into, as the parser treats it as one body
+        if (visit(part, section, context)) {
+            return 1;
+        }
+    }
+
+    // The subtype of a multipart and the extension data are skipped
+    while (*position != ')') {
+        if (skip_structure_value(&position, depth) < 0) {
+            return -1;
+        }
+    }
+    position++;
+    position += strspn(position, " ");
+    *current = position;
+    return 0;
+}
+
+int read_structure_parameters(char** current, char* charset, mime_filename_t* filename, char* filename_parameter) {
+    char name[MIME_FIELD_SIZE], value[MIME_FIELD_SIZE];
+    char* position = *current;
+
+    if (*position != '(') {
+        return read_structure_string(current, value, sizeof(value)) < 0 ? -1 : 0;
+    }
+
+    position += strspn(position + 1, " ") + 1;
+    while (*position != ')') {
+        if (read_structure_string(&position, name, sizeof(name)) < 0 || read_structure_string(&position, value, sizeof(value)) < 0) {
+            return -1;
+        }
+        if (charset != NULL && strcasecmp(name, "charset") == 0) {
+            for (int i = 0; i < MIME_FIELD_SIZE; i++) {
+                charset[i] = tolower((unsigned char)value[i]);
+                if (value[i] == '\0') {
+                    break;
+                }
+            }
+        }
+        add_filename_parameter(filename, name, value, filename_parameter);
+    }
+    *current = position + 1 + strspn(position + 1, " ");
+    return 0;
+}
+
+int read_structure_string(char** current, char* value, int value_size) {
+    char* position = *current;
+    int value_len = 0;
+
+    if (*position == '"') {
+        for (position++; *position != '"'; position++) {
+            if (*position == '\\' && position[1] != '\0') {
+                position++;
+            }
+            if (*position == '\0') {
+                return -1;
+            }
+            if (value_len < value_size - 1) {
+                value[value_len++] = *position;
+            }
+        }
+        position++;
+    } else {
+        int atom_len = strcspn(position, " ()");
+        if (atom_len == 0 || *position == '{') {
+            return -1;
+        }
+        if (atom_len == strlen("NIL") && strncasecmp(position, "NIL", atom_len) == 0) {
+            value[0] = '\0';
+            position += atom_len;
+            *current = position + strspn(position, " ");
+            return 0;
+        }
+        value_len = atom_len < value_size - 1 ? atom_len : value_size - 1;
+        memcpy(value, position, value_len);
+        position += atom_len;
+    }
+
+    value[value_len] = '\0';
+    *current = position + strspn(position, " ");
+    return 1;
+}
+
+int skip_structure_value(char** current, int depth) {
+    char value[MIME_FIELD_SIZE];
+
+    if (**current != '(') {
+        return read_structure_string(current, value, sizeof(value)) < 0 ? -1 : 0;
+    }
+
+    // Envelopes and extension data nest lists, a message/rfc822 part even holds a whole body
+    if (depth >= MIME_MAX_DEPTH * 4) {
+        return -1;
+    }
+    (*current)++;
+    *current += strspn(*current, " ");
+    while (**current != ')') {
+        if (skip_structure_value(current, depth + 1) < 0) {
+            return -1;
+        }
+    }
+    (*current)++;
+    *current += strspn(*current, " ");
+    return 0;
+}
+
+void init_mime_parser(mime_parser_t* parser, FILE* output, arena_t* arena, int decode) {
+    parser->state = MIME_STATE_HEADER;
+    parser->arena = arena;
+    parser->root = new_mime_part(arena, NULL);
+    parser->current = parser->root;
+    parser->container = NULL;
+    parser->selected = NULL;
+    parser->header = NULL;
+    parser->header_len = 0;
+    parser->header_size = 0;
+    parser->line_len = 0;
+    parser->long_line = 0;
+    parser->held_cr = 0;
+    parser->held_end_len = 0;
+    parser->decode = decode;
+    parser->transfer_encoding = TRANSFER_IDENTITY;
+    parser->decode_len = 0;
+    parser->decode_finished = 0;
+    parser->output = output;
+    parser->attachment_dir = NULL;
+    parser->attachment_count = 0;
+    parser->attachment_names = NULL;
+    parser->attachment_names_size = 0;
+}
+
+mime_part_t* new_mime_part(arena_t* arena, mime_part_t* parent) {
+    mime_part_t* part = (mime_part_t*)arena_alloc(arena, sizeof(mime_part_t));
+    memset(part, 0, sizeof(mime_part_t));
+
+    part->parent = parent;
+    if (parent != NULL) {
+        part->depth = parent->depth + 1;
+        if (parent->last_child != NULL) {
+            parent->last_child->next = part;
+        } else {
+            parent->first_child = part;
+        }
+        parent->last_child = part;
+    }
+    return part;
+}
+
+void feed_mime_parser(mime_parser_t* parser, char* data, int data_len) {
+
+    // Work one line at a time, a line may be split over several calls
+    while (data_len > 0 && parser->state != MIME_STATE_DONE) {
+        char* newline = memchr(data, '\n', data_len);
+        int take = newline != NULL ? newline - data + 1 : data_len;
+
+        if (parser->state == MIME_STATE_HEADER) {
+            feed_mime_header(parser, data, take, newline != NULL);
+        } else {
+            feed_mime_line(parser, data, take, newline != NULL);
+        }
+        data += take;
+        data_len -= take;
+    }
+}
+
+void feed_mime_header(mime_parser_t* parser, char* data, int data_len, int complete) {
+    if (parser->header_len + data_len + 1 > parser->header_size) {
+        if (parser->header_len + data_len + 1 > MIME_HEADER_MAX_SIZE) {
+            fprintf(stderr, "MIME header too long\n");
+            exit(4);
+        }
+        parser->header_size = (parser->header_len + data_len + 1) * 2;
+        parser->header = (char*)reallocate(parser->header, parser->header_size);
+    }
+    memcpy(parser->header + parser->header_len, data, data_len);
+    parser->header_len += data_len;
+    parser->line_len += data_len;
+
+    // The header block ends at the first empty line
+    if (complete) {
+        int empty = parser->line_len == 1 || (parser->line_len == 2 && parser->header[parser->header_len - 2] == '\r');
+        parser->line_len = 0;
+        if (empty) {
+            end_mime_header(parser);
+        }
+    }
+}
+
+void end_mime_header(mime_parser_t* parser) {
+    mime_part_t* part = parser->current;
+    char mime_version[MIME_FIELD_SIZE];
+
+    parser->header = parser->header != NULL ? parser->header : (char*)allocate(1);
+    parser->header[parser->header_len] = '\0';
+    parse_mime_header(parser->header, part);
+    parser->header_len = 0;
+
+    // The top level must be a MIME 1.0 multipart
+    if (part == parser->root) {
+        if (!get_mime_header_value(parser->header, "MIME-Version", mime_version, sizeof(mime_version))
+                || strncmp(mime_version, "1.0", strlen("1.0")) != 0) {
+            fprintf(stderr, "MIME-Version not found\n");
+            exit(4);
+        }
+        if (strncmp(part->media_type, "multipart/", strlen("multipart/")) != 0) {
+            fprintf(stderr, "Content-Type multipart not found\n");
+            exit(4);
+        }
+    }
+
+    if (strncmp(part->media_type, "multipart/", strlen("multipart/")) == 0) {
+        if (part->boundary[0] == '\0') {
+            fprintf(stderr, "Boundary not found\n");
+            exit(4);
+        }
+        if (part->depth >= MIME_MAX_DEPTH) {
+            fprintf(stderr, "MIME parts nested too deeply\n");
+            exit(4);
+        }
+        parser->container = part;
+        parser->state = MIME_STATE_PREAMBLE;
+        return;
+    }
+
+    if (parser->attachment_dir != NULL) {
+        if (is_attachment_part(part)) {
+            open_attachment(parser, part);
+        }
+    } else if (parser->selected == NULL && is_selected_mime_part(part, parser->decode)) {
+        select_mime_part(parser, part);
+    }
+    parser->state = MIME_STATE_BODY;
+}
+
+void select_mime_part(mime_parser_t* parser, mime_part_t* part) {
+    parser->selected = part;
+    if (parser->decode && strcmp(part->encoding, "base64") == 0) {
+        parser->transfer_encoding = TRANSFER_BASE64;
+    } else if (parser->decode && strcmp(part->encoding, "quoted-printable") == 0) {
+        parser->transfer_encoding = TRANSFER_QUOTED_PRINTABLE;
+    }
+}
+
+void parse_mime_header(char* header, mime_part_t* part) {
+    char content_type[BUFFER_SIZE];
+    char disposition[BUFFER_SIZE];
+    mime_filename_t type_name = {"", 0}, disposition_name = {"", 0};
+
+    // Defaults from RFC 2045 for a part without the fields
+    strcpy(part->media_type, "text/plain");
+    strcpy(part->charset, "us-ascii");
+    strcpy(part->encoding, "7bit");
+    part->boundary[0] = '\0';
+
+    if (get_mime_header_value(header, "Content-Type", content_type, sizeof(content_type))) {
+        int type_len = strcspn(content_type, "; \t");
+        if (type_len > 0 && type_len < MIME_FIELD_SIZE) {
+            for (int i = 0; i < type_len; i++) {
+                part->media_type[i] = tolower((unsigned char)content_type[i]);
+            }
+            part->media_type[type_len] = '\0';
+        }
+        if (get_mime_parameter(content_type, "charset", part->charset, sizeof(part->charset))) {
+            for (char* c = part->charset; *c; c++) {
+                *c = tolower((unsigned char)*c);
+            }
+        }
+        get_mime_parameter(content_type, "boundary", part->boundary, sizeof(part->boundary));
+        get_mime_filename(content_type, "name", &type_name);
+    }
+
+    // The file name of an attachment, its disposition may be left out
+    part->attachment = 0;
+    if (get_mime_header_value(header, "Content-Disposition", disposition, sizeof(disposition))) {
+        int type_len = strcspn(disposition, "; \t");
+        part->attachment = type_len == (int)strlen("attachment") && strncasecmp(disposition, "attachment", type_len) == 0;
+        get_mime_filename(disposition, "filename", &disposition_name);
+    }
+    strcpy(part->filename, disposition_name.value[0] != '\0' ? disposition_name.value : type_name.value);
+
+    if (get_mime_header_value(header, "Content-Transfer-Encoding", part->encoding, sizeof(part->encoding))) {
+        for (char* c = part->encoding; *c; c++) {
+            *c = tolower((unsigned char)*c);
+        }
+    }
+}
+
+int is_selected_mime_part(mime_part_t* part, int decode) {
+    return strcmp(part->media_type, "text/plain") == 0 && strcmp(part->charset, "utf-8") == 0
+            && (strcmp(part->encoding, "quoted-printable") == 0 || strcmp(part->encoding, "7bit") == 0
+                || strcmp(part->encoding, "8bit") == 0 || (decode && strcmp(part->encoding, "base64") == 0));
+}
+
+void get_mime_filename(char* field, char* wanted, mime_filename_t* filename) {
+    char name[MIME_FIELD_SIZE], value[MIME_FIELD_SIZE];
+    char* current = strchr(field, ';');
+
+    // Every parameter is looked at, an RFC 2231 name may be split over several of them
+    while (current != NULL) {
+        current++;
+        current += strspn(current, " \t");
+        int name_len = strcspn(current, "=; \t");
+        snprintf(name, sizeof(name), "%.*s", name_len < MIME_FIELD_SIZE - 1 ? name_len : MIME_FIELD_SIZE - 1, current);
+        current += name_len;
+        current += strspn(current, " \t");
+        if (*current != '=') {
+            current = strchr(current, ';');
+            continue;
+        }
+        current++;
+        current += strspn(current, " \t");
+
+        int value_len = 0;
+        if (*current == '"') {
+            for (current++; *current != '\0' && *current != '"'; current++) {
+                if (*current == '\\' && current[1] != '\0') {
+                    current++;
+                }
+                if (value_len < MIME_FIELD_SIZE - 1) {
+                    value[value_len++] = *current;
+                }
+            }
+        } else {
+            int token_len = strcspn(current, "; \t");
+            value_len = token_len < MIME_FIELD_SIZE - 1 ? token_len : MIME_FIELD_SIZE - 1;
+            memcpy(value, current, value_len);
+            current += token_len;
+        }
+        value[value_len] = '\0';
+        add_filename_parameter(filename, name, value, wanted);
+        current = strchr(current, ';');
+    }
+}
+
+void add_filename_parameter(mime_filename_t* filename, char* parameter, char* value, char* wanted) {
+    int wanted_len = strlen(wanted);
+    char* rest = parameter + wanted_len;
+    int encoded = 1, index = 0;
+
+    if (strncasecmp(parameter, wanted, wanted_len) != 0) {
+        return;
+    }
+    if (*rest == '\0') {
+        if (!filename->extended) {
+            snprintf(filename->value, sizeof(filename->value), "%s", value);
+        }
+        return;
+    }
+    if (*rest++ != '*') {
+        return;
+    }
+
+    // name* is encoded, name*N is a plain section and name*N* an encoded one
+    if (*rest != '\0') {
+        char* end;
+        index = strtol(rest, &end, 10);
+        if (end == rest || (end[0] == '*' ? end[1] : end[0]) != '\0') {
+            return;
+        }
+        encoded = end[0] == '*';
+    }
+    if (index == 0 || !filename->extended) {
+        filename->value[0] = '\0';
+        filename->extended = 1;
+    }
+
+    // The first encoded section starts with charset'language', the bytes are kept as they are
+    if (encoded && index == 0) {
+        char* quote = strchr(value, '\'');
+        if (quote != NULL && strchr(quote + 1, '\'') != NULL) {
+            value = strchr(quote + 1, '\'') + 1;
+        }
+    }
+    int value_len = strlen(filename->value);
+    for (char* c = value; *c && value_len < MIME_FIELD_SIZE - 1; c++) {
+        if (encoded && c[0] == '%' && isxdigit((unsigned char)c[1]) && isxdigit((unsigned char)c[2])) {
+            char hex[3] = {c[1], c[2], '\0'};
+            filename->value[value_len++] = (char)strtol(hex, NULL, 16);
+            c += 2;
+        } else {
+            filename->value[value_len++] = *c;
+        }
+    }
+    filename->value[value_len] = '\0';
+}
+
+int get_mime_header_value(char* header, char* name, char* value, int value_size) {
+    view_t field = find_header_field(header, name);
+    int value_len = 0;
+
+    if (field.data == NULL) {
+        return 0;
+    }
+
+    // Unfold into the value, leaving out the whitespace around it
+    for (int i = 0; i < field.len && value_len < value_size - 1; i++) {
+        if (field.data[i] == '\r' && i + 1 < field.len && field.data[i + 1] == '\n') {
+            i++;
+        } else if (value_len > 0 || (field.data[i] != ' ' && field.data[i] != '\t')) {
+            value[value_len++] = field.data[i];
+        }
+    }
+    while (value_len > 0 && (value[value_len - 1] == ' ' || value[value_len - 1] == '\t')) {
+        value_len--;
+    }
+    value[value_len] = '\0';
+    return 1;
+}
+
+int get_mime_parameter(char* content_type, char* name, char* value, int value_size) {
+    int name_len = strlen(name);
+    char* current = content_type;
+
+    while ((current = insensitive_strstr(current, name)) != NULL) {
+        char* before = current;
+        char* after = current + name_len;
+
+        // The name must start a parameter, after the ';' and any whitespace
+        while (before > content_type && (before[-1] == ' ' || before[-1] == '\t')) {
+            before--;
+        }
+        after += strspn(after, " \t");
+        if (before == content_type || before[-1] != ';' || *after != '=') {
+            current += name_len;
+            continue;
+        }
+        after++;
+        after += strspn(after, " \t");
+
+        // Quoted values may hold any character, with \ escaping the next one
+        int value_len = 0;
+        if (*after == '"') {
+            after++;
+            while (*after && *after != '"' && value_len < value_size - 1) {
+                if (*after == '\\' && after[1]) {
+                    after++;
+                }
+                value[value_len++] = *after++;
+            }
+        } else {
+            while (*after && *after != ';' && *after != ' ' && *after != '\t' && value_len < value_size - 1) {
+                value[value_len++] = *after++;
+            }
+        }
+        value[value_len] = '\0';
+        return value_len > 0;
+    }
+    return 0;
+}
+
+void feed_mime_line(mime_parser_t* parser, char* data, int data_len, int complete) {
+
+    // A line longer than the buffer cannot be a delimiter, so it is passed on as it arrives
+    if (!parser->long_line && parser->line_len + data_len > MIME_LINE_SIZE) {
+        write_mime_body(parser, parser->held_end, parser->held_end_len);
+        write_mime_body(parser, parser->line, parser->line_len);
+        parser->held_end_len = 0;
+        parser->line_len = 0;
+        parser->long_line = 1;
+    }
+
+    if (!parser->long_line) {
+        memcpy(parser->line + parser->line_len, data, data_len);
+        parser->line_len += data_len;
+        if (complete) {
+            int ending_len = parser->line_len >= 2 && parser->line[parser->line_len - 2] == '\r' ? 2 : 1;
+            process_mime_line(parser, parser->line_len - ending_len, ending_len);
+            parser->line_len = 0;
+        }
+        return;
+    }
+
+    // The line ending is held back, a \r at the end of the data may turn out to be part of it
+    int content_len = data_len;
+    int ending_len = 0;
+    if (complete) {
+        content_len--;
+        ending_len = 1;
+        if (content_len > 0 && data[content_len - 1] == '\r') {
+            content_len--;
+            ending_len = 2;
+        } else if (content_len == 0 && parser->held_cr) {
+            parser->held_cr = 0;
+            ending_len = 2;
+        }
+    }
+    if (parser->held_cr) {
+        write_mime_body(parser, "\r", 1);
+        parser->held_cr = 0;
+    }
+    if (!complete && data[data_len - 1] == '\r') {
+        content_len--;
+        parser->held_cr = 1;
+    }
+    write_mime_body(parser, data, content_len);
+
+    if (complete) {
+        memcpy(parser->held_end, &"\r\n"[2 - ending_len], ending_len);
+        parser->held_end_len = ending_len;
+        parser->long_line = 0;
+    }
+}
+
+void process_mime_line(mime_parser_t* parser, int content_len, int ending_len) {
+    int closing;
+    mime_part_t* container = find_mime_delimiter(parser, parser->line, content_len, &closing);
+
+    if (container != NULL) {
+        end_mime_part(parser, container, closing);
+        return;
+    }
+
+    // The line ending waits until the next line shows whether it belongs to a delimiter
+    write_mime_body(parser, parser->held_end, parser->held_end_len);
+    write_mime_body(parser, parser->line, content_len);
+    memcpy(parser->held_end, parser->line + content_len, ending_len);
+    parser->held_end_len = ending_len;
+}
+
+mime_part_t* find_mime_delimiter(mime_parser_t* parser, char* line, int line_len, int* closing) {
+    if (line_len < 2 || line[0] != '-' || line[1] != '-') {
+        return NULL;
+    }
+
+    // An outer boundary also ends the parts that were left open inside it
+    for (mime_part_t* container = parser->container; container != NULL; container = container->parent) {
+        int boundary_len = strlen(container->boundary);
+        if (line_len - 2 < boundary_len || memcmp(line + 2, container->boundary, boundary_len) != 0) {
+            continue;
+        }
+
+        char* rest = line + 2 + boundary_len;
+        int rest_len = line_len - 2 - boundary_len;
+        *closing = rest_len >= 2 && rest[0] == '-' && rest[1] == '-';
+        if (*closing) {
+            rest += 2;
+            rest_len -= 2;
+        }
+        while (rest_len > 0 && (*rest == ' ' || *rest == '\t')) {
+            rest++;
+            rest_len--;
+        }
+        if (rest_len == 0) {
+            return container;
+        }
+    }
+    return NULL;
+}
+
+void end_mime_part(mime_parser_t* parser, mime_part_t* container, int closing) {
+
+    // The line break before a delimiter belongs to the delimiter
+    parser->held_end_len = 0;
+
+    // Attachments go on to the next part, the selected part is all mime prints
+    if (parser->state == MIME_STATE_BODY && parser->current == parser->selected && parser->attachment_dir != NULL) {
+        close_attachment(parser);
+    } else if (parser->state == MIME_STATE_BODY && parser->current == parser->selected) {
+        finish_decoding(parser);
+        parser->state = MIME_STATE_DONE;
+        return;
+    }
+
+    if (closing) {
+        parser->current = container;
+        parser->container = container->parent;
+        parser->state = MIME_STATE_EPILOGUE;
+    } else {
+        parser->current = new_mime_part(parser->arena, container);
+        parser->container = container;
+        parser->state = MIME_STATE_HEADER;
+    }
+}
+
+void write_mime_body(mime_parser_t* parser, char* data, int data_len) {
+    if (parser->state != MIME_STATE_BODY || parser->current != parser->selected || data_len <= 0) {
+        return;
+    }
+
+    if (parser->transfer_encoding == TRANSFER_BASE64) {
+        decode_base64(parser, data, data_len);
+    } else if (parser->transfer_encoding == TRANSFER_QUOTED_PRINTABLE) {
+        decode_quoted_printable(parser, data, data_len);
+    } else {
+        fwrite(data, 1, data_len, parser->output);
+    }
+}
+
+void finish_mime_parser(mime_parser_t* parser) {
+    end_mime_input(parser);
+
+    // Every part is read for attachments, so the message has to end after its last boundary
+    if (parser->attachment_dir != NULL) {
+        if (parser->selected != NULL) {
+            close_attachment(parser);
+        }
+        fflush(stdout);
+        if (parser->state != MIME_STATE_DONE && parser->root->first_child == NULL) {
+            fprintf(stderr, "Starting boundary not found\n");
+            exit(4);
+        }
+        if (parser->state != MIME_STATE_DONE && (parser->state != MIME_STATE_EPILOGUE || parser->container != NULL)) {
+            fprintf(stderr, "Ending boundary not found\n");
+            exit(4);
+        }
+        free(parser->attachment_names);
+        free(parser->header);
+        return;
+    }
+
+    if (parser->selected == NULL) {
+        fprintf(stderr, parser->root->first_child == NULL ? "Starting boundary not found\n" : "Content-Type text/plain not found\n");
+        exit(4);
+    }
+    if (parser->state != MIME_STATE_DONE) {
+        fprintf(stderr, "Ending boundary not found\n");
+        exit(4);
+    }
+
+    free(parser->header);
+}
+
+void end_mime_input(mime_parser_t* parser) {
+    if (parser->state == MIME_STATE_HEADER && parser->current == parser->root) {
+        end_mime_header(parser);
+    } else if (parser->state != MIME_STATE_HEADER && parser->state != MIME_STATE_DONE && !parser->long_line && parser->line_len > 0) {
+        process_mime_line(parser, parser->line_len, 0);
+    }
+    fflush(parser->output);
+}
+
+void decode_quoted_printable(mime_parser_t* parser, char* data, int data_len) {
+    char output[DECODE_BUFFER_SIZE];
+    int output_len = 0;
+
+    while (data_len > 0) {
+
+        // An escape split over several calls is finished one byte at a time, it is only a few bytes long
+        if (parser->decode_len > 0) {
+            fwrite(output, 1, output_len, parser->output);
+            output_len = 0;
+            parser->decode_buffer[parser->decode_len++] = *data;
+            data++;
+            data_len--;
+            resolve_qp_escape(parser);
+            continue;
+        }
+
+        // Everything up to the next '=' is copied as it is, long runs go straight out
+        char* escape = memchr(data, '=', data_len);
+        int run_len = escape != NULL ? escape - data : data_len;
+        if (output_len + run_len + 1 > (int)sizeof(output)) {
+            fwrite(output, 1, output_len, parser->output);
+            output_len = 0;
+        }
+        if (run_len + 1 > (int)sizeof(output)) {
+            fwrite(data, 1, run_len, parser->output);
+        } else {
+            memcpy(output + output_len, data, run_len);
+            output_len += run_len;
+        }
+        data += run_len;
+        data_len -= run_len;
+        if (escape == NULL) {
+            break;
+        }
+
+        // Escapes that are whole in the data are decoded on the spot, a run of them as binary data has without going back to memchr
+        while (data_len >= 3 && *data == '=') {
+            if (output_len == (int)sizeof(output)) {
+                fwrite(output, 1, output_len, parser->output);
+                output_len = 0;
+            }
+            int high = get_hex_value(data[1]), low = get_hex_value(data[2]);
+            if (high >= 0 && low >= 0) {
+                output[output_len++] = high << 4 | low;
+            } else if (data[1] != '\r' || data[2] != '\n') {
+                break;
+            }
+            data += 3;
+            data_len -= 3;
+        }
+
+        // What is left is an escape cut off by the end of the data or one that is not well formed
+        if (data_len > 0 && *data == '=') {
+            parser->decode_buffer[0] = '=';
+            parser->decode_len = 1;
+            data++;
+            data_len--;
+        }
+    }
+    fwrite(output, 1, output_len, parser->output);
+}
+
+void resolve_qp_escape(mime_parser_t* parser) {
+    char* escape = parser->decode_buffer;
+
+    while (parser->decode_len > 0) {
+        int escape_len = parser->decode_len;
+
+        if (get_hex_value(escape[1]) >= 0) {
+            if (escape_len < 3) {
+                return;
+            }
+            if (get_hex_value(escape[2]) >= 0) {
+                fputc(get_hex_value(escape[1]) << 4 | get_hex_value(escape[2]), parser->output);
+                parser->decode_len = 0;
+                return;
+            }
+        } else if (escape_len > 1) {
+
+            // Trailing whitespace may come between the '=' and the line break of a soft line break
+            int i = 1;
+            while (i < escape_len && (escape[i] == ' ' || escape[i] == '\t')) {
+                i++;
+            }
+            if ((i == escape_len || (i == escape_len - 1 && escape[i] == '\r')) && escape_len < QP_ESCAPE_SIZE) {
+                return;
+            }
+            if ((i == escape_len - 1 && escape[i] == '\n') || (i == escape_len - 2 && escape[i] == '\r' && escape[i + 1] == '\n')) {
+                parser->decode_len = 0;
+                return;
+            }
+        } else {
+            return;
+        }
+
+        // Not an escape, the '=' and the bytes up to the next '=' are printed as they are
+        int printed = 1;
+        while (printed < escape_len && escape[printed] != '=') {
+            printed++;
+        }
+        fwrite(escape, 1, printed, parser->output);
+        memmove(escape, escape + printed, escape_len - printed);
+        parser->decode_len = escape_len - printed;
+    }
+}
+
+int get_hex_value(char c) {
+    static signed char values[256];
+    static int values_ready = 0;
+
+    if (!values_ready) {
+        memset(values, -1, sizeof(values));
+        for (int i = 0; i < 16; i++) {
+            values[(unsigned char)"0123456789abcdef"[i]] = i;
+            values[(unsigned char)"0123456789ABCDEF"[i]] = i;
+        }
+        values_ready = 1;
+    }
+    return values[(unsigned char)c];
+}
+
+void decode_base64(mime_parser_t* parser, char* data, int data_len) {
+    if (parser->decode_finished) {
+        return;
+    }
+
+    // Padding ends the data, anything after it is ignored
+    char* padding = memchr(data, '=', data_len);
+    if (padding != NULL) {
+        data_len = padding - data;
+        parser->decode_finished = 1;
+    }
+
+    // Line endings are dropped on the way into the buffer, a literal holds many lines and the kernels stop at anything outside the alphabet
+    while (data_len > 0) {
+        char* line_end = memchr(data, '\n', data_len);
+        int line_len = line_end != NULL ? line_end - data : data_len;
+        int run_len = line_len > 0 && data[line_len - 1] == '\r' ? line_len - 1 : line_len;
+        char* run = data;
+        data += line_end != NULL ? line_len + 1 : line_len;
+        data_len -= line_end != NULL ? line_len + 1 : line_len;
+
+        while (run_len > 0) {
+            int copy_len = DECODE_BUFFER_SIZE - parser->decode_len;
+            copy_len = copy_len < run_len ? copy_len : run_len;
+            memcpy(parser->decode_buffer + parser->decode_len, run, copy_len);
+            parser->decode_len += copy_len;
+            run += copy_len;
+            run_len -= copy_len;
+            if (parser->decode_len == DECODE_BUFFER_SIZE) {
+                flush_base64(parser, 0);
+            }
+        }
+    }
+}
+
+void flush_base64(mime_parser_t* parser, int final) {
+    unsigned char output[DECODE_BUFFER_SIZE / 4 * 3 + 32];
+    unsigned char* input = (unsigned char*)parser->decode_buffer;
+    int input_used;
+    int output_len = decode_base64_data(input, parser->decode_len, output, &input_used);
+
+    // Fewer than four characters are left, they wait for the rest of their group
+    int left = 0;
+    for (int i = input_used; i < parser->decode_len; i++) {
+        if (get_base64_value(input[i]) >= 0) {
+            input[left++] = input[i];
+        }
+    }
+    parser->decode_len = left;
+
+    // A group cut short by the padding still holds one or two bytes
+    if (final) {
+        if (left >= 2) {
+            output[output_len++] = get_base64_value(input[0]) << 2 | get_base64_value(input[1]) >> 4;
+        }
+        if (left == 3) {
+            output[output_len++] = get_base64_value(input[1]) << 4 | get_base64_value(input[2]) >> 2;
+        }
+        parser->decode_len = 0;
+    }
+    fwrite(output, 1, output_len, parser->output);
+}
+
+int decode_base64_data(unsigned char* input, int input_len, unsigned char* output, int* input_used) {
+    static base64_kernel_t base64_kernel = NULL;
+    int position = 0;
+    int output_len = 0;
+    int used;
+
+    if (base64_kernel == NULL) {
+        base64_kernel = select_base64_kernel();
+    }
+
+    // The kernel stops at a block holding a byte outside the alphabet, that group is decoded here
+    while (position < input_len) {
+        output_len += base64_kernel(input + position, input_len - position, output + output_len, &used);
+        position += used;
+        used = decode_base64_group(input + position, input_len - position, output + output_len);
+        if (used == 0) {
+            break;
+        }
+        position += used;
+        output_len += 3;
+    }
+    *input_used = position;
+    return output_len;
+}
+
+int decode_base64_group(unsigned char* input, int input_len, unsigned char* output) {
+    int values[4];
+    int count = 0;
+    int i = 0;
+
+    for (; i < input_len && count < 4; i++) {
+        int value = get_base64_value(input[i]);
+        if (value >= 0) {
+            values[count++] = value;
+        }
+    }
+    if (count < 4) {
+        return 0;
+    }
+
+    output[0] = values[0] << 2 | values[1] >> 4;
+    output[1] = values[1] << 4 | values[2] >> 2;
+    output[2] = values[2] << 6 | values[3];
+    return i;
+}
+
+int get_base64_value(unsigned char c) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    static signed char values[256];
+    static int values_ready = 0;
+
+    // A table keeps the lookup free of branches that random data would mispredict
+    if (!values_ready) {
+        memset(values, -1, sizeof(values));
+        for (int i = 0; alphabet[i] != '\0'; i++) {
+            values[(unsigned char)alphabet[i]] = i;
+        }
+        values_ready = 1;
+    }
+    return values[c];
+}
+
+void finish_decoding(mime_parser_t* parser) {
+    if (parser->transfer_encoding == TRANSFER_BASE64) {
+        flush_base64(parser, 1);
+        return;
+    }
+
+    // A soft line break right before the delimiter leaves a lone '=', anything else is printed as it came
+    if (parser->transfer_encoding == TRANSFER_QUOTED_PRINTABLE && parser->decode_len > 0) {
+        int i = 1;
+        while (i < parser->decode_len && (parser->decode_buffer[i] == ' ' || parser->decode_buffer[i] == '\t')) {
+            i++;
+        }
+        if (i < parser->decode_len) {
+            fwrite(parser->decode_buffer, 1, parser->decode_len, parser->output);
+        }
+        parser->decode_len = 0;
+    }
+}
+
+base64_kernel_t select_base64_kernel() {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return decode_base64_avx2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        return decode_base64_ssse3;
+    }
+#endif
+    return decode_base64_scalar;
+}
+
+int decode_base64_scalar(unsigned char* input, int input_len, unsigned char* output, int* input_used) {
+    int i = 0;
+    int output_len = 0;
+
+    for (; i + 4 <= input_len; i += 4) {
+        int a = get_base64_value(input[i]);
+        int b = get_base64_value(input[i + 1]);
+        int c = get_base64_value(input[i + 2]);
+        int d = get_base64_value(input[i + 3]);
+        if ((a | b | c | d) < 0) {
+            break;
+        }
+        output[output_len++] = a << 2 | b >> 4;
+        output[output_len++] = b << 4 | c >> 2;
+        output[output_len++] = c << 6 | d;
+    }
+    *input_used = i;
+    return output_len;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("ssse3")))
+int decode_base64_ssse3(unsigned char* input, int input_len, unsigned char* output, int* input_used) {
+    __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    __m128i lut_shift = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    __m128i mask_2f = _mm_set1_epi8(0x2f);
+    __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    int i = 0;
+    int output_len = 0;
+
+    // The low and high nibbles each name the classes of bytes they can belong to, a valid byte has no class in common
+    for (; i + 16 <= input_len; i += 16) {
+        __m128i block = _mm_loadu_si128((__m128i*)(input + i));
+        __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(block, 4), mask_2f);
+        __m128i lo = _mm_shuffle_epi8(lut_lo, _mm_and_si128(block, mask_2f));
+        __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0xffff) {
+            break;
+        }
+
+        // The high nibble picks the offset to each 6 bit value, '/' shares its nibble with '+' and is told apart
+        __m128i shift = _mm_shuffle_epi8(lut_shift, _mm_add_epi8(_mm_cmpeq_epi8(block, mask_2f), hi_nibbles));
+        block = _mm_add_epi8(block, shift);
+
+        // Four 6 bit values are joined into 24 bits and the three bytes of each are moved together
+        block = _mm_maddubs_epi16(block, _mm_set1_epi32(0x01400140));
+        block = _mm_madd_epi16(block, _mm_set1_epi32(0x00011000));
+        _mm_storeu_si128((__m128i*)(output + output_len), _mm_shuffle_epi8(block, pack));
+        output_len += 12;
+    }
+    *input_used = i;
+    return output_len;
+}
+
+__attribute__((target("avx2")))
+int decode_base64_avx2(unsigned char* input, int input_len, unsigned char* output, int* input_used) {
+    __m256i lut_lo = _mm256_broadcastsi128_si256(_mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a));
+    __m256i lut_hi = _mm256_broadcastsi128_si256(_mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10));
+    __m256i lut_shift = _mm256_broadcastsi128_si256(_mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0));
+    __m256i mask_2f = _mm256_set1_epi8(0x2f);
+    __m256i pack = _mm256_broadcastsi128_si256(_mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    __m256i join_lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1);
+    int i = 0;
+    int output_len = 0;
+    int used;
+
+    for (; i + 32 <= input_len; i += 32) {
+        __m256i block = _mm256_loadu_si256((__m256i*)(input + i));
+        __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(block, 4), mask_2f);
+        __m256i lo = _mm256_shuffle_epi8(lut_lo, _mm256_and_si256(block, mask_2f));
+        __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+        if (!_mm256_testz_si256(lo, hi)) {
+            break;
+        }
+
+        __m256i shift = _mm256_shuffle_epi8(lut_shift, _mm256_add_epi8(_mm256_cmpeq_epi8(block, mask_2f), hi_nibbles));
+        block = _mm256_add_epi8(block, shift);
+        block = _mm256_maddubs_epi16(block, _mm256_set1_epi32(0x01400140));
+        block = _mm256_madd_epi16(block, _mm256_set1_epi32(0x00011000));
+
+        // Each lane packs its 12 bytes to the front, then the two lanes are joined
+        block = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(block, pack), join_lanes);
+        _mm256_storeu_si256((__m256i*)(output + output_len), block);
+        output_len += 24;
+    }
+    output_len += decode_base64_ssse3(input + i, input_len - i, output + output_len, &used);
+    *input_used = i + used;
+    return output_len;
+}
+#endif
+
+char* insensitive_strstr(char* search, char* target) {
+    size_t target_len = strlen(target);
+    char first = target[0] | 0x20;
+
+    if (!target[0]) {
+        return search;
+    }
+
+    // Setting 0x20 folds the case of letters, other bytes may match too but strncasecmp settles it
+    for (; *search; search++) {
+        if ((*search | 0x20) == first && strncasecmp(search, target, target_len) == 0) {
+            return search;
+        }
+    }
+    return NULL;
+}
+
+void list_email(client_t* client) {
+
+    // Filters and paging are left to the server, so only the matching subjects come over the wire
+    if (has_list_filter(client)) {
+        list_filtered(client);
+        return;
+    }
+
+    // Only the changes since the last run are fetched into the cache
+    if (client->list_cache != NULL) {
+        wait_all_commands(client);
+        sync_list_cache(client);
+        save_list_cache(client->list_cache);
+        print_list_cache(client->list_cache, client->decode);
+        clear_list_cache(client->list_cache);
+        free(client->list_cache);
+        client->list_cache = NULL;
+        return;
+    }
+
+    // Each subject is printed as its response arrives, an empty folder makes the FETCH fail
+    int tag_num = send_fetch(client, "1:*", "(BODY[HEADER.FIELDS (SUBJECT)])", "BODY[HEADER.FIELDS (SUBJECT)]", list_literal_handler, NULL);
+    if (wait_fetch(client, tag_num) <= 0) {
+        fprintf(stderr, "Mailbox is empty\n");
+    }
+}
+
+int has_list_filter(client_t* client) {
+    list_filter_t* filter = &client->filter;
+
+    return filter->since[0] != '\0' || filter->from != NULL || filter->subject != NULL || filter->unseen
+            || filter->larger >= 0 || filter->limit >= 0 || filter->offset > 0;
+}
+
+void list_filtered(client_t* client) {
+    char criteria[BUFFER_SIZE];
+    char uid_set[BUFFER_SIZE / 2];
+    number_list_t uids = {NULL, 0, 0};
+    list_filter_t* filter = &client->filter;
+
+    get_search_criteria(filter, criteria, sizeof(criteria));
+    int tag_num = send_search(client, "UID SEARCH", criteria, number_search_handler, &uids);
+    if (wait_command(client, tag_num) != RESPONSE_OK) {
+        fprintf(stderr, "Search failure\n");
+        exit(3);
+    }
+
+    // Paging counts the matches in UID order, which is the order of the folder
+    if (uids.count > 1) {
+        qsort(uids.numbers, uids.count, sizeof(int), compare_numbers);
+    }
+    int first = filter->offset < uids.count ? filter->offset : uids.count;
+    int last = filter->limit >= 0 && filter->limit < uids.count - first ? first + filter->limit : uids.count;
+    if (first == last) {
+        fprintf(stderr, "No matching messages\n");
+        free(uids.numbers);
+        return;
+    }
+
+    // Several batches are in flight at once, and each one waits for the batch sent before the window
+    int* tags = (int*)allocate(sizeof(int) * (last - first));
+    int batch_count = 0, waited = 0;
+    for (int i = first; i < last; ) {
+        i = build_uid_set(uids.numbers, i, last, uid_set, sizeof(uid_set));
+        if (batch_count - waited == LIST_PIPELINE_DEPTH && wait_fetch(client, tags[waited++]) < 0) {
+            fprintf(stderr, "Failed to fetch the list\n");
+            exit(3);
+        }
+        tags[batch_count++] = send_fetch_command(client, "UID FETCH", uid_set, "(BODY.PEEK[HEADER.FIELDS (SUBJECT)])",
+                "BODY[HEADER.FIELDS (SUBJECT)]", list_literal_handler, NULL, NULL);
+    }
+    while (waited < batch_count) {
+        if (wait_fetch(client, tags[waited++]) < 0) {
+            fprintf(stderr, "Failed to fetch the list\n");
+            exit(3);
+        }
+    }
+    free(tags);
+    free(uids.numbers);
+}
+
+void get_search_criteria(list_filter_t* filter, char* criteria, int criteria_size) {
+    int len = 0;
+
+    // Text outside ASCII is only understood once the charset is named, and the charset has to come first
+    criteria[0] = '\0';
+    if ((filter->from != NULL && has_non_ascii(filter->from)) || (filter->subject != NULL && has_non_ascii(filter->subject))) {
+        len += snprintf(criteria + len, criteria_size - len, "CHARSET UTF-8 ");
+    }
+    if (filter->since[0] != '\0' && len < criteria_size) {
+        len += snprintf(criteria + len, criteria_size - len, "SINCE %s ", filter->since);
+    }
+    if (filter->from != NULL && len < criteria_size) {
+        len += append_search_text(criteria + len, criteria_size - len, "FROM", filter->from);
+    }
+    if (filter->subject != NULL && len < criteria_size) {
+        len += append_search_text(criteria + len, criteria_size - len, "SUBJECT", filter->subject);
+    }
+    if (filter->unseen && len < criteria_size) {
+        len += snprintf(criteria + len, criteria_size - len, "UNSEEN ");
+    }
+    if (filter->larger >= 0 && len < criteria_size) {
+        len += snprintf(criteria + len, criteria_size - len, "LARGER %ld ", filter->larger);
+    }
+    if (len >= criteria_size) {
+        fprintf(stderr, "Search too long\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Paging alone still needs the UIDs of every message
+    if (len == 0) {
+        snprintf(criteria, criteria_size, "ALL");
+    } else {
+        criteria[len - 1] = '\0';
+    }
+}
+
+int append_search_text(char* criteria, int criteria_size, char* key, char* text) {
+    char escaped[FOLDER_SIZE];
+
+    // Quoted strings are 7-bit, RFC 3501 4.3, so other text goes as a literal
+    if (has_non_ascii(text)) {
+        return snprintf(criteria, criteria_size, "%s {%zu}\r\n%s ", key, strlen(text), text);
+    }
+    escape_special_char(text, escaped, sizeof(escaped));
+    return snprintf(criteria, criteria_size, "%s \"%s\" ", key, escaped);
+}
+
+int format_search_date(char* input, char* output, int output_size) {
+    struct tm date;
+    char* end;
+
+    memset(&date, 0, sizeof(date));
+    end = strptime(input, "%Y-%m-%d", &date);
+    if (end == NULL || *end != '\0') {
+        memset(&date, 0, sizeof(date));
+        end = strptime(input, "%d-%b-%Y", &date);
+    }
+    if (end == NULL || *end != '\0') {
+        return -1;
+    }
+
+    // The month names of the C locale are the ones IMAP expects
+    strftime(output, output_size, "%d-%b-%Y", &date);
+    return 0;
+}
+
+int has_non_ascii(char* text) {
+    for (; *text != '\0'; text++) {
+        if ((unsigned char)*text >= 0x80) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int build_uid_set(int* uids, int first, int last, char* uid_set, int uid_set_size) {
+    int len = 0, i = first;
+
+    // Consecutive UIDs become one range, and the set stops before it outgrows the batch or the command
+    while (i < last && i - first < LIST_BATCH_SIZE) {
+        char range[MSG_NUM_STR_SIZE * 2 + 3];
+        int end = i, range_len;
+
+        while (end + 1 < last && end + 1 - first < LIST_BATCH_SIZE && uids[end + 1] == uids[end] + 1) {
+            end++;
+        }
+        if (end > i) {
+            range_len = snprintf(range, sizeof(range), "%s%d:%d", len > 0 ? "," : "", uids[i], uids[end]);
+        } else {
+            range_len = snprintf(range, sizeof(range), "%s%d", len > 0 ? "," : "", uids[i]);
+        }
+        if (len + range_len >= uid_set_size) {
+            break;
+        }
+        memcpy(uid_set + len, range, range_len + 1);
+        len += range_len;
+        i = end + 1;
+    }
+    return i;
+}
+
+void list_literal_handler(client_t* client, int message_num, int literal_size, void* context) {
+    char* header = (char*)arena_alloc(&client->arena, literal_size + 1);
+    read_literal(client, header, literal_size);
+    header[literal_size] = '\0';
+
+    // Each message is done once its line is printed, so the arena is reused for the next one
+    printf("%d: ", message_num);
+    print_list_subject(header, client->decode);
+    reset_arena(&client->arena);
+}
+
+void print_list_subject(char* header, int decode) {
+    print_subject(find_list_subject(header), decode);
+}
+
+void print_subject(view_t subject, int decode) {
+    if (subject.data != NULL && decode) {
+        write_decoded_header(subject, stdout);
+    } else if (subject.data != NULL) {
+        write_unfolded(subject, stdout);
+    } else {
+        printf("<No subject>");
+    }
+    printf("\n");
+}
+
+view_t find_list_subject(char* header) {
+    view_t subject = find_header_field(header, "Subject");
+
+    // The list leaves out the whitespace at the start of the subject, folded or not
+    while (subject.len > 0) {
+        if (subject.data[0] == ' ' || subject.data[0] == '\t') {
+            subject.data++;
+            subject.len--;
+        } else if (subject.len >= 2 && subject.data[0] == '\r' && subject.data[1] == '\n') {
+            subject.data += 2;
+            subject.len -= 2;
+        } else {
+            break;
+        }
+    }
+    return subject;
+}
+
+void open_list_cache(client_t* client) {
+    static char select_options[BUFFER_SIZE];
+    list_cache_t* cache = (list_cache_t*)allocate(sizeof(list_cache_t));
+
+    cache->entries = NULL;
+    cache->size = 0;
+    init_arena(&cache->strings, 0);
+    clear_list_cache(cache);
+    get_cache_path(client, ".list", cache->path, sizeof(cache->path));
+    load_list_cache(cache);
+    client->list_cache = cache;
+
+    // The capabilities before login often leave out the extensions, so wait for the ones after it
+    if (!has_capability(client, "CONDSTORE") && !has_capability(client, "QRESYNC")) {
+        wait_all_commands(client);
+        if (client->capabilities == NULL) {
+            send_command(client, "CAPABILITY", NULL, NULL);
+            wait_all_commands(client);
+        }
+    }
+
+    // QRESYNC reports the expunged UIDs during SELECT, CONDSTORE at least gives the modification sequence
+    if (has_capability(client, "QRESYNC") && cache->uid_validity > 0 && cache->highest_modseq > 0) {
+        send_command(client, "ENABLE QRESYNC", NULL, NULL);
+        snprintf(select_options, sizeof(select_options), "(QRESYNC (%lu %llu))", cache->uid_validity, cache->highest_modseq);
+        client->select_options = select_options;
+    } else if (has_capability(client, "CONDSTORE") || has_capability(client, "QRESYNC")) {
+        client->select_options = "(CONDSTORE)";
+    }
+}
+
+void get_cache_path(client_t* client, char* extension, char* path, int path_size) {
+    char username[FOLDER_SIZE];
+    char server_name[FOLDER_SIZE];
+    char folder[FOLDER_SIZE];
+
+    if (mkdir(client->cache_dir, 0700) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create cache directory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    escape_file_name(client->username, username, sizeof(username));
+    escape_file_name(client->server_name, server_name, sizeof(server_name));
+    escape_file_name(client->folder, folder, sizeof(folder));
+    snprintf(path, path_size, "%s/%s_%s_%s%s", client->cache_dir, username, server_name, folder, extension);
+}
+
+void escape_file_name(char* input, char* output, int output_size) {
+    int output_len = 0;
+
+    // Anything but letters, digits, dots and dashes is written as %XX, so the parts cannot run together
+    while (*input && output_len < output_size - 4) {
+        unsigned char c = *input++;
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '.' || c == '-') {
+            output[output_len++] = c;
+        } else {
+            output_len += snprintf(output + output_len, output_size - output_len, "%%%02X", c);
+        }
+    }
+    output[output_len] = '\0';
+}
+
+void load_list_cache(list_cache_t* cache) {
+    char version[BUFFER_SIZE];
+    int count;
+    FILE* file = fopen(cache->path, "rb");
+
+    if (file == NULL) {
+        return;
+    }
+
+    // A file from another version or a broken file is treated as no cache
+    if (fgets(version, sizeof(version), file) == NULL || strcmp(version, LIST_CACHE_VERSION "\n") != 0
+            || fscanf(file, "%lu %lu %llu %d", &cache->uid_validity, &cache->uid_next, &cache->highest_modseq, &count) != 4
+            || fgetc(file) != '\n' || count < 0) {
+        fclose(file);
+        clear_list_cache(cache);
+        return;
+    }
+
+    // The fields take less room than the file, so they all fit in the first block
+    struct stat file_stat;
+    cache->entries = (cache_entry_t*)allocate(sizeof(cache_entry_t) * (count > 0 ? count : 1));
+    cache->size = count > 0 ? count : 1;
+    if (fstat(fileno(file), &file_stat) == 0) {
+        init_arena(&cache->strings, file_stat.st_size);
+    }
+
+    for (int i = 0; i < count; i++) {
+        cache_entry_t* entry = &cache->entries[i];
+        int subject_len, from_len, date_len;
+
+        entry->subject = entry->from = entry->date = NULL;
+        if (fscanf(file, "%d %d %d %d", &entry->uid, &subject_len, &from_len, &date_len) != 4 || fgetc(file) != '\n'
+                || !read_cache_field(file, subject_len, &cache->strings, &entry->subject)
+                || !read_cache_field(file, from_len, &cache->strings, &entry->from)
+                || !read_cache_field(file, date_len, &cache->strings, &entry->date)
+                || fgetc(file) != '\n') {
+            cache->count = i;
+            fclose(file);
+            clear_list_cache(cache);
+            return;
+        }
+        cache->count = i + 1;
+    }
+    fclose(file);
+}
+
+int read_cache_field(FILE* file, int field_len, arena_t* strings, char** field) {
+    // A missing field is stored with length -1
+    if (field_len < 0) {
+        *field = NULL;
+        return 1;
+    }
+
+    *field = (char*)arena_alloc(strings, field_len + 1);
+    if (fread(*field, 1, field_len, file) != (size_t)field_len) {
+        return 0;
+    }
+    (*field)[field_len] = '\0';
+    return 1;
+}
+
+void save_list_cache(list_cache_t* cache) {
+    char temp_path[PATH_MAX + 8];
+
+    if (!cache->changed) {
+        return;
+    }
+
+    // Write a new file and move it over the old one, so an interrupted run never leaves half a cache
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", cache->path);
+    FILE* file = fopen(temp_path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Failed to open cache file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(file, "%s\n%lu %lu %llu %d\n", LIST_CACHE_VERSION, cache->uid_validity, cache->uid_next, cache->highest_modseq, cache->count);
+    for (int i = 0; i < cache->count; i++) {
+        cache_entry_t* entry = &cache->entries[i];
+        fprintf(file, "%d %d %d %d\n%s%s%s\n", entry->uid,
+                entry->subject ? (int)strlen(entry->subject) : -1,
+                entry->from ? (int)strlen(entry->from) : -1,
+                entry->date ? (int)strlen(entry->date) : -1,
+                entry->subject ? entry->subject : "", entry->from ? entry->from : "", entry->date ? entry->date : "");
+    }
+
+    if (fclose(file) != 0 || rename(temp_path, cache->path) < 0) {
+        fprintf(stderr, "Failed to write cache file\n");
+        exit(EXIT_FAILURE);
+    }
+    cache->changed = 0;
+}
+
+void clear_list_cache(list_cache_t* cache) {
+    free_arena(&cache->strings);
+    free(cache->entries);
+    cache->entries = NULL;
+    cache->count = 0;
+    cache->size = 0;
+    cache->uid_validity = 0;
+    cache->uid_next = 1;
+    cache->highest_modseq = 0;
+    cache->changed = 1;
+}
+
+int find_cache_entry(list_cache_t* cache, int uid) {
+    int low = 0, high = cache->count;
+
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (cache->entries[middle].uid < uid) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+void remove_cached_uids(list_cache_t* cache, char* uid_set) {
+    range_t* ranges;
+    int range_count = parse_sequence_set(uid_set, INT_MAX, &ranges);
+    char* removed = (char*)allocate(cache->count + 1);
+    int kept = 0;
+
+    memset(removed, 0, cache->count + 1);
+
+    // Mark the entries in each range, then close the gaps in one pass
+    for (int i = 0; i < range_count; i++) {
+        for (int j = find_cache_entry(cache, ranges[i].first); j < cache->count && cache->entries[j].uid <= ranges[i].last; j++) {
+            removed[j] = 1;
+        }
+    }
+    free(ranges);
+
+    // The fields of the removed entries stay in the arena until the cache is cleared
+    for (int i = 0; i < cache->count; i++) {
+        if (!removed[i]) {
+            cache->entries[kept++] = cache->entries[i];
+        }
+    }
+    free(removed);
+    if (kept != cache->count) {
+        cache->count = kept;
+        cache->changed = 1;
+    }
+}
+
+void sync_list_cache(client_t* client) {
+    list_cache_t* cache = client->list_cache;
+    int exists = client->exists > 0 ? client->exists : 0;
+
+    // A new UIDVALIDITY means the cached UIDs may name other messages now
+    if (cache->uid_validity != client->uid_validity) {
+        clear_list_cache(cache);
+        cache->uid_validity = client->uid_validity;
+    }
+
+    // Only messages from the cached UIDNEXT onwards can be new
+    if (exists > 0 && (client->uid_next == 0 || client->uid_next > cache->uid_next)) {
+        fetch_cache_entries(client, cache->uid_next);
+    }
+
+    // Messages were expunged without VANISHED responses, so ask which UIDs remain
+    if (cache->count > exists) {
+        retain_cached_uids(client);
+    }
+
+    // Start over if the cache still disagrees with the folder
+    if (cache->count != exists) {
+        unsigned long uid_validity = cache->uid_validity;
+        clear_list_cache(cache);
+        cache->uid_validity = uid_validity;
+        if (exists > 0) {
+            fetch_cache_entries(client, 1);
+        }
+    }
+
+    unsigned long uid_next = client->uid_next;
+    if (uid_next == 0) {
+        uid_next = cache->count > 0 ? (unsigned long)cache->entries[cache->count - 1].uid + 1 : cache->uid_next;
+    }
+    if (cache->uid_next != uid_next || cache->highest_modseq != client->highest_modseq) {
+        cache->uid_next = uid_next;
+        cache->highest_modseq = client->highest_modseq;
+        cache->changed = 1;
+    }
+}
+
+void fetch_cache_entries(client_t* client, unsigned long first_uid) {
+    char uid_set[MSG_NUM_STR_SIZE * 2 + 2];
+    cache_fetch_t fetch = {client->list_cache, &client->arena, first_uid, -1, -1, NULL};
+    int count = client->list_cache->count;
+
+    snprintf(uid_set, sizeof(uid_set), "%lu:*", first_uid);
+    int tag_num = send_fetch_command(client, "UID FETCH", uid_set, "(" LIST_CACHE_ITEMS ")", LIST_CACHE_ITEM,
+            cache_literal_handler, cache_fetch_handler, &fetch);
+    if (wait_fetch(client, tag_num) < 0) {
+        fprintf(stderr, "Failed to fetch the list\n");
+        exit(3);
+    }
+    reset_arena(&client->arena);
+
+    // Servers send the messages in order, but the cache must stay sorted whatever happens
+    for (int i = count > 0 ? count : 1; i < client->list_cache->count; i++) {
+        if (client->list_cache->entries[i - 1].uid >= client->list_cache->entries[i].uid) {
+            qsort(client->list_cache->entries, client->list_cache->count, sizeof(cache_entry_t), compare_cache_entries);
+            break;
+        }
+    }
+}
+
+void cache_fetch_handler(client_t* client, int message_num, char* line, void* context) {
+    cache_fetch_t* fetch = (cache_fetch_t*)context;
+    long uid = get_fetch_attribute(line, "UID");
+
+    // Each response starts a new message, the UID may come before or after the header
+    // A header left without its UID stays in the arena, which is given back with the command
+    if (message_num != fetch->message_num) {
+        fetch->header = NULL;
+        fetch->uid = -1;
+        fetch->message_num = message_num;
+    }
+    if (uid > 0) {
+        fetch->uid = uid;
+        add_cache_entry(fetch);
+    }
+}
+
+void cache_literal_handler(client_t* client, int message_num, int literal_size, void* context) {
+    cache_fetch_t* fetch = (cache_fetch_t*)context;
+
+    fetch->header = (char*)arena_alloc(fetch->arena, literal_size + 1);
+    read_literal(client, fetch->header, literal_size);
+    fetch->header[literal_size] = '\0';
+    add_cache_entry(fetch);
+}
+
+void add_cache_entry(cache_fetch_t* fetch) {
+    list_cache_t* cache = fetch->cache;
+
+    if (fetch->uid <= 0 || fetch->header == NULL) {
+        return;
+    }
+
+    // UID FETCH n:* returns the last message even when its UID is below n
+    if ((unsigned long)fetch->uid >= fetch->first_uid) {
+        if (cache->count == cache->size) {
+            cache->size = cache->size > 0 ? cache->size * 2 : RETRIEVE_BATCH_SIZE;
+            cache->entries = (cache_entry_t*)reallocate(cache->entries, sizeof(cache_entry_t) * cache->size);
+        }
+
+        cache_entry_t* entry = &cache->entries[cache->count++];
+        entry->uid = fetch->uid;
+        entry->subject = copy_unfolded(find_list_subject(fetch->header), &cache->strings);
+        entry->from = copy_unfolded(find_header_field(fetch->header, "From"), &cache->strings);
+        entry->date = copy_unfolded(find_header_field(fetch->header, "Date"), &cache->strings);
+        cache->changed = 1;
+    }
+
+    // The header was the only thing in the arena
+    reset_arena(fetch->arena);
+    fetch->header = NULL;
+    fetch->uid = -1;
+}
+
+void retain_cached_uids(client_t* client) {
+    list_cache_t* cache = client->list_cache;
+    number_list_t uids = {NULL, 0, 0};
+    int kept = 0;
+
+    int tag_num = send_search(client, "UID SEARCH", "ALL", number_search_handler, &uids);
+    if (wait_command(client, tag_num) != RESPONSE_OK) {
+        free(uids.numbers);
+        return;
+    }
+    if (uids.count > 1) {
+        qsort(uids.numbers, uids.count, sizeof(int), compare_numbers);
+    }
+
+    for (int i = 0; i < cache->count; i++) {
+        if (uids.count > 0 && bsearch(&cache->entries[i].uid, uids.numbers, uids.count, sizeof(int), compare_numbers) != NULL) {
+            cache->entries[kept++] = cache->entries[i];
+        }
+    }
+    if (kept != cache->count) {
+        cache->count = kept;
+        cache->changed = 1;
+    }
+    free(uids.numbers);
+}
+
+void number_search_handler(client_t* client, long number, void* context) {
+    append_number((number_list_t*)context, number);
+}
+
+int compare_numbers(const void* a, const void* b) {
+    int first = *(const int*)a, second = *(const int*)b;
+    return (first > second) - (first < second);
+}
+
+int compare_cache_entries(const void* a, const void* b) {
+    return compare_numbers(&((const cache_entry_t*)a)->uid, &((const cache_entry_t*)b)->uid);
+}
+
+void print_list_cache(list_cache_t* cache, int decode) {
+    if (cache->count == 0) {
+        fprintf(stderr, "Mailbox is empty\n");
+        return;
+    }
+
+    // Message numbers follow the UID order
+    for (int i = 0; i < cache->count; i++) {
+        print_cached_subject(i + 1, cache->entries[i].subject, decode);
+    }
+}
+
+void print_cached_subject(int message_num, char* subject, int decode) {
+    if (subject != NULL && decode) {
+        view_t value = {subject, strlen(subject)};
+        printf("%d: ", message_num);
+        write_decoded_header(value, stdout);
+        printf("\n");
+    } else {
+        printf("%d: %s\n", message_num, subject ? subject : "<No subject>");
+    }
+}
+
+void idle_folder(client_t* client) {
+    idle_state_t* state = (idle_state_t*)mmap(NULL, sizeof(idle_state_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    int backoff = IDLE_BACKOFF_MIN_MS;
+    int ever_idled = 0;
+
+    if (state == MAP_FAILED) {
+        fprintf(stderr, "Failed to set up idle state\n");
+        exit(EXIT_FAILURE);
+    }
+    state->uid_validity = 0;
+    state->next_uid = 0;
+    srand(getpid());
+
+    // Each session runs in a process of its own, so whatever error ends it leaves this loop free to reconnect
+    while (1) {
+        int status;
+
+        state->idled = 0;
+        pid_t pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "Failed to start session\n");
+            exit(EXIT_FAILURE);
+        }
+        if (pid == 0) {
+            // The session must not outlive the loop printing for it
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            run_idle_session(client, state);
+        }
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+        }
+
+        // A first session that cannot log in or select the folder will not do better the next time
+        int code = WIFEXITED(status) ? WEXITSTATUS(status) : 2;
+        if (state->idled) {
+            ever_idled = 1;
+            backoff = IDLE_BACKOFF_MIN_MS;
+        } else if (!ever_idled && code != 2) {
+            exit(code);
+        }
+
+        // The random half of the delay keeps clients of a restarted server from all coming back at once
+        int delay = backoff / 2 + rand() % (backoff / 2 + 1);
+        struct timespec pause = {delay / 1000, (delay % 1000) * 1000000L};
+        fprintf(stderr, "Reconnecting in %.1f seconds\n", delay / 1000.0);
+        nanosleep(&pause, NULL);
+        backoff = backoff * 2 < IDLE_BACKOFF_MAX_MS ? backoff * 2 : IDLE_BACKOFF_MAX_MS;
+    }
+}
+
+void run_idle_session(client_t* client, idle_state_t* state) {
+    list_cache_t cache;
+
+    connect_server(client);
+    check_connection(client);
+    login_imap(client);
+    if (client->use_compress) {
+        start_compress(client);
+    }
+    select_folder(client);
+    wait_all_commands(client);
+
+    // New messages are fetched into a cache that is only kept in memory
+    cache.entries = NULL;
+    cache.size = 0;
+    init_arena(&cache.strings, 0);
+    clear_list_cache(&cache);
+    client->list_cache = &cache;
+
+    // A new UIDVALIDITY means the old UIDs may name other messages, so only mail from now on is new
+    if (state->next_uid == 0 || state->uid_validity != client->uid_validity) {
+        state->uid_validity = client->uid_validity;
+        state->next_uid = client->uid_next;
+
+        // Without UIDNEXT the next UID has to be found from the messages already there
+        if (state->next_uid == 0) {
+            state->next_uid = 1;
+            if (client->exists > 0) {
+                fetch_cache_entries(client, 1);
+                if (cache.count > 0) {
+                    state->next_uid = cache.entries[cache.count - 1].uid + 1;
+                }
+                clear_list_cache(&cache);
+            }
+        }
+    } else if (client->uid_next == 0 || client->uid_next > state->next_uid) {
+        // Mail that arrived while the last session was down
+        print_new_messages(client, state);
+    }
+
+    int known = client->exists;
+    while (1) {
+        int tag_num = send_command(client, "IDLE", NULL, NULL);
+        pending_t* pending = &client->pending[tag_num % MAX_PENDING];
+        long long restart_time = get_time_ms() + IDLE_RESTART_MS;
+        long long now;
+
+        // New messages end the IDLE once the server has accepted it, RFC 2177 servers may drop it after 30 minutes
+        client->continued = 0;
+        while (pending->status == RESPONSE_PENDING && (!client->continued || client->exists <= known)
+                && (now = get_time_ms()) < restart_time) {
+            if (wait_readable(client, restart_time - now)) {
+                dispatch_response(client);
+            }
+            if (client->continued) {
+                state->idled = 1;
+            }
+
+            // Expunged messages lower the count the next EXISTS is compared with
+            if (client->exists < known) {
+                known = client->exists;
+            }
+        }
+
+        if (pending->status == RESPONSE_PENDING && send_data(client, "DONE\r\n", strlen("DONE\r\n")) < 0) {
+            fprintf(stderr, "Failed to send DONE\n");
+            exit(2);
+        }
+        if (wait_command(client, tag_num) != RESPONSE_OK) {
+            fprintf(stderr, "IDLE failure\n");
+            exit(3);
+        }
+
+        if (client->exists > known) {
+            print_new_messages(client, state);
+        }
+        known = client->exists;
+    }
+}
+
+int wait_readable(client_t* client, long long timeout_ms) {
+    struct pollfd connection = {client->connfd, POLLIN, 0};
+
+    // Bytes already read into the buffer, held by TLS or waiting to be inflated would never wake poll
+    if (client->reader.start < client->reader.end || (client->tls != NULL && SSL_pending(client->tls) > 0)
+            || (client->compress != NULL && client->compress->inflater.avail_in > 0)) {
+        return 1;
+    }
+    return poll(&connection, 1, timeout_ms) > 0;
+}
+
+void print_new_messages(client_t* client, idle_state_t* state) {
+    list_cache_t* cache = client->list_cache;
+
+    fetch_cache_entries(client, state->next_uid);
+
+    // New messages have the highest UIDs, so they are the last ones in the folder
+    for (int i = 0; i < cache->count; i++) {
+        print_cached_subject(client->exists - cache->count + 1 + i, cache->entries[i].subject, client->decode);
+    }
+    if (cache->count > 0) {
+        state->next_uid = cache->entries[cache->count - 1].uid + 1;
+    }
+    fflush(stdout);
+    clear_list_cache(cache);
+}
+
+char* load_stored_message(client_t* client, message_store_t* store, int* message_size) {
+    long uid = -1;
+
+    // Only the UID crosses the network when the message is stored already
+    int tag_num = send_fetch_command(client, "FETCH", client->message_set, "(UID)", NULL, NULL, message_uid_handler, &uid);
+    if (wait_command(client, tag_num) != RESPONSE_OK || uid <= 0) {
+        return NULL;
+    }
+
+    open_message_store(client, store);
+    char* message = find_stored_message(store, uid, message_size);
+    if (message != NULL) {
+        return message;
+    }
+
+    // Append the message to the store, then read it back through the new mapping
+    char uid_set[MSG_NUM_STR_SIZE + 2];
+    snprintf(uid_set, sizeof(uid_set), "%ld", uid);
+    store->fetch_uid = uid;
+    tag_num = send_fetch_command(client, "UID FETCH", uid_set, "BODY.PEEK[]", "BODY[]", store_message_handler, NULL, store);
+    if (wait_fetch(client, tag_num) <= 0) {
+        close_message_store(store);
+        return NULL;
+    }
+    map_message_store(store);
+
+    // The caller only closes the store of a message it got
+    message = find_stored_message(store, uid, message_size);
+    if (message == NULL) {
+        close_message_store(store);
+    }
+    return message;
+}
+
+void message_uid_handler(client_t* client, int message_num, char* line, void* context) {
+    long uid = get_fetch_attribute(line, "UID");
+
+    if (uid > 0) {
+        *(long*)context = uid;
+    }
+}
+
+void open_message_store(client_t* client, message_store_t* store) {
+    char index_path[PATH_MAX], segment_path[PATH_MAX];
+    store_header_t header;
+    struct stat fd_stat, path_stat;
+
+    get_cache_path(client, ".idx", index_path, sizeof(index_path));
+    get_cache_path(client, ".seg", segment_path, sizeof(segment_path));
+    store->index_map = NULL;
+    store->segment_map = NULL;
+    store->index_size = 0;
+    store->segment_size = 0;
+
+    while (1) {
+        store->index_fd = open(index_path, O_RDWR | O_CREAT, 0600);
+        store->segment_fd = open(segment_path, O_RDWR | O_CREAT | O_APPEND, 0600);
+        if (store->index_fd < 0 || store->segment_fd < 0) {
+            fprintf(stderr, "Failed to open message store\n");
+            exit(EXIT_FAILURE);
+        }
+
+        flock(store->index_fd, LOCK_EX);
+        if (pread(store->index_fd, &header, sizeof(header), 0) == sizeof(header)
+                && memcmp(header.magic, STORE_MAGIC, sizeof(header.magic)) == 0
+                && header.uid_validity == client->uid_validity) {
+            flock(store->index_fd, LOCK_UN);
+            break;
+        }
+
+        // Another run may have put new files in place while this one waited for the lock
+        if (fstat(store->index_fd, &fd_stat) == 0 && stat(index_path, &path_stat) == 0
+                && fd_stat.st_dev == path_stat.st_dev && fd_stat.st_ino == path_stat.st_ino) {
+            replace_message_store(client, store);
+            break;
+        }
+        close(store->index_fd);
+        close(store->segment_fd);
+    }
+
+    map_message_store(store);
+}
+
+void replace_message_store(client_t* client, message_store_t* store) {
+    char path[PATH_MAX], temp_path[PATH_MAX];
+    store_header_t header;
+
+    // A new UIDVALIDITY means the stored UIDs may name other messages now, so both files start again
+    get_cache_path(client, ".seg-new", temp_path, sizeof(temp_path));
+    int segment_fd = open(temp_path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0600);
+    get_cache_path(client, ".seg", path, sizeof(path));
+    if (segment_fd < 0 || rename(temp_path, path) < 0) {
+        fprintf(stderr, "Failed to write message store\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // The empty segment goes first, so a run opening the files in between ignores every old record
+    memcpy(header.magic, STORE_MAGIC, sizeof(header.magic));
+    header.uid_validity = client->uid_validity;
+    get_cache_path(client, ".idx-new", temp_path, sizeof(temp_path));
+    int index_fd = open(temp_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    get_cache_path(client, ".idx", path, sizeof(path));
+    if (index_fd < 0 || pwrite(index_fd, &header, sizeof(header), 0) != sizeof(header) || rename(temp_path, path) < 0) {
+        fprintf(stderr, "Failed to write message store\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Closing the old index releases its lock, runs waiting on it find the new files
+    close(store->index_fd);
+    close(store->segment_fd);
+    store->index_fd = index_fd;
+    store->segment_fd = segment_fd;
+}
+
+void map_message_store(message_store_t* store) {
+    struct stat index_stat, segment_stat;
+
+    unmap_message_store(store);
+    if (fstat(store->index_fd, &index_stat) < 0 || fstat(store->segment_fd, &segment_stat) < 0) {
+        fprintf(stderr, "Failed to read message store\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Files only grow, so a mapping of the current size stays valid while other runs append
+    if (index_stat.st_size > 0) {
+        store->index_map = mmap(NULL, index_stat.st_size, PROT_READ, MAP_SHARED, store->index_fd, 0);
+        store->index_size = index_stat.st_size;
+    }
+    if (segment_stat.st_size > 0) {
+        store->segment_map = mmap(NULL, segment_stat.st_size, PROT_READ, MAP_SHARED, store->segment_fd, 0);
+        store->segment_size = segment_stat.st_size;
+    }
+    if (store->index_map == MAP_FAILED || store->segment_map == MAP_FAILED) {
+        fprintf(stderr, "Failed to map message store\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void unmap_message_store(message_store_t* store) {
+    if (store->index_map != NULL) {
+        munmap(store->index_map, store->index_size);
+    }
+    if (store->segment_map != NULL) {
+        munmap(store->segment_map, store->segment_size);
+    }
+    store->index_map = NULL;
+    store->segment_map = NULL;
+    store->index_size = 0;
+    store->segment_size = 0;
+}
+
+void close_message_store(message_store_t* store) {
+    unmap_message_store(store);
+    close(store->index_fd);
+    close(store->segment_fd);
+}
+
+char* find_stored_message(message_store_t* store, long uid, int* message_size) {
+    size_t record_count;
+
+    if (store->index_map == NULL || store->index_size < sizeof(store_header_t)) {
+        return NULL;
+    }
+    record_count = (store->index_size - sizeof(store_header_t)) / sizeof(store_record_t);
+
+    // The newest record of a UID wins, and a record past the mapped segment is ignored
+    for (size_t i = record_count; i > 0; i--) {
+        store_record_t record;
+        memcpy(&record, store->index_map + sizeof(store_header_t) + (i - 1) * sizeof(store_record_t), sizeof(record));
+        if (record.uid == uid && record.offset + record.length < store->segment_size) {
+            *message_size = record.length;
+            return store->segment_map + record.offset;
+        }
+    }
+    return NULL;
+}
+
+void store_message_handler(client_t* client, int message_num, int literal_size, void* context) {
+    message_store_t* store = (message_store_t*)context;
+    struct stat segment_stat;
+    store_record_t record;
+
+    // Only one run appends at a time, the index record goes last so it never points at missing bytes
+    flock(store->index_fd, LOCK_EX);
+    if (fstat(store->segment_fd, &segment_stat) < 0) {
+        fprintf(stderr, "Failed to read message store\n");
+        exit(EXIT_FAILURE);
+    }
+
+    FILE* segment = fdopen(dup(store->segment_fd), "ab");
+    if (segment == NULL) {
+        fprintf(stderr, "Failed to write message store\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Every message is followed by a NUL, so the mapped bytes can be read as a string
+    write_literal(client, segment, literal_size);
+    fputc('\0', segment);
+    if (fclose(segment) != 0) {
+        fprintf(stderr, "Failed to write message store\n");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&record, 0, sizeof(record));
+    record.uid = store->fetch_uid;
+    record.offset = segment_stat.st_size;
+    record.length = literal_size;
+    off_t index_end = lseek(store->index_fd, 0, SEEK_END);
+    if (index_end < 0 || pwrite(store->index_fd, &record, sizeof(record), index_end) != sizeof(record)) {
+        fprintf(stderr, "Failed to write message store\n");
+        exit(EXIT_FAILURE);
+    }
+    flock(store->index_fd, LOCK_UN);
+}
+
+void index_folder(client_t* client) {
+    index_fetch_t fetch = {{NULL, 0, 0}, {NULL, 0, 0}, 0, NULL};
+    index_builder_t builder;
+    text_index_t index;
+    message_store_t store;
+    char uid_set[BUFFER_SIZE / 2];
+    int record_count;
+
+    // A new UIDVALIDITY means the indexed UIDs may name other messages now, so the index starts again
+    wait_all_commands(client);
+    int has_index = open_text_index(client, &index);
+    if (has_index && index.header->uid_validity != client->uid_validity) {
+        close_text_index(&index);
+        has_index = 0;
+    }
+    fetch.last_uid = has_index ? index.header->last_uid : 0;
+
+    // The set n:* always holds the last message, even when its UID is below n
+    snprintf(uid_set, sizeof(uid_set), "%u:*", fetch.last_uid + 1);
+    int tag_num = send_fetch_command(client, "UID FETCH", uid_set, "(UID)", NULL, NULL, index_uid_handler, &fetch);
+    if (wait_command(client, tag_num) != RESPONSE_OK) {
+        fprintf(stderr, "Failed to fetch UIDs\n");
+        exit(3);
+    }
+
+    // Messages missing from the store are fetched into it first, a few batches in flight
+    open_message_store(client, &store);
+    fetch.store = &store;
+    store_record_t* records = sort_store_records(&store, &record_count);
+    number_list_t missing = {NULL, 0, 0};
+    for (int i = 0; i < fetch.uids.count; i++) {
+        if (find_store_record(records, record_count, fetch.uids.numbers[i]) == NULL) {
+            append_number(&missing, fetch.uids.numbers[i]);
+        }
+    }
+    free(records);
+
+    int* tags = (int*)allocate(sizeof(int) * (missing.count > 0 ? missing.count : 1));
+    int batch_count = 0, waited = 0;
+    for (int i = 0; i < missing.count; ) {
+        i = build_uid_set(missing.numbers, i, missing.count, uid_set, sizeof(uid_set));
+        if (batch_count - waited == WORKER_PIPELINE_DEPTH && wait_fetch(client, tags[waited++]) < 0) {
+            fprintf(stderr, "Failed to fetch messages\n");
+            exit(3);
+        }
+        tags[batch_count++] = send_fetch_command(client, "UID FETCH", uid_set, "BODY.PEEK[]", "BODY[]", index_store_handler, NULL, &fetch);
+    }
+    while (waited < batch_count) {
+        if (wait_fetch(client, tags[waited++]) < 0) {
+            fprintf(stderr, "Failed to fetch messages\n");
+            exit(3);
+        }
+    }
+    free(tags);
+    free(missing.numbers);
+
+    // UIDs come in increasing order, so each posting is a small delta from the one before
+    memset(&builder, 0, sizeof(builder));
+    init_arena(&builder.terms, 0);
+    map_message_store(&store);
+    records = sort_store_records(&store, &record_count);
+    for (int i = 0; i < fetch.uids.count; i++) {
+        store_record_t* record = find_store_record(records, record_count, fetch.uids.numbers[i]);
+        if (record != NULL) {
+            index_message(&builder, record->uid, store.segment_map + record->offset, record->length, &client->arena);
+        }
+    }
+    free(records);
+    close_message_store(&store);
+
+    uint32_t last_uid = fetch.uids.count > 0 ? fetch.uids.numbers[fetch.uids.count - 1] : fetch.last_uid;
+    write_text_index(client, has_index ? &index : NULL, &builder, last_uid);
+    printf("Indexed %d new messages\n", builder.document_count);
+
+    if (has_index) {
+        close_text_index(&index);
     }
+    free_index_builder(&builder);
+    free(fetch.message_nums.numbers);
+    free(fetch.uids.numbers);
 }
 
-void login_imap(client_t* client) {
-    char send_buffer[BUFFER_SIZE];
-    char receive_buffer[BUFFER_SIZE];
-    int bytes_received;
-    char tag[TAG_SIZE];
-    char check_buffer[BUFFER_SIZE];
+void index_uid_handler(client_t* client, int message_num, char* line, void* context) {
+    index_fetch_t* fetch = (index_fetch_t*)context;
+    long uid = get_fetch_attribute(line, "UID");
 
-    // Generate tag
-    snprintf(tag, sizeof(tag), "A%04d", client->tag_counter++);
+    if (uid > fetch->last_uid && (fetch->uids.count == 0 || uid > fetch->uids.numbers[fetch->uids.count - 1])) {
+        append_number(&fetch->message_nums, message_num);
+        append_number(&fetch->uids, uid);
+    }
+}
+
+void index_store_handler(client_t* client, int message_num, int literal_size, void* context) {
+    index_fetch_t* fetch = (index_fetch_t*)context;
+    int low = 0, high = fetch->message_nums.count - 1;
+
+    // The sequence numbers say which UID the message has, wherever the server puts the UID in the response
+    while (low <= high) {
+        int middle = (low + high) / 2;
+        if (fetch->message_nums.numbers[middle] == message_num) {
+            fetch->store->fetch_uid = fetch->uids.numbers[middle];
+            store_message_handler(client, message_num, literal_size, fetch->store);
+            return;
+        }
+        if (fetch->message_nums.numbers[middle] < message_num) {
+            low = middle + 1;
+        } else {
+            high = middle - 1;
+        }
+    }
+}
 
-    // Generate login command
-    snprintf(send_buffer, sizeof(send_buffer), "%s LOGIN %s %s\r\n", tag, client->username, client->password);
+store_record_t* sort_store_records(message_store_t* store, int* record_count) {
+    size_t count = store->index_size > sizeof(store_header_t) ? (store->index_size - sizeof(store_header_t)) / sizeof(store_record_t) : 0;
+    store_record_t* records = (store_record_t*)allocate(sizeof(store_record_t) * (count > 0 ? count : 1));
+    int kept = 0;
 
-    // Send login command
-    if (send(client->connfd, send_buffer, strlen(send_buffer), 0) < 0) {
-        fprintf(stderr, "Failed to send login command\n");
-        exit(EXIT_FAILURE);
+    // A record past the mapped segment is ignored, as it is by the lookup of a single message
+    for (size_t i = 0; i < count; i++) {
+        memcpy(&records[kept], store->index_map + sizeof(store_header_t) + i * sizeof(store_record_t), sizeof(store_record_t));
+        if (records[kept].offset + records[kept].length < store->segment_size) {
+            kept++;
+        }
     }
+    qsort(records, kept, sizeof(store_record_t), compare_store_records);
 
-    // Receive login response
-    bytes_received = recv(client->connfd, receive_buffer, sizeof(receive_buffer) - 1, 0);
-    if (bytes_received < 0) {
-        fprintf(stderr, "Failed to receive login response\n");
-        exit(EXIT_FAILURE);
+    // The newest record of a UID wins
+    *record_count = 0;
+    for (int i = 0; i < kept; i++) {
+        if (*record_count == 0 || records[*record_count - 1].uid != records[i].uid) {
+            records[(*record_count)++] = records[i];
+        }
     }
-    receive_buffer[bytes_received] = '\0';
+    return records;
+}
 
-    // Generate the response checker
-    snprintf(check_buffer, sizeof(check_buffer), LOGIN_RESPONSE, tag);
+int compare_store_records(const void* first, const void* second) {
+    const store_record_t* a = (const store_record_t*)first;
+    const store_record_t* b = (const store_record_t*)second;
 
-    // Check if login was successful
-    if (strstr(receive_buffer, check_buffer) == NULL) {
-        printf("Login failure\n");
-        exit(3);
+    // The segment only grows, so a later record has a larger offset
+    if (a->uid != b->uid) {
+        return a->uid < b->uid ? -1 : 1;
     }
+    return a->offset > b->offset ? -1 : a->offset < b->offset;
 }
 
-void select_folder(client_t* client) {
-    char send_buffer[BUFFER_SIZE];
-    char receive_buffer[BUFFER_SIZE];
-    int bytes_received;
-    char tag[TAG_SIZE];
-    char check_buffer[BUFFER_SIZE];
-    char escaped_folder[FOLDER_SIZE];
-
-    // Generate tag
-    snprintf(tag, sizeof(tag), "A%04d", client->tag_counter++);
+store_record_t* find_store_record(store_record_t* records, int record_count, uint32_t uid) {
+    int low = 0, high = record_count - 1;
 
-    // Generate select command
-    escape_special_char(client->folder, escaped_folder, FOLDER_SIZE);
-    if (strchr(client->folder, ' ') != NULL || strchr(client->folder, '"') != NULL) {
-        snprintf(send_buffer, sizeof(send_buffer), "%s SELECT \"%s\"\r\n", tag, escaped_folder);
-    } else {
-        snprintf(send_buffer, sizeof(send_buffer), "%s SELECT %s\r\n", tag, escaped_folder);
+    while (low <= high) {
+        int middle = (low + high) / 2;
+        if (records[middle].uid == uid) {
+            return &records[middle];
+        }
+        if (records[middle].uid < uid) {
+            low = middle + 1;
+        } else {
+            high = middle - 1;
+        }
     }
+    return NULL;
+}
 
-    // Send select command
-    if (send(client->connfd, send_buffer, strlen(send_buffer), 0) < 0) {
-        fprintf(stderr, "Failed to send select command\n");
-        exit(EXIT_FAILURE);
+void index_message(index_builder_t* builder, uint32_t uid, char* message, int message_size, arena_t* arena) {
+    static char* const fields[] = {"From", "To", "Cc", "Subject"};
+    char* text;
+    size_t text_len;
+
+    // Header fields are decoded as parse prints them, each one apart so a phrase cannot run from one into the next
+    builder->position = 0;
+    for (int i = 0; i < (int)(sizeof(fields) / sizeof(fields[0])); i++) {
+        FILE* output = open_memstream(&text, &text_len);
+        if (output == NULL) {
+            fprintf(stderr, "Failed to index message\n");
+            exit(EXIT_FAILURE);
+        }
+        write_decoded_header(find_header_field(message, fields[i]), output);
+        fclose(output);
+        index_text(builder, text, text_len);
+        builder->position++;
+        free(text);
     }
 
-    // Receive select response
-    bytes_received = recv(client->connfd, receive_buffer, sizeof(receive_buffer) - 1, 0);
-    if (bytes_received < 0) {
-        fprintf(stderr, "Failed to receive select response\n");
+    FILE* output = open_memstream(&text, &text_len);
+    if (output == NULL) {
+        fprintf(stderr, "Failed to index message\n");
         exit(EXIT_FAILURE);
     }
-
-    receive_buffer[bytes_received] = '\0';
-    
-    // Generate response checker
-    snprintf(check_buffer, sizeof(check_buffer), SELECT_RESPONSE, tag);
-    
-    // Check if select was successful
-    if (strstr(receive_buffer, check_buffer) == NULL) {
-        printf("Folder not found\n");
-        exit(3);
+    write_message_text(message, message_size, output, arena);
+    fclose(output);
+    index_text(builder, text, text_len);
+    free(text);
+    end_index_document(builder, uid);
+
+    // The subject is kept as it is in the header, search decodes it as list does
+    if (builder->document_count == builder->document_size) {
+        builder->document_size = builder->document_size > 0 ? builder->document_size * 2 : RETRIEVE_BATCH_SIZE;
+        builder->documents = (text_index_document_t*)reallocate(builder->documents, sizeof(text_index_document_t) * builder->document_size);
+    }
+    view_t subject = find_list_subject(message);
+    text_index_document_t* document = &builder->documents[builder->document_count++];
+    document->uid = uid;
+    document->subject_len = subject.data != NULL ? subject.len : -1;
+    document->subject_offset = builder->subjects.len;
+    if (subject.data != NULL) {
+        append_bytes(&builder->subjects, subject.data, subject.len);
     }
 }
 
-void escape_special_char(char *input, char *output, int output_size) {
-    int j = 0;
+void write_message_text(char* message, int message_size, FILE* output, arena_t* arena) {
+    char* body = strstr(message, "\r\n\r\n");
+    char mime_version[MIME_FIELD_SIZE];
+    char* header;
+    mime_parser_t parser;
 
-    for (int i = 0; i < strlen(input) && j < output_size - 1; i++) {
-        if (input[i] == '"' || input[i] == '\\') {
-            if (j < output_size - 2) {
-                output[j++] = '\\';
-            } else {
-                break;
+    if (body == NULL) {
+        return;
+    }
+    body += strlen("\r\n\r\n");
+    header = (char*)arena_alloc(arena, body - message + 1);
+    memcpy(header, message, body - message);
+    header[body - message] = '\0';
+
+    // A MIME multipart goes through the parser for the part mime would print, a message mime would refuse has only its header indexed
+    init_mime_parser(&parser, output, arena, 1);
+    parse_mime_header(header, parser.root);
+    if (get_mime_header_value(header, "MIME-Version", mime_version, sizeof(mime_version))
+            && strncmp(mime_version, "1.0", strlen("1.0")) == 0
+            && strncmp(parser.root->media_type, "multipart/", strlen("multipart/")) == 0) {
+        if (parser.root->boundary[0] != '\0') {
+            parser.container = parser.root;
+            parser.state = MIME_STATE_PREAMBLE;
+            feed_mime_parser(&parser, body, message_size - (body - message));
+            end_mime_input(&parser);
+            if (parser.selected != NULL && parser.state != MIME_STATE_DONE) {
+                finish_decoding(&parser);
             }
         }
-        output[j++] = input[i];
+    } else if (strcmp(parser.root->media_type, "text/plain") == 0) {
+
+        // A plain text message is its own part, in whatever charset it has
+        select_mime_part(&parser, parser.root);
+        parser.current = parser.root;
+        parser.state = MIME_STATE_BODY;
+        write_mime_body(&parser, body, message_size - (body - message));
+        finish_decoding(&parser);
     }
-    output[j] = '\0'; // Null-terminate
+    free(parser.header);
+    reset_arena(arena);
 }
 
-void fetch_email(client_t* client) {
-    char send_buffer[BUFFER_SIZE];
-    char receive_buffer[BUFFER_SIZE];
-    int bytes_received, body_size;
-    char tag[TAG_SIZE];
-    char* body_start;
-
-    // Generate tag
-    snprintf(tag, sizeof(tag), "A%04d", client->tag_counter++);
+void index_text(index_builder_t* builder, char* text, int text_len) {
+    char token[TERM_MAX_SIZE];
+    char* current = text;
+    int token_len;
 
-    // Generate fetch command
-    snprintf(send_buffer, sizeof(send_buffer), "%s FETCH %d BODY.PEEK[]\r\n", tag, client->message_num);
+    while ((token_len = next_token(&current, text + text_len, token)) > 0) {
+        index_term_t* term = find_index_term(builder, token, token_len);
 
-    // Send fetch command
-    if (send(client->connfd, send_buffer, strlen(send_buffer), 0) < 0) {
-        fprintf(stderr, "Failed to send fetch command");
-        exit(EXIT_FAILURE);
+        // The first position of a term in the message puts it on the list to write out at the end
+        if (term->position_count == 0) {
+            if (builder->touched_count == builder->touched_size) {
+                builder->touched_size = builder->touched_size > 0 ? builder->touched_size * 2 : RETRIEVE_BATCH_SIZE;
+                builder->touched = (index_term_t**)reallocate(builder->touched, sizeof(index_term_t*) * builder->touched_size);
+            }
+            builder->touched[builder->touched_count++] = term;
+        }
+        if (term->position_count == term->position_size) {
+            term->position_size = term->position_size > 0 ? term->position_size * 2 : 4;
+            term->positions = (int*)reallocate(term->positions, sizeof(int) * term->position_size);
+        }
+        term->positions[term->position_count++] = builder->position++;
     }
+}
 
-    // Receive fetch response
-    bytes_received = recv(client->connfd, receive_buffer, sizeof(receive_buffer) - 1, MSG_PEEK);
-    if (bytes_received < 0) {
-        fprintf(stderr, "Failed to receive select response\n");
-        exit(EXIT_FAILURE);
+int next_token(char** current, char* end, char* token) {
+    unsigned char* position = (unsigned char*)*current;
+    int token_len = 0;
+
+    // Letters and digits make up a token, and so does every byte of UTF-8 outside ASCII
+    while (position < (unsigned char*)end && !isalnum(*position) && *position < 0x80) {
+        position++;
     }
-    receive_buffer[bytes_received] = '\0';
-    
-    body_start = strstr(receive_buffer, "\r\n");
-    if (sscanf(receive_buffer, "* %*d FETCH (BODY[] {%d}", &body_size) == 1 && body_start != NULL) {
-        body_start += 2;                        // Move past the \r\n to the start of the body
-        int body_index = body_start - receive_buffer;
-        print_response(client->connfd, body_index, body_size - 1);
-        printf("\n");
-        exit(0);
-    } else {
-        printf("Message not found\n");
-        exit(3);
+    while (position < (unsigned char*)end && (isalnum(*position) || *position >= 0x80)) {
+        if (token_len < TERM_MAX_SIZE) {
+            token[token_len++] = tolower(*position);
+        }
+        position++;
     }
+    *current = (char*)position;
+    return token_len;
 }
 
-void print_response(int connfd, int print_index, int print_size) {
-    int total_received = 0;
-    int bytes_received;
-    
-    char* print_buffer = (char*)malloc(sizeof(char) * (print_size + 1));
-    if (print_buffer == NULL) {
-        fprintf(stderr, "Memory allocation failure\n");
-        exit(EXIT_FAILURE);
+index_term_t* find_index_term(index_builder_t* builder, char* term, int term_len) {
+    uint32_t hash = 2166136261u;
+
+    for (int i = 0; i < term_len; i++) {
+        hash = (hash ^ (unsigned char)term[i]) * 16777619u;
     }
 
-    // Read the initial response line
-    if (print_index > 0) {
-        char response_buffer[print_index];
-        int response_bytes_received = recv(connfd, response_buffer, print_index, 0);
-        if (response_bytes_received < 0) {
-            fprintf(stderr, "Failed to receive header\n");
-            free(print_buffer);
-            exit(EXIT_FAILURE);
+    // The table is kept at most half full
+    if (builder->term_count * 2 >= builder->table_size) {
+        int old_size = builder->table_size;
+        index_term_t** old_table = builder->table;
+
+        builder->table_size = old_size > 0 ? old_size * 2 : INDEX_TABLE_SIZE;
+        builder->table = (index_term_t**)allocate(sizeof(index_term_t*) * builder->table_size);
+        memset(builder->table, 0, sizeof(index_term_t*) * builder->table_size);
+        for (int i = 0; i < old_size; i++) {
+            if (old_table[i] != NULL) {
+                int slot = old_table[i]->hash & (builder->table_size - 1);
+                while (builder->table[slot] != NULL) {
+                    slot = (slot + 1) & (builder->table_size - 1);
+                }
+                builder->table[slot] = old_table[i];
+            }
         }
+        free(old_table);
     }
 
-    // Read the entire parsed content
-    while (total_received < print_size) {
-        bytes_received = recv(connfd, print_buffer + total_received, print_size - total_received, 0);
-        if (bytes_received < 0) {
-            fprintf(stderr, "Failed to receive body content\n");
-            free(print_buffer);
-            exit(EXIT_FAILURE);
+    int slot = hash & (builder->table_size - 1);
+    while (builder->table[slot] != NULL) {
+        index_term_t* entry = builder->table[slot];
+        if (entry->hash == hash && entry->term_len == term_len && memcmp(entry->term, term, term_len) == 0) {
+            return entry;
         }
-        total_received += bytes_received;
+        slot = (slot + 1) & (builder->table_size - 1);
     }
 
-    print_buffer[total_received] = '\0'; // Null-terminate the buffer
-
-    // Print the parsed content
-    printf("%s", print_buffer);
-    free(print_buffer); // Free allocated memory
-    receive_remaining_response(connfd);
+    index_term_t* entry = (index_term_t*)arena_alloc(&builder->terms, sizeof(index_term_t));
+    memset(entry, 0, sizeof(index_term_t));
+    entry->term = (char*)arena_alloc(&builder->terms, term_len);
+    memcpy(entry->term, term, term_len);
+    entry->term_len = term_len;
+    entry->hash = hash;
+    builder->table[slot] = entry;
+    builder->term_count++;
+    return entry;
 }
 
-void receive_remaining_response(int connfd) {
-    char receive_buffer[BUFFER_SIZE];
-    int bytes_received;
-    
-    bytes_received = recv(connfd, receive_buffer, sizeof(receive_buffer) - 1, 0);
-    if (bytes_received < 0) {
-        fprintf(stderr, "Failed to receive remaining response");
-        exit(EXIT_FAILURE);
-    }
+void end_index_document(index_builder_t* builder, uint32_t uid) {
+    for (int i = 0; i < builder->touched_count; i++) {
+        index_term_t* term = builder->touched[i];
+        int previous = 0;
 
+        append_varint(&term->postings, uid - term->last_uid);
+        append_varint(&term->postings, term->position_count);
+        for (int j = 0; j < term->position_count; j++) {
+            append_varint(&term->postings, term->positions[j] - previous);
+            previous = term->positions[j];
+        }
+        term->last_uid = uid;
+        term->document_count++;
+        term->position_count = 0;
+    }
+    builder->touched_count = 0;
 }
 
-void parse_header_fields(client_t* client) {
-    parse_from(client);
-    parse_to(client);
-    parse_date(client);
-    parse_subject(client);
+void free_index_builder(index_builder_t* builder) {
+    for (int i = 0; i < builder->table_size; i++) {
+        if (builder->table[i] != NULL) {
+            free(builder->table[i]->postings.data);
+            free(builder->table[i]->positions);
+        }
+    }
+    free(builder->table);
+    free(builder->touched);
+    free(builder->documents);
+    free(builder->subjects.data);
+    free_arena(&builder->terms);
 }
 
-void parse_from(client_t* client) {
-    char send_buffer[BUFFER_SIZE];
-    char receive_buffer[BUFFER_SIZE];
-    int bytes_received, from_size;
-    char tag[TAG_SIZE];
-    char* from_start;
-
-    // Generate tag
-    snprintf(tag, sizeof(tag), "A%04d", client->tag_counter++);
+int open_text_index(client_t* client, text_index_t* index) {
+    char path[PATH_MAX];
+    struct stat index_stat;
 
-    // Generate parse from command
-    snprintf(send_buffer, sizeof(send_buffer), "%s FETCH %d BODY.PEEK[HEADER.FIELDS (FROM)]\r\n", tag, client->message_num);
-
-    // Send parse from command
-    if (send(client->connfd, send_buffer, strlen(send_buffer), 0) < 0) {
-        fprintf(stderr, "Failed to send parse from command");
-        exit(EXIT_FAILURE);
+    get_cache_path(client, TEXT_INDEX_EXTENSION, path, sizeof(path));
+    index->size = 0;
+    index->map = NULL;
+    index->fd = open(path, O_RDONLY);
+    if (index->fd < 0) {
+        return 0;
+    }
+    if (fstat(index->fd, &index_stat) < 0 || index_stat.st_size < (off_t)sizeof(text_index_header_t)) {
+        close(index->fd);
+        return 0;
     }
 
-    // Receive parse from response
-    bytes_received = recv(client->connfd, receive_buffer, sizeof(receive_buffer) - 1, MSG_PEEK);
-    if (bytes_received < 0) {
-        fprintf(stderr, "Failed to receive parse from response\n");
-        exit(EXIT_FAILURE);
-    }
-    receive_buffer[bytes_received] = '\0';
-    
-    from_start = strstr(receive_buffer, "\r\n");
-    if (sscanf(receive_buffer, "* %*d FETCH (BODY[HEADER.FIELDS (FROM)] {%d}", &from_size) == 1 && from_start != NULL) {
-        from_start += 2;        // Move past the \r\n to the start of the from
-        from_start += 6;        // Move past the "From: ":
-        int from_index = from_start - receive_buffer;
-        printf("From: ");
-        print_parsed_fields(client->connfd, from_index, from_size - 8);
-        printf("\n");
-    } else {
-        fprintf(stderr, "From response not found\n");
+    // The file is replaced whole by each update, so the mapping never changes under a search
+    index->map = mmap(NULL, index_stat.st_size, PROT_READ, MAP_PRIVATE, index->fd, 0);
+    if (index->map == MAP_FAILED) {
+        fprintf(stderr, "Failed to map text index\n");
         exit(EXIT_FAILURE);
     }
+    index->size = index_stat.st_size;
+    index->header = (text_index_header_t*)index->map;
+    if (memcmp(index->header->magic, TEXT_INDEX_MAGIC, sizeof(index->header->magic)) != 0
+            || index->header->documents_offset + (uint64_t)index->header->document_count * sizeof(text_index_document_t) > index->size
+            || index->header->terms_offset + (uint64_t)index->header->term_count * sizeof(text_index_term_t) > index->size
+            || index->header->strings_offset + index->header->strings_size > index->size) {
+        close_text_index(index);
+        return 0;
+    }
+    index->documents = (text_index_document_t*)(index->map + index->header->documents_offset);
+    index->terms = (text_index_term_t*)(index->map + index->header->terms_offset);
+    index->strings = (char*)(index->map + index->header->strings_offset);
+    return 1;
 }
 
-void parse_to(client_t* client) {
-    char send_buffer[BUFFER_SIZE];
-    char receive_buffer[BUFFER_SIZE];
-    int bytes_received, to_size;
-    char tag[TAG_SIZE];
-    char* to_start;
-
-    // Generate tag
-    snprintf(tag, sizeof(tag), "A%04d", client->tag_counter++);
-
-    // Generate parse to command
-    snprintf(send_buffer, sizeof(send_buffer), "%s FETCH %d BODY.PEEK[HEADER.FIELDS (TO)]\r\n", tag, client->message_num);
-
-    // Send parse to command
-    if (send(client->connfd, send_buffer, strlen(send_buffer), 0) < 0) {
-        fprintf(stderr, "Failed to send parse to command");
-        exit(EXIT_FAILURE);
+void close_text_index(text_index_t* index) {
+    if (index->map != NULL) {
+        munmap(index->map, index->size);
     }
+    close(index->fd);
+    index->map = NULL;
+    index->size = 0;
+}
 
-    // Receive parse to response
-    bytes_received = recv(client->connfd, receive_buffer, sizeof(receive_buffer) - 1, MSG_PEEK);
-    if (bytes_received < 0) {
-        fprintf(stderr, "Failed to receive parse to response\n");
-        exit(EXIT_FAILURE);
-    }
-    receive_buffer[bytes_received] = '\0';
+text_index_term_t* find_text_index_term(text_index_t* index, char* term, int term_len) {
+    int low = 0, high = (int)index->header->term_count - 1;
 
-    to_start = strstr(receive_buffer, "\r\n");
-    if (sscanf(receive_buffer, "* %*d FETCH (BODY[HEADER.FIELDS (TO)] {%d}", &to_size) == 1 && to_start != NULL) {
-        to_start += 2;          // Move past the \r\n to the start of the to
-        to_start += 4;          // Move past the "To: ":
-        int to_index = to_start - receive_buffer;
-        
-        if (to_size > 2) {
-            printf("To: ");
-            print_parsed_fields(client->connfd, to_index, to_size - 6);
-            printf("\n");
+    while (low <= high) {
+        int middle = (low + high) / 2;
+        text_index_term_t* entry = &index->terms[middle];
+        int order = compare_terms(index->strings + entry->term_offset, entry->term_len, term, term_len);
+        if (order == 0) {
+            return entry;
+        }
+        if (order < 0) {
+            low = middle + 1;
         } else {
-            printf("To:\n");
-            receive_remaining_response(client->connfd);
-        }   
+            high = middle - 1;
+        }
     }
+    return NULL;
 }
 
-void parse_date(client_t* client) {
-    char send_buffer[BUFFER_SIZE];
-    char receive_buffer[BUFFER_SIZE];
-    int bytes_received, date_size;
-    char tag[TAG_SIZE];
-    char* date_start;
-
-    // Generate tag
-    snprintf(tag, sizeof(tag), "A%04d", client->tag_counter++);
-
-    // Generate parse from command
-    snprintf(send_buffer, sizeof(send_buffer), "%s FETCH %d BODY.PEEK[HEADER.FIELDS (DATE)]\r\n", tag, client->message_num);
-
-    // Send parse from command
-    if (send(client->connfd, send_buffer, strlen(send_buffer), 0) < 0) {
-        fprintf(stderr, "Failed to send parse date command");
-        exit(EXIT_FAILURE);
+void write_text_index(client_t* client, text_index_t* index, index_builder_t* builder, uint32_t last_uid) {
+    char path[PATH_MAX], temp_path[PATH_MAX];
+    text_index_header_t header;
+    byte_buffer_t postings = {NULL, 0, 0}, records = {NULL, 0, 0}, strings = {NULL, 0, 0};
+    int old_count = index != NULL ? index->header->term_count : 0;
+    int old_documents = index != NULL ? index->header->document_count : 0;
+
+    // Terms of the builder in the same order as the terms of the old index
+    index_term_t** terms = (index_term_t**)allocate(sizeof(index_term_t*) * (builder->term_count > 0 ? builder->term_count : 1));
+    int term_count = 0;
+    for (int i = 0; i < builder->table_size; i++) {
+        if (builder->table[i] != NULL) {
+            terms[term_count++] = builder->table[i];
+        }
     }
-
-    // Receive parse date response
-    bytes_received = recv(client->connfd, receive_buffer, sizeof(receive_buffer) - 1, MSG_PEEK);
-    if (bytes_received < 0) {
-        fprintf(stderr, "Failed to receive parse date response\n");
+    qsort(terms, term_count, sizeof(index_term_t*), compare_index_terms);
+
+    // Subjects go first in the strings, the old ones as they were and the new ones after them
+    if (index != NULL) {
+        uint64_t subjects_size = 0;
+        for (int i = 0; i < old_documents; i++) {
+            if (index->documents[i].subject_len > 0 && index->documents[i].subject_offset + index->documents[i].subject_len > subjects_size) {
+                subjects_size = index->documents[i].subject_offset + index->documents[i].subject_len;
+            }
+        }
+        append_bytes(&strings, index->strings, subjects_size);
+    }
+    int subjects_base = strings.len;
+    append_bytes(&strings, builder->subjects.data, builder->subjects.len);
+
+    // Both lists are sorted, so one pass merges them, and the new messages of a term follow its old ones
+    int old = 0, new = 0;
+    while (old < old_count || new < term_count) {
+        text_index_term_t* old_term = old < old_count ? &index->terms[old] : NULL;
+        index_term_t* new_term = new < term_count ? terms[new] : NULL;
+        int order = old_term == NULL ? 1 : new_term == NULL ? -1
+                : compare_terms(index->strings + old_term->term_offset, old_term->term_len, new_term->term, new_term->term_len);
+        text_index_term_t record;
+
+        memset(&record, 0, sizeof(record));
+        record.postings_offset = sizeof(text_index_header_t) + postings.len;
+        record.term_offset = strings.len;
+        if (order <= 0) {
+            record.term_len = old_term->term_len;
+            record.document_count = old_term->document_count;
+            record.last_uid = old_term->last_uid;
+            append_bytes(&strings, index->strings + old_term->term_offset, old_term->term_len);
+            append_bytes(&postings, index->map + old_term->postings_offset, old_term->postings_len);
+            old++;
+        }
+        if (order >= 0) {
+            if (order > 0) {
+                record.term_len = new_term->term_len;
+                append_bytes(&strings, new_term->term, new_term->term_len);
+            }
+            append_postings(&postings, new_term->postings.data, new_term->postings.len, record.last_uid);
+            record.document_count += new_term->document_count;
+            record.last_uid = new_term->last_uid;
+            new++;
+        }
+        record.postings_len = sizeof(text_index_header_t) + postings.len - record.postings_offset;
+        append_bytes(&records, &record, sizeof(record));
+    }
+    free(terms);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TEXT_INDEX_MAGIC, sizeof(header.magic));
+    header.uid_validity = client->uid_validity;
+    header.last_uid = last_uid;
+    header.document_count = old_documents + builder->document_count;
+    header.term_count = records.len / sizeof(text_index_term_t);
+    header.documents_offset = sizeof(header) + postings.len;
+    header.terms_offset = header.documents_offset + (uint64_t)header.document_count * sizeof(text_index_document_t);
+    header.strings_offset = header.terms_offset + records.len;
+    header.strings_size = strings.len;
+
+    // The new file replaces the old one only once it is complete
+    get_cache_path(client, TEXT_INDEX_EXTENSION, path, sizeof(path));
+    get_cache_path(client, TEXT_INDEX_TEMP_EXTENSION, temp_path, sizeof(temp_path));
+    FILE* file = fopen(temp_path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Failed to write text index\n");
         exit(EXIT_FAILURE);
     }
-    receive_buffer[bytes_received] = '\0';
-
-    date_start = strstr(receive_buffer, "\r\n");
-    if (sscanf(receive_buffer, "* %*d FETCH (BODY[HEADER.FIELDS (DATE)] {%d}", &date_size) == 1 && date_start != NULL) {
-        date_start += 2;            // Move past the \r\n to the start of the date
-        date_start += 6;            // Move past the "Date: ":
-        int date_index = date_start - receive_buffer;
-        printf("Date: ");
-        print_parsed_fields(client->connfd, date_index, date_size - 8);
-        printf("\n");
-    } else {
-        fprintf(stderr, "Date response not found\n");
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(postings.data, 1, postings.len, file);
+    if (old_documents > 0) {
+        fwrite(index->documents, sizeof(text_index_document_t), old_documents, file);
+    }
+    for (int i = 0; i < builder->document_count; i++) {
+        text_index_document_t document = builder->documents[i];
+        document.subject_offset += subjects_base;
+        fwrite(&document, sizeof(document), 1, file);
+    }
+    fwrite(records.data, 1, records.len, file);
+    fwrite(strings.data, 1, strings.len, file);
+    if (fflush(file) != 0 || fsync(fileno(file)) < 0 || fclose(file) != 0 || rename(temp_path, path) < 0) {
+        fprintf(stderr, "Failed to write text index\n");
         exit(EXIT_FAILURE);
     }
+
+    free(postings.data);
+    free(records.data);
+    free(strings.data);
 }
 
-void parse_subject(client_t* client) {
-    char send_buffer[BUFFER_SIZE];
-    char receive_buffer[BUFFER_SIZE];
-    int bytes_received, subject_size;
-    char tag[TAG_SIZE];
-    char* subject_start;
+int compare_index_terms(const void* first, const void* second) {
+    index_term_t* a = *(index_term_t* const*)first;
+    index_term_t* b = *(index_term_t* const*)second;
 
-    // Generate tag
-    snprintf(tag, sizeof(tag), "A%04d", client->tag_counter++);
+    return compare_terms(a->term, a->term_len, b->term, b->term_len);
+}
 
-    // Generate parse from command
-    snprintf(send_buffer, sizeof(send_buffer), "%s FETCH %d BODY.PEEK[HEADER.FIELDS (SUBJECT)]\r\n", tag, client->message_num);
+int compare_terms(char* first, int first_len, char* second, int second_len) {
+    int order = memcmp(first, second, first_len < second_len ? first_len : second_len);
 
-    // Send parse from command
-    if (send(client->connfd, send_buffer, strlen(send_buffer), 0) < 0) {
-        fprintf(stderr, "Failed to send parse subject command");
-        exit(EXIT_FAILURE);
+    if (order != 0) {
+        return order;
     }
+    return first_len - second_len;
+}
 
-    // Receive parse from response
-    bytes_received = recv(client->connfd, receive_buffer, sizeof(receive_buffer) - 1, MSG_PEEK);
-    if (bytes_received < 0) {
-        fprintf(stderr, "Failed to receive parse subject response\n");
-        exit(EXIT_FAILURE);
-    }
-    receive_buffer[bytes_received] = '\0';
+void append_postings(byte_buffer_t* output, unsigned char* postings, int postings_len, uint32_t base_uid) {
+    unsigned char* current = postings;
+    uint32_t first_uid;
 
-    subject_start = strstr(receive_buffer, "\r\n");
-    if (sscanf(receive_buffer, "* %*d FETCH (BODY[HEADER.FIELDS (SUBJECT)] {%d}\r\n", &subject_size) == 1 && subject_start != NULL) {
-        subject_start += 2;             // Move past the \r\n to the start of the subject
-        subject_start += 9;             // Move past the "Subject: ":
-        int subject_index = subject_start - receive_buffer;
-        
-        printf("Subject: ");
-        if (subject_size > 2) {
-            print_parsed_fields(client->connfd, subject_index, subject_size - 11);
-            printf("\n");
-        } else {
-           printf("<No subject>\n");
-           receive_remaining_response(client->connfd);
-        }
-        
-    } else {
-        fprintf(stderr, "Subject response not found\n");
-        exit(EXIT_FAILURE);
+    // Only the first delta changes, the rest are relative to the messages before them
+    if (postings_len == 0 || !read_varint(&current, postings + postings_len, &first_uid)) {
+        return;
     }
+    append_varint(output, first_uid - base_uid);
+    append_bytes(output, current, postings + postings_len - current);
 }
 
-void print_parsed_fields(int connfd, int print_index, int print_size) {
-    int total_received = 0;
-    int bytes_received;
-    
-    char* print_buffer = (char*)malloc(sizeof(char) * (print_size + 1));
-    if (print_buffer == NULL) {
-        printf("%d", print_size);
-        fprintf(stderr, "Memory allocation failure\n");
-        exit(EXIT_FAILURE);
-    }
-
-    // Read the initial response line
-    if (print_index > 0) {
-        char response_buffer[print_index];
-        int response_bytes_received = recv(connfd, response_buffer, print_index, 0);
-        if (response_bytes_received < 0) {
-            fprintf(stderr, "Failed to receive header\n");
-            free(print_buffer);
-            exit(EXIT_FAILURE);
-        }
+void append_bytes(byte_buffer_t* buffer, void* data, int data_len) {
+    if (data_len <= 0) {
+        return;
     }
-
-    // Read the entire parsed content
-    while (total_received < print_size) {
-        bytes_received = recv(connfd, print_buffer + total_received, print_size - total_received, 0);
-        if (bytes_received < 0) {
-            fprintf(stderr, "Failed to receive body content\n");
-            free(print_buffer);
-            exit(EXIT_FAILURE);
+    if (buffer->len + data_len > buffer->size) {
+        buffer->size = buffer->size > 0 ? buffer->size : STREAM_CHUNK_SIZE;
+        while (buffer->len + data_len > buffer->size) {
+            buffer->size *= 2;
         }
-        total_received += bytes_received;
+        buffer->data = (unsigned char*)reallocate(buffer->data, buffer->size);
     }
+    memcpy(buffer->data + buffer->len, data, data_len);
+    buffer->len += data_len;
+}
 
-    print_buffer[total_received] = '\0'; // Null-terminate the buffer
-    remove_cr_newline(print_buffer);    // Unfold the fields
+void append_varint(byte_buffer_t* buffer, uint32_t value) {
+    unsigned char bytes[5];
+    int bytes_len = 0;
 
-    // Print the parsed content
-    printf("%s", print_buffer);
-    free(print_buffer); // Free allocated memory
-    receive_remaining_response(connfd);
+    while (value >= 0x80) {
+        bytes[bytes_len++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    bytes[bytes_len++] = value;
+    append_bytes(buffer, bytes, bytes_len);
 }
 
-void remove_cr_newline(char *input) {
-    char *src = input, *dst = input;
-    while (*src) {
-       
-        if (*src == '\r' && *(src + 1) == '\n') {
-            src += 2;
-        } else {
-            *dst++ = *src++;
+int read_varint(unsigned char** current, unsigned char* end, uint32_t* value) {
+    uint32_t result = 0;
+
+    for (int shift = 0; shift < 35 && *current < end; shift += 7) {
+        unsigned char byte = *(*current)++;
+        result |= (uint32_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return 1;
         }
     }
-    *dst = '\0';
+    return 0;
 }
 
-void read_mime(client_t* client) {
-    char send_buffer[BUFFER_SIZE];
-    char receive_buffer[BUFFER_SIZE];
-    int bytes_received, body_size;
-    char tag[TAG_SIZE];
-    char* body_start;
-
-    // Generate tag
-    snprintf(tag, sizeof(tag), "A%04d", client->tag_counter++);
+void search_index(client_t* client) {
+    text_index_t index;
+    query_t query;
 
-    // Generate parse from command
-    snprintf(send_buffer, sizeof(send_buffer), "%s FETCH %d BODY.PEEK[]\r\n", tag, client->message_num);
-
-    // Send parse from command
-    if (send(client->connfd, send_buffer, strlen(send_buffer), 0) < 0) {
-        fprintf(stderr, "Failed to send parse subject command");
+    if (!open_text_index(client, &index)) {
+        fprintf(stderr, "Text index not found\n");
         exit(EXIT_FAILURE);
     }
 
-    // Receive parse from response
-    bytes_received = recv(client->connfd, receive_buffer, sizeof(receive_buffer) - 1, MSG_PEEK);
-    if (bytes_received < 0) {
-        fprintf(stderr, "Failed to receive parse subject response\n");
+    query.current = client->query;
+    query.index = &index;
+    number_list_t uids = parse_query_or(&query);
+    query.current += strspn(query.current, " \t");
+    if (*query.current != '\0') {
+        fprintf(stderr, "Invalid search query\n");
         exit(EXIT_FAILURE);
     }
-    receive_buffer[bytes_received] = '\0';
 
-    body_start = strstr(receive_buffer, "\r\n");
-    if (sscanf(receive_buffer, "* %*d FETCH (BODY[] {%d}", &body_size) == 1 && body_start != NULL) {
-        body_start += 2;                    // Move past the \r\n to the start of the body           
-        int body_index = body_start - receive_buffer;
-        char* body_buffer = get_full_body(client->connfd, body_size + body_index);
-        print_mime(body_buffer);
-        free(body_buffer);
+    // Documents are sorted by UID and so are the matches, so one pass finds every subject
+    int document = 0;
+    for (int i = 0; i < uids.count; i++) {
+        while (document < (int)index.header->document_count && index.documents[document].uid < (uint32_t)uids.numbers[i]) {
+            document++;
+        }
+        if (document == (int)index.header->document_count) {
+            break;
+        }
+        text_index_document_t* entry = &index.documents[document];
+        view_t subject = {entry->subject_len >= 0 ? index.strings + entry->subject_offset : NULL, entry->subject_len};
+
+        printf("%d: ", uids.numbers[i]);
+        print_subject(subject, client->decode);
     }
+    fflush(stdout);
+
+    free(uids.numbers);
+    close_text_index(&index);
 }
 
-char* get_full_body(int connfd, int body_size) {
-    int bytes_received, total_received = 0;
+number_list_t parse_query_or(query_t* query) {
+    number_list_t uids = parse_query_and(query);
 
-    char* body_buffer = (char*)malloc(sizeof(char) * (body_size + 1));
-    if (body_buffer == NULL) {
-        fprintf(stderr, "Memory allocation failure\n");
-        exit(EXIT_FAILURE);
+    while (match_query_operator(query, "OR")) {
+        uids = unite_uids(uids, parse_query_and(query));
     }
+    return uids;
+}
 
-    // Read the entire body content
-    while (total_received < body_size) {
-        bytes_received = recv(connfd, body_buffer + total_received, body_size - total_received, 0);
-        if (bytes_received < 0) {
-            fprintf(stderr, "Failed to receive body content\n");
-            free(body_buffer);
-            exit(EXIT_FAILURE);
+number_list_t parse_query_and(query_t* query) {
+    number_list_t uids = parse_query_term(query);
+
+    // Terms side by side must all match, as if AND stood between them
+    while (1) {
+        match_query_operator(query, "AND");
+        query->current += strspn(query->current, " \t");
+        if (*query->current == '\0' || *query->current == ')'
+                || (strncmp(query->current, "OR", strlen("OR")) == 0 && strchr(" \t(\"", query->current[strlen("OR")]) != NULL)) {
+            return uids;
         }
-        total_received += bytes_received;
+        uids = intersect_uids(uids, parse_query_term(query));
     }
-    body_buffer[total_received] = '\0'; // Null-terminate the buffer 
-    return body_buffer;
 }
 
-void print_mime(char* body_buffer) {
+number_list_t parse_query_term(query_t* query) {
+    query->current += strspn(query->current, " \t");
 
-    char* content = NULL;
-    char* boundary = NULL;
+    if (*query->current == '-' || match_query_operator(query, "NOT")) {
+        if (*query->current == '-') {
+            query->current++;
+        }
+        return complement_uids(query->index, parse_query_term(query));
+    }
 
-    if (!insensitive_strstr(body_buffer, "MIME-Version: 1.0")) {
-        fprintf(stderr, "MIME-Version not found\n");
-        exit(4);
+    if (*query->current == '(') {
+        query->current++;
+        number_list_t uids = parse_query_or(query);
+        query->current += strspn(query->current, " \t");
+        if (*query->current != ')') {
+            fprintf(stderr, "Invalid search query\n");
+            exit(EXIT_FAILURE);
+        }
+        query->current++;
+        return uids;
     }
 
-    content = insensitive_strstr(body_buffer, "Content-Type: multipart/alternative;");
-    if (content) {
-        boundary = get_boundary(content);
-        if (!boundary) {
-            fprintf(stderr, "Boundary not found\n");
-            exit(4);
-        } 
+    // A quoted phrase, or a word, which is a phrase too when it holds several tokens such as e-mail
+    char* text = query->current;
+    int text_len;
+    if (*text == '"') {
+        text++;
+        char* quote = strchr(text, '"');
+        if (quote == NULL) {
+            fprintf(stderr, "Invalid search query\n");
+            exit(EXIT_FAILURE);
+        }
+        text_len = quote - text;
+        query->current = quote + 1;
     } else {
-        fprintf(stderr, "Content-Type: multipart/alternative\n");
-        exit(4);
+        text_len = strcspn(text, " \t()\"");
+        query->current += text_len;
     }
-    
-    content = check_starting_boundary(content, boundary);
-    
-    char* content_type = check_content_type_charset(content);
-    char* encoding = check_encoding_parameter(content);
-    
-    if (content_type < encoding) {
-        content = check_content_type_charset(content);
-        content = check_encoding_parameter(content);
-    } else {
-        content = check_encoding_parameter(content); 
-        content = check_content_type_charset(content);
+    if (text_len == 0) {
+        fprintf(stderr, "Invalid search query\n");
+        exit(EXIT_FAILURE);
     }
-
-    content += 4;                               // Skip the \r\n\r\n
-    content = check_end_boundary(content, boundary);
-    printf("%s", content);
-
+    return match_phrase(query->index, text, text_len);
 }
 
-char* insensitive_strstr(char* search, char* target) {
-    if (!target[0]) {
-        return search;
+int match_query_operator(query_t* query, char* operator) {
+    int operator_len = strlen(operator);
+
+    // Operators are upper case words, so lower case and, or and not are searched for
+    query->current += strspn(query->current, " \t");
+    if (strncmp(query->current, operator, operator_len) == 0 && strchr(" \t(\"", query->current[operator_len]) != NULL
+            && query->current[operator_len] != '\0') {
+        query->current += operator_len;
+        return 1;
     }
+    return 0;
+}
 
-    size_t target_len = strlen(target);
-    
-    while (*search) {
-        if (strncasecmp(search, target, target_len) == 0) {
-            return search;
+number_list_t match_phrase(text_index_t* index, char* text, int text_len) {
+    char tokens[PHRASE_MAX_TOKENS][TERM_MAX_SIZE];
+    postings_cursor_t cursors[PHRASE_MAX_TOKENS];
+    number_list_t uids = {NULL, 0, 0}, positions = {NULL, 0, 0};
+    char* current = text;
+    int token_count = 0, token_len;
+
+    while (token_count < PHRASE_MAX_TOKENS && (token_len = next_token(&current, text + text_len, tokens[token_count])) > 0) {
+        text_index_term_t* term = find_text_index_term(index, tokens[token_count], token_len);
+        if (term == NULL) {
+            return uids;
         }
-        search++;
+        start_postings_cursor(&cursors[token_count++], index, term);
+    }
+    if (token_count == 0) {
+        return uids;
     }
 
-    return NULL;
-}
+    // The cursors move together, each message all of them hold is checked for the tokens in a row
+    while (cursors[0].uid != 0) {
+        uint32_t uid = cursors[0].uid;
+        int all = 1;
 
-char* get_boundary(char* content) {
-    
-    char* start = insensitive_strstr(content, "boundary=");
-    if (start) {
-        start += strlen("boundary=");
-        
-        // Check if boundary is in quotes
-        if (*start == '\"') {
-            start++;            // Move past the \"
-            char* end = strchr(start, '\"');
-            if (end) {
-                int boundary_len = end - start;
-                char* boundary = (char*)malloc(boundary_len + 1);
-                if (boundary == NULL) {
-                    fprintf(stderr, "Malloc failure\n");
-                    exit(EXIT_FAILURE);
-                }
-                strncpy(boundary, start, boundary_len);
-                boundary[boundary_len] = '\0';
-                return boundary;
+        for (int i = 1; i < token_count; i++) {
+            while (cursors[i].uid != 0 && cursors[i].uid < uid) {
+                next_postings_document(&cursors[i]);
             }
-        } else {
-            // Boundary without quotes
-            char* end = start;
-            while (*end && *end != ' ' && *end != '\r' && *end != '\n') {
-                end++;
-            }
-            int boundary_len = end - start;
-            char* boundary = (char*)malloc(boundary_len + 1);
-            if (boundary == NULL) {
-                fprintf(stderr, "Malloc failure\n");
-                exit(EXIT_FAILURE);
+            if (cursors[i].uid == 0) {
+                free(positions.numbers);
+                return uids;
+            }
+            if (cursors[i].uid > uid) {
+                uid = cursors[i].uid;
+                all = 0;
             }
-            strncpy(boundary, start, boundary_len);
-            boundary[boundary_len] = '\0';
-            return boundary;
         }
-    }    
-    return NULL;
-}
-
-char* check_starting_boundary(char* content, char* boundary) {
-    char boundary_start[BUFFER_SIZE];
 
-    snprintf(boundary_start, sizeof(boundary_start), "\r\n--%s\r\n", boundary);
-    if (insensitive_strstr(content, boundary_start)) {
-        char* new_content = insensitive_strstr(content, boundary_start);
-        new_content += strlen(boundary_start);
-        return new_content;
-    } else {
-        fprintf(stderr, "Starting boundary not found\n");
-        exit(4);
+        if (all && match_positions(cursors, token_count, &positions)) {
+            append_number(&uids, uid);
+        }
+        while (cursors[0].uid != 0 && cursors[0].uid < uid + all) {
+            next_postings_document(&cursors[0]);
+        }
     }
+    free(positions.numbers);
+    return uids;
 }
 
-char* check_content_type_charset(char* content) {
-    char text_plain[BUFFER_SIZE];
-
-    snprintf(text_plain, sizeof(text_plain), "Content-Type: text/plain");
-    if (insensitive_strstr(content, text_plain)) {
-        
-        char charset[BUFFER_SIZE];
-        snprintf(charset, sizeof(charset), "charset=UTF-8");
+void start_postings_cursor(postings_cursor_t* cursor, text_index_t* index, text_index_term_t* term) {
+    cursor->current = index->map + term->postings_offset;
+    cursor->end = cursor->current + term->postings_len;
+    cursor->uid = 0;
+    cursor->position_count = 0;
+    cursor->positions = cursor->current;
+    if (cursor->end > index->map + index->size) {
+        cursor->end = cursor->current;
+    }
+    next_postings_document(cursor);
+}
 
-        if (insensitive_strstr(content, charset)) {
-            char* new_content = insensitive_strstr(content, charset);
-            new_content += strlen(charset);
-            return new_content;
+void next_postings_document(postings_cursor_t* cursor) {
+    uint32_t delta, position;
 
-        } else {
-           fprintf(stderr, "charset not found\n");
-            exit(4); 
+    // The positions of the message before are skipped first
+    cursor->current = cursor->positions;
+    for (uint32_t i = 0; i < cursor->position_count; i++) {
+        if (!read_varint(&cursor->current, cursor->end, &position)) {
+            cursor->uid = 0;
+            return;
         }
-        
-    } else {
-        fprintf(stderr, "Content-Type text/plain not found\n");
-        exit(4);
-    } 
-}
-
-char* check_encoding_parameter(char* content) {
-    
-    char encoding_quoted[BUFFER_SIZE];
-    snprintf(encoding_quoted, sizeof(encoding_quoted), "Content-Transfer-Encoding: quoted-printable");
-    if (insensitive_strstr(content, "Content-Transfer-Encoding: quoted-printable")) {
-        char* new_content = insensitive_strstr(content, "Content-Transfer-Encoding: quoted-printable");
-        new_content += strlen(encoding_quoted);
-        return new_content;
-    }
-
-    char encoding_7bit[BUFFER_SIZE];
-    snprintf(encoding_7bit, sizeof(encoding_7bit), "Content-Transfer-Encoding: 7bit");
-    if (insensitive_strstr(content, "Content-Transfer-Encoding: 7bit")) {
-        char* new_content = insensitive_strstr(content, "Content-Transfer-Encoding: 7bit");
-        new_content += strlen(encoding_7bit);
-        return new_content;
-    } 
-    
-    char encoding_8bit[BUFFER_SIZE];
-    snprintf(encoding_8bit, sizeof(encoding_8bit), "Content-Transfer-Encoding: 8bit");
-    if (insensitive_strstr(content, "Content-Transfer-Encoding: 8bit")) {
-        char* new_content = insensitive_strstr(content, "Content-Transfer-Encoding: 8bit");
-        new_content += strlen(encoding_8bit);
-        return new_content;
-    }
-    
-    fprintf(stderr, "Content-Transfer-Encoding not found\n");
-    exit(4);    
-}
-
-char* check_end_boundary(char* content, char* boundary) {
-    char boundary_end[BUFFER_SIZE];
-
-    snprintf(boundary_end, sizeof(boundary_end), "\r\n--%s", boundary);
-    if (insensitive_strstr(content, boundary_end)) {
-        char* end_content = insensitive_strstr(content, boundary_end);
-        
-        int new_len = end_content - content;
-        char* new_content = (char*)malloc(new_len + 1);
-        if (new_content == NULL) {
-            fprintf(stderr, "Memory allocation failed\n");
-            exit(1);
-        }
-        strncpy(new_content, content, new_len);
-        new_content[new_len] = '\0';
-        return new_content;
-    } else {
-        fprintf(stderr, "Ending boundary not found\n");
-        exit(4);
     }
+    if (!read_varint(&cursor->current, cursor->end, &delta) || !read_varint(&cursor->current, cursor->end, &cursor->position_count)) {
+        cursor->uid = 0;
+        cursor->position_count = 0;
+        return;
+    }
+    cursor->uid += delta;
+    cursor->positions = cursor->current;
 }
 
-void list_email(client_t* client) {
-    char send_buffer[BUFFER_SIZE];
-    char receive_buffer[BUFFER_SIZE];
-    int bytes_received;
-    char tag[TAG_SIZE];
-
-    // Generate tag
-    snprintf(tag, sizeof(tag), "A%04d", client->tag_counter++);
+int match_positions(postings_cursor_t* cursors, int cursor_count, number_list_t* positions) {
+    uint32_t delta;
+    int position = 0;
 
-    // Generate list command
-    snprintf(send_buffer, sizeof(send_buffer), "%s FETCH 1:* (BODY[HEADER.FIELDS (SUBJECT)])\r\n", tag);
+    if (cursor_count == 1) {
+        return 1;
+    }
 
-    // Send list command
-    if (send(client->connfd, send_buffer, strlen(send_buffer), 0) < 0) {
-        fprintf(stderr, "Failed to send list command");
-        exit(EXIT_FAILURE);
+    // The first token may start the phrase at any of its positions, the others must follow it
+    positions->count = 0;
+    unsigned char* current = cursors[0].positions;
+    for (uint32_t i = 0; i < cursors[0].position_count && read_varint(&current, cursors[0].end, &delta); i++) {
+        position += delta;
+        append_number(positions, position);
+    }
+    for (int token = 1; token < cursor_count && positions->count > 0; token++) {
+        int kept = 0, next = 0;
+        position = 0;
+        current = cursors[token].positions;
+        for (uint32_t i = 0; i < cursors[token].position_count && read_varint(&current, cursors[token].end, &delta); i++) {
+            position += delta;
+            while (next < positions->count && positions->numbers[next] + 1 < position) {
+                next++;
+            }
+            if (next < positions->count && positions->numbers[next] + 1 == position) {
+                positions->numbers[kept++] = position;
+                next++;
+            }
+        }
+        positions->count = kept;
     }
+    return positions->count > 0;
+}
 
-    // Receive list response
-    bytes_received = recv(client->connfd, receive_buffer, sizeof(receive_buffer) - 1, 0);
-    if (bytes_received < 0) {
-        fprintf(stderr, "Failed to receive select response\n");
-        exit(EXIT_FAILURE);
+number_list_t intersect_uids(number_list_t first, number_list_t second) {
+    number_list_t uids = {NULL, 0, 0};
+    int i = 0, j = 0;
+
+    while (i < first.count && j < second.count) {
+        if (first.numbers[i] == second.numbers[j]) {
+            append_number(&uids, first.numbers[i]);
+            i++;
+            j++;
+        } else if (first.numbers[i] < second.numbers[j]) {
+            i++;
+        } else {
+            j++;
+        }
     }
-    receive_buffer[bytes_received] = '\0';
+    free(first.numbers);
+    free(second.numbers);
+    return uids;
+}
 
-    if (!parse_list_response(client->connfd, receive_buffer)) {
-        fprintf(stderr, "Mailbox is empty\n");
-        exit(0);
-    }
-}
-
-int parse_list_response(int connfd, char* response) {
-    char* line_start = response;
-    char* subject_start;
-    char* subject_end;
-    int is_not_empty = 0;
-
-    // Loop to get all of the email header lines
-    while ((line_start = strstr(line_start, "* ")) != NULL) {
-        int email_num, subject_size;
-        if (sscanf(line_start, "* %d FETCH (BODY[HEADER.FIELDS (SUBJECT)] {%d}\r\n", &email_num, &subject_size) == 2) {
-            subject_start = strstr(line_start, "\r\nSubject:");
-            if (subject_start) {
-                subject_start += 10; // Move past "\r\nSubject:"
-        
-                // Find the end of the subject line
-                subject_end = strstr(subject_start, "\r\n\r\n)\r\n");
-                if (subject_end) {
-                    *subject_end = '\0'; // Temporarily null-terminate the subject
-
-                    // Remove starting whitespace
-                    while (*subject_start == ' ' || *subject_start == '\t') {
-                        subject_start++;
-                    }
-
-                    // Unfold and print
-                    remove_cr_newline(subject_start);
-                    printf("%d: %s\n", email_num, subject_start);
-                    is_not_empty = 1;
-                    
-                    // Move to the next line
-                    line_start = subject_end + 7;
-                } else {
-                    fprintf(stderr, "Subject end not found\n");
-                    exit(EXIT_FAILURE);
-                }
-            } else {
-                printf("%d: <No subject>\n", email_num);
-                is_not_empty = 1;
+number_list_t unite_uids(number_list_t first, number_list_t second) {
+    number_list_t uids = {NULL, 0, 0};
+    int i = 0, j = 0;
 
-                // Move to the next line
-                line_start += 5;
-            }
+    while (i < first.count || j < second.count) {
+        if (j == second.count || (i < first.count && first.numbers[i] < second.numbers[j])) {
+            append_number(&uids, first.numbers[i++]);
+        } else if (i == first.count || second.numbers[j] < first.numbers[i]) {
+            append_number(&uids, second.numbers[j++]);
         } else {
-            fprintf(stderr, "Header not found\n");
-            exit(EXIT_FAILURE);
+            append_number(&uids, first.numbers[i]);
+            i++;
+            j++;
+        }
+    }
+    free(first.numbers);
+    free(second.numbers);
+    return uids;
+}
+
+number_list_t complement_uids(text_index_t* index, number_list_t uids) {
+    number_list_t complement = {NULL, 0, 0};
+    int j = 0;
+
+    for (uint32_t i = 0; i < index->header->document_count; i++) {
+        int uid = index->documents[i].uid;
+        while (j < uids.count && uids.numbers[j] < uid) {
+            j++;
+        }
+        if (j == uids.count || uids.numbers[j] != uid) {
+            append_number(&complement, uid);
         }
     }
-    
-    return is_not_empty;
-}
\ No newline at end of file
+    free(uids.numbers);
+    return complement;
+}
+
+void append_number(number_list_t* list, int number) {
+    if (list->count == list->size) {
+        list->size = list->size > 0 ? list->size * 2 : RETRIEVE_BATCH_SIZE;
+        list->numbers = (int*)reallocate(list->numbers, sizeof(int) * list->size);
+    }
+    list->numbers[list->count++] = number;
+}
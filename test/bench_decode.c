@@ -0,0 +1,330 @@
+// Benchmark and cross-check of the quoted-printable and base64 decoders of the mime output
+// Built by make bench, the check runs first and the benchmark only if every body decodes as the reference does
+#define main fetchmail_main
+#include "../main.c"
+#undef main
+
+#include <openssl/evp.h>
+#include <time.h>
+
+#define BENCH_SECONDS 0.5
+#define BENCH_BODY_SIZE (16 << 20)
+#define CHECK_BODIES 1000
+#define CHECK_MAX_SIZE 4096
+#define CHECK_MAX_PIECE 200
+#define BASE64_LINE_SIZE 76
+#define READ_SIZE 65536
+#define FEED_SECTION 0
+#define FEED_MESSAGE 1
+
+static const char base64_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Processor time, so that other load on the machine does not skew the figures
+double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// Naive base64 decoder, a strchr lookup per character and a fputc per byte
+void naive_base64(char* data, int data_len, FILE* output) {
+    int values[4], count = 0;
+
+    for (int i = 0; i < data_len && data[i] != '='; i++) {
+        char* found = data[i] != '\0' ? strchr(base64_alphabet, data[i]) : NULL;
+        if (found == NULL) {
+            continue;
+        }
+        values[count++] = found - base64_alphabet;
+        if (count == 4) {
+            fputc(values[0] << 2 | values[1] >> 4, output);
+            fputc((values[1] << 4 | values[2] >> 2) & 0xff, output);
+            fputc((values[2] << 6 | values[3]) & 0xff, output);
+            count = 0;
+        }
+    }
+    if (count >= 2) {
+        fputc(values[0] << 2 | values[1] >> 4, output);
+    }
+    if (count == 3) {
+        fputc((values[1] << 4 | values[2] >> 2) & 0xff, output);
+    }
+}
+
+// Naive quoted-printable decoder of RFC 2045, a fputc per byte, malformed escapes are kept as they came
+void naive_quoted_printable(char* data, int data_len, FILE* output) {
+    for (int i = 0; i < data_len; i++) {
+        if (data[i] != '=') {
+            fputc(data[i], output);
+            continue;
+        }
+        if (i + 2 < data_len && get_hex_value(data[i + 1]) >= 0 && get_hex_value(data[i + 2]) >= 0) {
+            fputc(get_hex_value(data[i + 1]) << 4 | get_hex_value(data[i + 2]), output);
+            i += 2;
+            continue;
+        }
+        int j = i + 1;
+        while (j < data_len && (data[j] == ' ' || data[j] == '\t')) {
+            j++;
+        }
+        if (j < data_len && data[j] == '\n') {
+            i = j;
+        } else if (j + 1 < data_len && data[j] == '\r' && data[j + 1] == '\n') {
+            i = j + 1;
+        } else {
+            fputc('=', output);
+        }
+    }
+}
+
+// Reference base64 decoder from OpenSSL
+unsigned char* reference_base64(char* data, int data_len, int* output_len) {
+    EVP_ENCODE_CTX* context = EVP_ENCODE_CTX_new();
+    unsigned char* output = (unsigned char*)malloc(data_len / 4 * 3 + 3);
+    int update_len, final_len;
+
+    EVP_DecodeInit(context);
+    if (EVP_DecodeUpdate(context, output, &update_len, (unsigned char*)data, data_len) < 0
+            || EVP_DecodeFinal(context, output + update_len, &final_len) < 0) {
+        fprintf(stderr, "Reference decoder rejected a body\n");
+        exit(EXIT_FAILURE);
+    }
+    EVP_ENCODE_CTX_free(context);
+    *output_len = update_len + final_len;
+    return output;
+}
+
+// Decoding the body as the mime command does, in pieces of max_piece bytes or of random sizes up to -max_piece
+// A section goes straight to the decoder as a fetched BODYSTRUCTURE part does, a message goes through the whole parser
+void parser_decode(int feed, char* encoding, char* data, int data_len, int max_piece, FILE* output) {
+    mime_parser_t parser;
+    arena_t arena;
+    char header[BUFFER_SIZE];
+    char* message = data;
+    int message_len = data_len;
+
+    init_arena(&arena, 0);
+    init_mime_parser(&parser, output, &arena, 1);
+    if (feed == FEED_SECTION) {
+        strcpy(parser.root->encoding, encoding);
+        select_mime_part(&parser, parser.root);
+        parser.state = MIME_STATE_BODY;
+    } else {
+        int header_len = snprintf(header, sizeof(header), "MIME-Version: 1.0\r\nContent-Type: multipart/mixed; boundary=b\r\n\r\n"
+                "--b\r\nContent-Type: text/plain; charset=UTF-8\r\nContent-Transfer-Encoding: %s\r\n\r\n", encoding);
+        message_len = header_len + data_len + strlen("\r\n--b--\r\n");
+        message = (char*)malloc(message_len);
+        memcpy(message, header, header_len);
+        memcpy(message + header_len, data, data_len);
+        memcpy(message + header_len + data_len, "\r\n--b--\r\n", strlen("\r\n--b--\r\n"));
+    }
+
+    for (int position = 0; position < message_len; ) {
+        int piece = max_piece < 0 ? 1 + rand() % -max_piece : max_piece;
+        piece = piece < message_len - position ? piece : message_len - position;
+        if (feed == FEED_SECTION) {
+            write_mime_body(&parser, message + position, piece);
+        } else {
+            feed_mime_parser(&parser, message + position, piece);
+        }
+        position += piece;
+    }
+
+    if (feed == FEED_SECTION) {
+        finish_decoding(&parser);
+        fflush(output);
+    } else {
+        finish_mime_parser(&parser);
+        free(message);
+    }
+    free_arena(&arena);
+}
+
+// Random bytes as base64 in lines of 76 characters
+char* make_base64(int size, int* encoded_len) {
+    unsigned char* raw = (unsigned char*)malloc(size + 1);
+    char* encoded = (char*)malloc((size + 2) / 3 * 4 + 1);
+    char* lines = (char*)malloc((size + 2) / 3 * 4 * 2 + 8);
+    int len = 0;
+
+    for (int i = 0; i < size; i++) {
+        raw[i] = rand();
+    }
+    int total = EVP_EncodeBlock((unsigned char*)encoded, raw, size);
+    for (int i = 0; i < total; i += BASE64_LINE_SIZE) {
+        int line_len = total - i < BASE64_LINE_SIZE ? total - i : BASE64_LINE_SIZE;
+        memcpy(lines + len, encoded + i, line_len);
+        len += line_len;
+        lines[len++] = '\r';
+        lines[len++] = '\n';
+    }
+    free(raw);
+    free(encoded);
+    *encoded_len = len;
+    return lines;
+}
+
+// Quoted-printable text, dense_percent of the bytes escaped, with soft breaks and a few stray '='
+char* make_quoted_printable(int size, int dense_percent, int* encoded_len) {
+    char* encoded = (char*)malloc(size * 4 + 16);
+    int len = 0, line_len = 0;
+
+    for (int i = 0; i < size; i++) {
+        int kind = rand() % 100;
+        if (line_len > 70) {
+            len += sprintf(encoded + len, rand() % 4 == 0 ? "= \t\r\n" : "=\r\n");
+            line_len = 0;
+        }
+        if (kind < dense_percent) {
+            line_len += sprintf(encoded + len, "=%02X", rand() & 0xff);
+            len += 3;
+        } else if (kind == 99 && dense_percent < 50) {
+            encoded[len++] = '=';
+            encoded[len++] = 'G' + rand() % 10;
+            line_len += 2;
+        } else if (kind == 98 && dense_percent < 50) {
+            encoded[len++] = '\r';
+            encoded[len++] = '\n';
+            line_len = 0;
+        } else {
+            encoded[len++] = "abcdefghijklmnopqrstuvwxyz ,."[rand() % 29];
+            line_len++;
+        }
+    }
+    encoded[len++] = '.';
+    *encoded_len = len;
+    return encoded;
+}
+
+// Checking random bodies fed whole and in random pieces against the reference decoders
+int check_decoders() {
+    int failures = 0;
+
+    for (int body = 0; body < CHECK_BODIES; body++) {
+        int size = rand() % CHECK_MAX_SIZE, encoded_len, expected_len;
+        char* encoded;
+        char* expected;
+        size_t expected_size;
+        FILE* reference = open_memstream(&expected, &expected_size);
+
+        if (body % 2 == 0) {
+            encoded = make_base64(size, &encoded_len);
+            fclose(reference);
+            free(expected);
+            expected = (char*)reference_base64(encoded, encoded_len, &expected_len);
+        } else {
+            encoded = make_quoted_printable(size, rand() % 100, &encoded_len);
+            naive_quoted_printable(encoded, encoded_len, reference);
+            fclose(reference);
+            expected_len = expected_size;
+        }
+
+        for (int way = 0; way < 3; way++) {
+            char* decoded;
+            size_t decoded_len;
+            FILE* output = open_memstream(&decoded, &decoded_len);
+            parser_decode(way == 2 ? FEED_MESSAGE : FEED_SECTION, body % 2 == 0 ? "base64" : "quoted-printable", encoded, encoded_len,
+                    way == 0 ? encoded_len + 1 : -CHECK_MAX_PIECE, output);
+            fclose(output);
+            if ((int)decoded_len != expected_len || memcmp(decoded, expected, expected_len) != 0) {
+                fprintf(stderr, "%s body %d of %d bytes differs, %s\n", body % 2 == 0 ? "base64" : "quoted-printable", body, encoded_len,
+                        way == 0 ? "section fed whole" : way == 1 ? "section fed in pieces" : "message fed in pieces");
+                failures++;
+            }
+            free(decoded);
+        }
+        free(encoded);
+        free(expected);
+    }
+    printf("check: %d bodies as a section whole and in pieces of 1-%d bytes, and in a message, %d failures\n",
+            CHECK_BODIES, CHECK_MAX_PIECE, failures);
+    return failures;
+}
+
+// Megabytes of encoded input per second
+double time_decoder(void (*decode)(char*, int, FILE*), char* data, int data_len, FILE* output) {
+    long passes = 0;
+    double start = now(), elapsed;
+
+    do {
+        decode(data, data_len, output);
+        passes++;
+        elapsed = now() - start;
+    } while (elapsed < BENCH_SECONDS);
+    return (double)data_len * passes / elapsed / 1e6;
+}
+
+double time_kernel(base64_kernel_t kernel, unsigned char* data, int data_len, unsigned char* output) {
+    long passes = 0;
+    double start = now(), elapsed;
+    int used;
+
+    do {
+        for (int position = 0; position + DECODE_BUFFER_SIZE <= data_len; position += DECODE_BUFFER_SIZE) {
+            kernel(data + position, DECODE_BUFFER_SIZE, output, &used);
+        }
+        passes++;
+        elapsed = now() - start;
+    } while (elapsed < BENCH_SECONDS);
+    return (double)data_len * passes / elapsed / 1e6;
+}
+
+void base64_section(char* data, int data_len, FILE* output) {
+    parser_decode(FEED_SECTION, "base64", data, data_len, READ_SIZE, output);
+}
+
+void base64_message(char* data, int data_len, FILE* output) {
+    parser_decode(FEED_MESSAGE, "base64", data, data_len, READ_SIZE, output);
+}
+
+void qp_section(char* data, int data_len, FILE* output) {
+    parser_decode(FEED_SECTION, "quoted-printable", data, data_len, READ_SIZE, output);
+}
+
+void qp_message(char* data, int data_len, FILE* output) {
+    parser_decode(FEED_MESSAGE, "quoted-printable", data, data_len, READ_SIZE, output);
+}
+
+int main() {
+    FILE* null_output = fopen("/dev/null", "wb");
+    unsigned char* kernel_output = (unsigned char*)malloc(DECODE_BUFFER_SIZE);
+    int base64_len, text_len, dense_len;
+
+    srand(1);
+    if (check_decoders() != 0) {
+        return 1;
+    }
+
+    // The kernels get the characters without line endings, as the parser hands them over
+    char* base64 = make_base64(BENCH_BODY_SIZE / 4 * 3, &base64_len);
+    unsigned char* packed = (unsigned char*)malloc(base64_len);
+    int packed_len = 0;
+    for (int i = 0; i < base64_len; i++) {
+        if (base64[i] != '\r' && base64[i] != '\n') {
+            packed[packed_len++] = base64[i];
+        }
+    }
+    printf("base64 MB/s: naive %.0f, scalar kernel %.0f", time_decoder(naive_base64, base64, base64_len, null_output),
+            time_kernel(decode_base64_scalar, packed, packed_len, kernel_output));
+#ifdef HAVE_X86_SIMD
+    if (__builtin_cpu_supports("ssse3")) {
+        printf(", ssse3 kernel %.0f", time_kernel(decode_base64_ssse3, packed, packed_len, kernel_output));
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        printf(", avx2 kernel %.0f", time_kernel(decode_base64_avx2, packed, packed_len, kernel_output));
+    }
+#endif
+    printf(", section %.0f, message %.0f\n", time_decoder(base64_section, base64, base64_len, null_output),
+            time_decoder(base64_message, base64, base64_len, null_output));
+
+    // Text escapes a few bytes, dense is mostly =XX as binary data would be
+    char* text = make_quoted_printable(BENCH_BODY_SIZE / 2, 2, &text_len);
+    char* dense = make_quoted_printable(BENCH_BODY_SIZE / 4, 90, &dense_len);
+    printf("quoted-printable text MB/s: naive %.0f, section %.0f, message %.0f\n", time_decoder(naive_quoted_printable, text, text_len, null_output),
+            time_decoder(qp_section, text, text_len, null_output), time_decoder(qp_message, text, text_len, null_output));
+    printf("quoted-printable dense MB/s: naive %.0f, section %.0f, message %.0f\n", time_decoder(naive_quoted_printable, dense, dense_len, null_output),
+            time_decoder(qp_section, dense, dense_len, null_output), time_decoder(qp_message, dense, dense_len, null_output));
+
+    fclose(null_output);
+    return 0;
+}
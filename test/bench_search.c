@@ -0,0 +1,105 @@
+// Micro-benchmark of insensitive_strstr against the strncasecmp scan it replaced
+// Built by make bench, run from the top of the tree so the fixtures in out/ are found
+#define main fetchmail_main
+#include "../main.c"
+#undef main
+
+#include <time.h>
+
+#define BENCH_SECONDS 0.2
+
+// Search of the original client, strncasecmp at every offset
+char* naive_strstr(char* search, char* target) {
+    size_t target_len = strlen(target);
+
+    if (!target[0]) {
+        return search;
+    }
+    while (*search) {
+        if (strncasecmp(search, target, target_len) == 0) {
+            return search;
+        }
+        search++;
+    }
+    return NULL;
+}
+
+// Searches the MIME checks of the original client made on a whole message, the last one misses
+static char* const fixture_targets[] = {
+    "MIME-Version: 1.0", "Content-Type: multipart/alternative;", "boundary=", "Content-Type: text/plain",
+    "charset=UTF-8", "Content-Transfer-Encoding: quoted-printable", "Content-Transfer-Encoding: 7bit", "X-Not-There:"
+};
+
+// What the remaining callers search, a Content-Type value and a FETCH line with a BODYSTRUCTURE
+static char content_type[] = "multipart/alternative; boundary=\"000000000000c6c1a2061226a1d7\"; charset=\"UTF-8\"";
+static char fetch_line[] = "* 1 FETCH (RFC822.SIZE 15557 BODYSTRUCTURE ((\"text\" \"plain\" (\"charset\" \"UTF-8\") NIL NIL "
+        "\"quoted-printable\" 2245 52 NIL NIL NIL NIL)(\"text\" \"html\" (\"charset\" \"UTF-8\") NIL NIL \"quoted-printable\" "
+        "10413 207 NIL NIL NIL NIL) \"alternative\" (\"boundary\" \"000000000000c6c1a2061226a1d7\") NIL NIL NIL) "
+        "BODY[HEADER.FIELDS (MIME-VERSION)] {19}";
+
+double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+char* read_fixture(char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Failed to open %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+    char* data = (char*)malloc(size + 1);
+    if (fread(data, 1, size, file) != (size_t)size) {
+        fprintf(stderr, "Failed to read %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    data[size] = '\0';
+    fclose(file);
+    return data;
+}
+
+// Microseconds per pass of every target over the text, after checking both searches agree
+double time_search(char* (*search)(char*, char*), char* text, char* const* targets, int target_count) {
+    long passes = 0;
+    volatile size_t sink = 0;
+    double start = now(), elapsed;
+
+    for (int i = 0; i < target_count; i++) {
+        if (search(text, targets[i]) != naive_strstr(text, targets[i])) {
+            fprintf(stderr, "Searches disagree on %s\n", targets[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    do {
+        for (int i = 0; i < target_count; i++) {
+            sink += (size_t)search(text, targets[i]);
+        }
+        passes++;
+        elapsed = now() - start;
+    } while (elapsed < BENCH_SECONDS);
+    return elapsed * 1e6 / passes;
+}
+
+void report(char* name, char* text, char* const* targets, int target_count) {
+    double naive = time_search(naive_strstr, text, targets, target_count);
+    double current = time_search(insensitive_strstr, text, targets, target_count);
+
+    printf("%-14s %8zu bytes %10.3f us %10.3f us %6.1fx\n", name, strlen(text), naive, current, naive / current);
+}
+
+int main(int argc, char* argv[]) {
+    char* const parameter_targets[] = {"charset", "boundary"};
+    char* const structure_targets[] = {"BODYSTRUCTURE ("};
+    int fixture_count = sizeof(fixture_targets) / sizeof(fixture_targets[0]);
+
+    printf("%-14s %14s %13s %13s\n", "input", "", "old", "current");
+    report("ed512", read_fixture(argc > 1 ? argv[1] : "out/ret-ed512.out"), fixture_targets, fixture_count);
+    report("mst", read_fixture(argc > 2 ? argv[2] : "out/ret-mst.out"), fixture_targets, fixture_count);
+    report("content-type", content_type, parameter_targets, 2);
+    report("fetch line", fetch_line, structure_targets, 1);
+    return 0;
+}
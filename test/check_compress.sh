@@ -0,0 +1,82 @@
+#!/bin/bash
+# Checks that COMPRESS=DEFLATE changes nothing the user sees: list, retrieve and mime print the
+# same output, errors and exit status with -z as without, also when the compressed stream
+# arrives in small pieces. The client only connects to port 143, so this has to be allowed to listen there.
+cd "$(dirname "$0")"
+B=${B:-../fetchmail}
+work=$(mktemp -d)
+server=
+fail=0
+count=0
+matched=0
+
+cleanup() {
+    [ -n "$server" ] && kill "$server" 2>/dev/null
+    rm -rf "$work"
+}
+trap cleanup EXIT
+
+start_server() { # extra stand-in arguments
+    [ -n "$server" ] && kill "$server" 2>/dev/null && wait "$server" 2>/dev/null
+    BIG_SIZE=$((4 << 20)) python3 imapd.py --port 143 --caps COMPRESS=DEFLATE "$@" 2> "$work/server.log" &
+    server=$!
+    sleep 0.5
+    kill -0 "$server" 2>/dev/null || { echo "FAIL stand-in server did not start"; exit 1; }
+    for i in $(seq 100); do (echo > /dev/tcp/127.0.0.1/143) 2>/dev/null && return; sleep 0.1; done
+    echo "FAIL stand-in server did not start"
+    exit 1
+}
+
+run() { # name arguments
+    local name=$1
+    shift
+    "$B" -u test -p pass "$@" localhost > "$work/$name.out" 2> "$work/$name.err"
+    echo $? > "$work/$name.status"
+}
+
+same() { # arguments
+    count=$((count + 1))
+    run plain "$@"
+    FETCHMAIL_COMPRESS_STATS=1 run compressed -z "$@"
+
+    # The statistics line is the only difference allowed, it shows the stream was compressed
+    # but is only printed when the client gets to close the connection
+    grep -v '^Compression: ' "$work/compressed.err" > "$work/compressed.err.rest"
+    if [ "$(cat "$work/compressed.status")" -eq 0 ] && ! grep -q '^Compression: received [1-9]' "$work/compressed.err"; then
+        echo "FAIL not compressed: $*"
+        fail=1
+    elif ! cmp -s "$work/plain.out" "$work/compressed.out" || ! cmp -s "$work/plain.err" "$work/compressed.err.rest" \
+            || ! cmp -s "$work/plain.status" "$work/compressed.status"; then
+        echo "FAIL differs with -z: $*"
+        fail=1
+    else
+        matched=$((matched + 1))
+    fi
+}
+
+for chunk in 0 512; do
+    start_server --chunk $chunk
+    count=0
+    matched=0
+    for folder in INBOX Test Parse Encoded Mime Attach Many Empty; do
+        same -f $folder list
+    done
+    for n in 1 2 3; do
+        same -f Test -n $n retrieve
+    done
+    for n in $(seq 9); do
+        same -f Parse -n $n retrieve
+    done
+    # The stand-in pauses between pieces, so the biggest messages are only fetched whole
+    [ "$chunk" -eq 0 ] && same -f Big retrieve
+    same -f Large -n 40 retrieve
+    same -f Test -n 42 retrieve
+    for n in 1 2 3 4 5 6 7 $([ "$chunk" -eq 0 ] && echo 8) 9 10; do
+        same -f Mime -n $n mime
+    done
+    same -f Test -n 2 mime
+    same -n 1 mime
+    echo "compressed output matched in $matched of $count runs, $([ "$chunk" -eq 0 ] && echo "server writing whole responses" || echo "server writing pieces of up to $chunk bytes")"
+done
+[ "$fail" -eq 0 ] && echo PASS COMPRESS=DEFLATE output is byte-identical
+exit $fail
@@ -0,0 +1,80 @@
+#!/bin/bash
+# Checks TLS against the stand-in server with a self-signed certificate: verification,
+# saving and reusing the session file, and handshake timings with and without a ticket.
+# The client only connects to port 993, so this has to be allowed to listen there.
+cd "$(dirname "$0")"
+B=${B:-../fetchmail}
+RUNS=${RUNS:-20}
+work=$(mktemp -d)
+server=
+fail=0
+
+cleanup() {
+    [ -n "$server" ] && kill "$server" 2>/dev/null
+    rm -rf "$work"
+}
+trap cleanup EXIT
+
+check() { # description status
+    if [ "$2" -eq 0 ]; then echo "PASS $1"; else echo "FAIL $1"; fail=1; fi
+}
+
+start_server() { # extra stand-in arguments
+    [ -n "$server" ] && kill "$server" 2>/dev/null && wait "$server" 2>/dev/null
+    python3 imapd.py --port 993 --log --tls "$work/cert.pem" "$work/key.pem" "$@" 2> "$work/server.log" &
+    server=$!
+    for i in $(seq 100); do (echo > /dev/tcp/127.0.0.1/993) 2>/dev/null && return; sleep 0.1; done
+    echo "FAIL stand-in server did not start"
+    exit 1
+}
+
+last_handshake() {
+    grep ' TLS ' "$work/server.log" | tail -1 | awk '{ print $4 }'
+}
+
+list_inbox() {
+    "$B" -t -u test -p pass list localhost > "$work/got.out" 2> "$work/got.err"
+}
+
+time_runs() { # keep-session
+    local start=$(date +%s%N)
+    for i in $(seq "$RUNS"); do
+        [ "$1" -eq 0 ] && rm -f "$session"
+        list_inbox
+    done
+    echo $(( ($(date +%s%N) - start) / RUNS / 1000 ))
+}
+
+./make_cert.sh "$work"
+export HOME="$work/home"
+mkdir "$HOME"
+session="$HOME/.fetchmail/localhost.tls"
+
+for version in 1.3 1.2; do
+    start_server $([ "$version" = 1.2 ] && echo --tls-max 1.2)
+    rm -f "$session"
+
+    # Without the certificate in the trust store the handshake fails and nothing is saved
+    SSL_CERT_FILE="$work/none.pem" SSL_CERT_DIR="$work/none" list_inbox
+    status=$?
+    grep -q '^TLS handshake failure: ' "$work/got.err" && [ "$status" -eq 2 ] && [ ! -e "$session" ]
+    check "TLS $version untrusted certificate fails verification" $?
+
+    export SSL_CERT_FILE="$work/cert.pem"
+    list_inbox && cmp -s "$work/got.out" ../out/list-INBOX.out && [ "$(last_handshake)" = full ] && [ -s "$session" ]
+    check "TLS $version full handshake saves the session" $?
+
+    list_inbox && cmp -s "$work/got.out" ../out/list-INBOX.out && [ "$(last_handshake)" = resumed ]
+    check "TLS $version saved session is resumed" $?
+
+    # A session the server cannot use falls back to a full handshake
+    head -c 100 /dev/urandom > "$session"
+    list_inbox && cmp -s "$work/got.out" ../out/list-INBOX.out && [ "$(last_handshake)" = full ]
+    check "TLS $version damaged session falls back to a full handshake" $?
+
+    full=$(time_runs 0)
+    resumed=$(time_runs 1)
+    echo "TLS $version list over $RUNS runs: ${full} us without a ticket, ${resumed} us with one"
+    unset SSL_CERT_FILE
+done
+exit $fail
@@ -0,0 +1,652 @@
+#!/usr/bin/env python3
+"""Stand-in IMAP server for exercising fetchmail locally, serving the fixtures in out/.
+
+Test-only commands XAPPEND and XEXPUNGE change a folder for every session, so
+incremental paths can be driven from a script.
+"""
+import zlib, argparse, os, random, re, socket, sys, threading, time
+
+OUT = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'out')
+
+def rd(name):
+    return open(os.path.join(OUT, name), 'rb').read()
+
+def mk(hdrs, body=b'body\r\n'):
+    return b''.join(h + b'\r\n' for h in hdrs) + b'\r\n' + body
+
+MSGS = {
+    'ed512': rd('ret-ed512.out'),
+    'mst': rd('ret-mst.out'),
+    'nul': rd('ret-nul.out'),
+    'caps': mk([b'FROM: random@comp30023', b'tO: TEACHING@comp30023', b'date: Sat, 26 Aug 2023 11:44:22 +0000', b'subJECT: ThIs iS WeIrD']),
+    'minimal': mk([b'From: random@comp30023', b'Date: Sat, 26 Aug 2023 11:44:22 +0000']),
+    'nested': mk([b'From: test@comp30023', b'To: inception@comp30023', b'Date: Thu, 29 Feb 2024 23:23:24 +1100', b'Subject: Subject: ?'],
+                 b'To: wrong@comp30023\r\nSubject: wrong\r\n'),
+    'nosubj': mk([b'From: test@comp30023', b'To: nosubject@comp30023', b'Date: Thu, 29 Feb 2024 23:23:23 +1100']),
+    'ws': mk([b'From: test@comp30023', b'To: space@comp30023', b'Date: Thu, 29 Feb 2024 23:24:25 +1100', b'Subject:   Content   ']),
+    'msttab': rd('ret-mst.out').replace(b'Computer Systems\r\n (COMP', b'Computer Systems\r\n\t(COMP'),
+}
+
+def big(size):
+    line = b'QmlnIGF0dGFjaG1lbnQgbGluZSBvZiBiYXNlNjQgZGF0YSBmb3IgdGVzdGluZyBzdHJlYW1pbmcu\r\n'
+    return mk([b'From: big@comp30023', b'To: big@comp30023', b'Date: Thu, 29 Feb 2024 23:24:25 +1100', b'Subject: big'],
+              line * (size // len(line)))
+
+MSGS['big'] = big(int(os.environ.get('BIG_SIZE', 60 << 20)))
+
+MSGS['fromq'] = mk([b'From: q@comp30023', b'Subject: quoting'], b'From the start\r\n>From quoted\r\n>>From twice\r\nFrom\r\n>Fro\r\nno newline >')
+MANY = ['m%d' % i for i in range(1, 1001)]
+for i, k in enumerate(MANY):
+    MSGS[k] = mk([b'From: many@comp30023', b'Subject: message %d' % (i + 1)], (b'line %d\r\n' % i) * (i % 50 + 1))
+
+HUGE = ['h%d' % i for i in range(1, 100001)]
+for i, k in enumerate(HUGE):
+    MSGS[k] = mk([b'From: huge@comp30023', b'Subject: huge message %d' % (i + 1)])
+
+LARGE = ['l%d' % i for i in range(1, 41)]
+for i, k in enumerate(LARGE):
+    MSGS[k] = big((i % 4 + 1) * 128 * 1024)
+
+LONG = b'x' * 3000 + b'\r' + b'y' * 2000
+MIMES = {
+    'nested': mk([b'MIME-Version: 1.0', b'Content-Type: multipart/mixed; boundary="outer"'],
+        b'preamble\r\n--outer\r\nContent-Type: multipart/alternative;\r\n boundary=inner\r\n\r\n--inner\r\nContent-Type: text/html; charset=UTF-8\r\n\r\n<p>html</p>\r\n--inner\r\n'
+        b'Content-Transfer-Encoding: quoted-printable\r\nContent-Type: text/plain;\r\n\tcharset="utf-8"\r\n\r\nnested plain=\r\nline\r\n\r\n--inner--\r\n--outer\r\nContent-Type: application/pdf\r\n\r\nJVBERi0=\r\n--outer--\r\n'),
+    'related': mk([b'MIME-Version: 1.0', b'Content-Type: multipart/related; boundary=r1'],
+        b'--r1\r\nContent-Type: multipart/alternative; boundary= "a b"\r\n\r\n--a b\r\nContent-Type: text/plain; charset=us-ascii\r\n\r\nascii\r\n--a b\r\nContent-Type: text/plain; charset=UTF-8\r\n\r\n--a bc not a delimiter\r\n' + LONG + b'\r\nend\r\n--a b--\r\n--r1--'),
+    'noplain': mk([b'MIME-Version: 1.0', b'Content-Type: multipart/alternative; boundary=b'], b'--b\r\nContent-Type: text/html; charset=UTF-8\r\n\r\nhi\r\n--b--\r\n'),
+    'noend': mk([b'MIME-Version: 1.0', b'Content-Type: multipart/alternative; boundary=b'], b'--b\r\nContent-Type: text/plain; charset=UTF-8\r\n\r\nhi\r\n'),
+    'nocte': mk([b'MIME-Version: 1.0', b'Content-Type: multipart/alternative; boundary=b'], b'--b\r\nContent-Type: text/plain; charset=UTF-8\r\n\r\nplain default\r\n--b--'),
+    'single': mk([b'MIME-Version: 1.0', b'Content-Type: text/plain; charset=UTF-8'], b'single\r\n'),
+    'noversion': mk([b'Content-Type: multipart/alternative; boundary=b'], b'--b\r\nContent-Type: text/plain; charset=UTF-8\r\n\r\nhi\r\n--b--\r\n'),
+}
+MIMES['big'] = mk([b'MIME-Version: 1.0', b'Content-Type: multipart/alternative; boundary=b'],
+    b'--b\r\nContent-Type: text/plain; charset=UTF-8\r\nContent-Transfer-Encoding: 7bit\r\n\r\n' + b'plain text line of a large body\r\n' * (1 << 20) + b'--b--\r\n')
+import base64 as _b64
+MIMES['b64'] = mk([b'MIME-Version: 1.0', b'Content-Type: multipart/alternative; boundary=b'],
+    b'--b\r\nContent-Type: text/plain; charset=UTF-8\r\nContent-Transfer-Encoding: base64\r\n\r\n' + _b64.encodebytes('h\u00e9llo w\u00f6rld \u20ac\r\n'.encode() * 3000).replace(b'\n', b'\r\n') + b'--b--\r\n')
+MIMES['attach'] = mk([b'MIME-Version: 1.0', b'Content-Type: multipart/mixed; boundary="mix"'],
+    b'--mix\r\nContent-Type: text/plain; charset=UTF-8\r\nContent-Transfer-Encoding: quoted-printable\r\n\r\nsee the r=C3=A9port attached\r\n'
+    b'--mix\r\nContent-Type: application/pdf; name="report.pdf"\r\nContent-Disposition: attachment; filename="report.pdf"\r\nContent-Transfer-Encoding: base64\r\n\r\n'
+    + _b64.encodebytes(bytes(range(256)) * 4096).replace(b'\n', b'\r\n') +
+    b'--mix\r\nContent-Type: text/csv; name="data.csv"\r\nContent-Disposition: attachment; filename="data.csv"\r\n\r\na,b\r\n1,2\r\n--mix--\r\n')
+MSGS.update({'mime_' + k: v for k, v in MIMES.items()})
+
+def att(headers, body):
+    return b'--f\r\n' + b''.join(h + b'\r\n' for h in headers) + b'\r\n' + body + b'\r\n'
+ATTACH = {
+    'files': mk([b'MIME-Version: 1.0', b'Content-Type: multipart/mixed; boundary=f'],
+        att([b'Content-Type: text/plain; charset=UTF-8'], b'body text') +
+        att([b'Content-Type: application/octet-stream', b'Content-Disposition: attachment;', b' filename*=UTF-8\'\'%E2%82%AC%20rates.bin', b'Content-Transfer-Encoding: base64'],
+            _b64.encodebytes(bytes(range(256)) * 3).replace(b'\n', b'\r\n').rstrip()) +
+        att([b'Content-Type: application/pdf; name="../../etc/passwd"', b'Content-Transfer-Encoding: base64'], _b64.b64encode(b'%PDF-not really')) +
+        att([b'Content-Type: text/plain; charset=UTF-8', b'Content-Disposition: attachment;', b' filename*0*=utf-8\'en\'long%20;', b' filename*1="name";', b' filename*2*=%2Etxt', b'Content-Transfer-Encoding: quoted-printable'],
+            b'caf=C3=A9 qp=\r\ntext') +
+        att([b'Content-Type: image/png', b'Content-Disposition: inline; filename="dup.png"', b'Content-Transfer-Encoding: base64'], _b64.b64encode(b'\x89PNG one')) +
+        att([b'Content-Type: image/png', b'Content-Disposition: inline; filename="dup.png"', b'Content-Transfer-Encoding: base64'], _b64.b64encode(b'\x89PNG two')) +
+        att([b'Content-Type: message/rfc822'], b'Subject: inner\r\n\r\ninner body') +
+        att([b'Content-Type: application/zip'], b'raw 8bit') + b'--f--\r\n'),
+    'none': mk([b'MIME-Version: 1.0', b'Content-Type: multipart/alternative; boundary=b'], b'--b\r\nContent-Type: text/plain; charset=UTF-8\r\n\r\nhi\r\n--b--\r\n'),
+}
+if os.environ.get('ATTACH_SIZE'):
+    ATTACH['huge'] = mk([b'MIME-Version: 1.0', b'Content-Type: multipart/mixed; boundary=f'],
+        att([b'Content-Type: text/plain; charset=UTF-8'], b'see attached') +
+        att([b'Content-Type: application/octet-stream; name=huge.bin', b'Content-Transfer-Encoding: base64'],
+            _b64.encodebytes(random.Random(7).randbytes(1 << 20) * (int(os.environ['ATTACH_SIZE']) >> 20)).replace(b'\n', b'\r\n')) + b'--f--\r\n')
+MSGS.update({'attach_' + k: v for k, v in ATTACH.items()})
+
+def unfold(v):
+    return re.sub(rb'\r\n[ \t]', b' ', v)
+
+def header_value(head, name):
+    m = re.search(rb'(?im)^' + name + rb':([^\r\n]*(?:\r\n[ \t][^\r\n]*)*)', head)
+    return unfold(m.group(1)).strip() if m else None
+
+def mime_params(v):
+    params = []
+    for m in re.finditer(rb';\s*([^=;\s]+)\s*=\s*("[^"]*"|[^;]*)', v):
+        params.append((m.group(1).decode(), m.group(2).strip().strip(b'"').decode('latin-1')))
+    return params
+
+def mime_tree(raw, depth=0):
+    """Part tree as a server sees it, the body of a part excludes the CRLF before the next delimiter."""
+    if b'\r\n\r\n' in raw:
+        head, body = raw.split(b'\r\n\r\n', 1)
+    elif raw.startswith(b'\r\n'):
+        head, body = b'', raw[2:]
+    else:
+        head, body = raw, b''
+    ct = header_value(head, b'Content-Type') or b'text/plain; charset=us-ascii'
+    mt = ct.split(b';', 1)[0].strip().lower().decode('latin-1')
+    params = mime_params(ct)
+    if '/' not in mt:
+        mt = 'text/plain'
+    node = {'type': mt.split('/')[0], 'subtype': mt.split('/')[1], 'params': params,
+            'encoding': (header_value(head, b'Content-Transfer-Encoding') or b'7bit').decode('latin-1'),
+            'disposition': header_value(head, b'Content-Disposition'), 'body': body, 'children': []}
+    b = dict((k.lower(), v) for k, v in params).get('boundary')
+    if node['type'] == 'multipart' and b and depth < 20:
+        delim = re.compile(rb'(?m)^--' + re.escape(b.encode('latin-1')) + rb'(--)?[ \t]*\r?(?:\n|$)')
+        marks = list(delim.finditer(body))
+        for a, z in zip(marks, marks[1:] + [None]):
+            if a.group(1):
+                break
+            start = a.end()
+            end = z.start() - 2 if z else len(body)
+            node['children'].append(mime_tree(body[start:max(start, end)], depth + 1))
+    return node
+
+def quote(v):
+    if v is None:
+        return 'NIL'
+    return '"' + v.replace('\\', '\\\\').replace('"', '\\"') + '"'
+
+def bodystructure(node):
+    if node['type'] == 'multipart' and node['children']:
+        return '(' + ''.join(bodystructure(c) for c in node['children']) + ' ' + quote(node['subtype'].upper()) + ')'
+    params = node['params'] if node['type'] != 'text' or any(k.lower() == 'charset' for k, _ in node['params']) else node['params'] + [('CHARSET', 'us-ascii')]
+    plist = '(' + ' '.join(quote(k.upper()) + ' ' + quote(v) for k, v in params) + ')' if params else 'NIL'
+    out = '(%s %s %s NIL NIL %s %d' % (quote(node['type'].upper()), quote(node['subtype'].upper()), plist, quote(node['encoding'].upper()), len(node['body']))
+    if node['type'] == 'text':
+        out += ' %d' % node['body'].count(b'\n')
+    disp = 'NIL'
+    if node['disposition']:
+        d = node['disposition']
+        dp = mime_params(d)
+        disp = '(%s %s)' % (quote(d.split(b';', 1)[0].strip().decode('latin-1').upper()),
+            '(' + ' '.join(quote(k.upper()) + ' ' + quote(v) for k, v in dp) + ')' if dp else 'NIL')
+    return out + ' NIL ' + disp + ' NIL NIL)'
+
+def mime_section(node, sec):
+    for n in sec.split('.'):
+        if node['type'] == 'multipart' and node['children']:
+            i = int(n) - 1
+            if i >= len(node['children']):
+                return b''
+            node = node['children'][i]
+        elif n != '1':
+            return b''
+    return node['body']
+
+ENC = [
+    b'Subject: =?UTF-8?B?aMOpbGxvIHfDtnJsZCDigqw=?=',
+    b'Subject: =?ISO-8859-1?Q?caf=E9_cr=E8me?= and more',
+    b'Subject: =?windows-1252?Q?=80uro_=93quoted=94?=',
+    b'Subject: =?UTF-16?B?/v8AaABpACDYPd4A?=',
+    b'Subject: =?utf-8?q?one?= =?utf-8?q?_two?=\r\n =?utf-8?q?_three?= plain =?utf-8?q?four?=',
+    b'Subject: =?x-unknown?Q?raw?= =?UTF-8?B?!!!?= =?UTF-8?X?bad?= =?utf-8?b?YQ?=',
+    b'Subject: folded\r\n =?UTF-8*en?Q?=C3=BC?=end',
+    b'Subject: plain subject',
+]
+for i, h in enumerate(ENC):
+    MSGS['enc%d' % i] = mk([b'From: =?UTF-8?Q?J=C3=B6rg?= <j@comp30023>', b'To: t@comp30023', b'Date: Thu, 29 Feb 2024 23:24:25 +1100', h])
+
+FOLDERS = {
+    'Encoded': ['enc%d' % i for i in range(len(ENC))],
+    'Mime': ['mime_' + k for k in MIMES],
+    'Attach': ['attach_' + k for k in ATTACH],
+    'Large': LARGE,
+    'Many': MANY,
+    'Huge': HUGE,
+    'Big': ['big'],
+    'INBOX': ['ed512'],
+    'Test': ['ed512', 'mst', 'minimal'],
+    'Parse': ['caps', 'minimal', 'nested', 'nosubj', 'ws', 'msttab', 'nul', 'mst', 'fromq'],
+    'Empty': [],
+    'With Space': ['mst'],
+}
+
+STATE = {}
+UID_BASE = 100
+UID_VALIDITY = 4242
+LOCK = threading.Lock()
+
+def folder_state(name):
+    # Mailbox state shared by every session so changes show up on the next SELECT
+    if name not in STATE:
+        keys = list(FOLDERS[name])
+        STATE[name] = {'keys': keys, 'uids': [UID_BASE + i * 3 for i in range(len(keys))],
+                       'uidnext': UID_BASE + 3 * len(keys) if keys else UID_BASE, 'modseq': 1000, 'vanished': []}
+    return STATE[name]
+
+class Session:
+    def __init__(self, conn, args):
+        self.conn, self.args = conn, args
+        self.rbuf = b''
+        self.folder = None
+        self.msgs = []
+        self.uids = []
+        self.enabled = False
+        self.outq = []
+        self.cv = threading.Condition()
+        if args.latency:
+            threading.Thread(target=self.writer, daemon=True).start()
+
+    def send(self, data):
+        if self.args.latency:
+            # Deliver after a simulated round trip without blocking later commands
+            self.outq.append((time.time() + self.args.latency, data))
+            with self.cv:
+                self.cv.notify()
+            return
+        self.raw_send(data)
+
+    def writer(self):
+        while True:
+            with self.cv:
+                while not self.outq:
+                    self.cv.wait()
+                due, data = self.outq.pop(0)
+            d = due - time.time()
+            if d > 0:
+                time.sleep(d)
+            try:
+                self.raw_send(data)
+            except OSError:
+                return
+
+    def raw_send(self, data):
+        if callable(data):
+            data()
+            return
+        if self.args.drop_after:
+            # Cut the connection once this many bytes went out, mid literal if need be
+            sent = getattr(self, 'sent', 0)
+            left = self.args.drop_after - sent
+            self.sent = sent + len(data)
+            if left <= 0 or len(data) > left:
+                if left > 0:
+                    self.conn.sendall(data[:left])
+                import socket
+                self.conn.shutdown(socket.SHUT_RDWR)
+                raise OSError('dropped')
+        if getattr(self, 'z_out', None):
+            data = self.z_out.compress(data) + self.z_out.flush(zlib.Z_SYNC_FLUSH)
+        if self.args.rate:
+            # Throttle each connection to a fixed number of bytes per second
+            for i in range(0, len(data), 16384):
+                piece = data[i:i + 16384]
+                self.conn.sendall(piece)
+                time.sleep(len(piece) / self.args.rate)
+            return
+        if self.args.chunk:
+            i = 0
+            while i < len(data):
+                n = random.randint(1, self.args.chunk)
+                self.conn.sendall(data[i:i + n])
+                i += n
+                time.sleep(0.0005)
+        else:
+            self.conn.sendall(data)
+
+    def readline(self):
+        while b'\r\n' not in self.rbuf:
+            d = self.conn.recv(65536)
+            if not d:
+                return None
+            if getattr(self, 'z_in', None):
+                d = self.z_in.decompress(d)
+            self.rbuf += d
+        line, self.rbuf = self.rbuf.split(b'\r\n', 1)
+
+        # A synchronizing literal is asked for, then the command goes on after it
+        m = re.search(rb'\{(\d+)\}$', line)
+        if m:
+            self.raw_send(b'+ ready for literal\r\n')
+            size = int(m.group(1))
+            while len(self.rbuf) < size:
+                d = self.conn.recv(65536)
+                if not d:
+                    return None
+                if getattr(self, 'z_in', None):
+                    d = self.z_in.decompress(d)
+                self.rbuf += d
+            literal, self.rbuf = self.rbuf[:size], self.rbuf[size:]
+            rest = self.readline()
+            return None if rest is None else (line + b'\r\n' + literal).decode('latin-1') + rest
+        return line.decode('latin-1')
+
+    def run(self):
+        caps = 'IMAP4rev1 ' + ' '.join(self.args.caps)
+        self.send(('* OK [CAPABILITY %s] stand-in ready\r\n' % caps).encode())
+        while True:
+            line = self.readline()
+            if line is None:
+                return
+            if self.args.log:
+                sys.stderr.write('%.3f C: %s\n' % (time.time(), line))
+            m = re.match(r'(\S+) (\S+)(?: (.*))?$', line, re.S)
+            if not m:
+                self.send(b'* BAD parse\r\n')
+                continue
+            tag, cmd, rest = m.group(1), m.group(2).upper(), m.group(3) or ''
+            if self.args.delay:
+                time.sleep(self.args.delay)
+            h = getattr(self, 'cmd_' + cmd, None)
+            if cmd == 'UID':
+                sub, _, rest2 = rest.partition(' ')
+                h = getattr(self, 'cmd_' + sub.upper(), None)
+                if h:
+                    h(tag, rest2, uid=True)
+                    continue
+            if h is None:
+                self.send(('%s BAD unknown\r\n' % tag).encode())
+            else:
+                h(tag, rest)
+            if cmd == 'LOGOUT':
+                return
+
+    def cmd_CAPABILITY(self, tag, rest):
+        self.send(('* CAPABILITY IMAP4rev1 %s\r\n%s OK done\r\n' % (' '.join(self.args.caps), tag)).encode())
+
+    def cmd_ENABLE(self, tag, rest):
+        if 'QRESYNC' in rest.upper() and 'QRESYNC' in self.args.caps:
+            self.enabled = True
+            self.send(('* ENABLED QRESYNC\r\n%s OK enabled\r\n' % tag).encode())
+        else:
+            self.send(('%s OK nothing\r\n' % tag).encode())
+
+    def cmd_SEARCH(self, tag, rest, uid=False):
+        import email.utils
+        if self.args.log:
+            sys.stderr.write('SEARCH %s\n' % rest)
+        import email.header
+        toks = []
+        try:
+            # Quoted strings are 7-bit, anything else has to come as a literal
+            pos = 0
+            while pos < len(rest):
+                m = re.compile(r' *(?:\{(\d+)\}\r\n|"((?:[^"\\]|\\.)*)"|(\S+))').match(rest, pos)
+                if not m:
+                    break
+                pos = m.end()
+                if m.group(1):
+                    toks.append(rest[pos:pos + int(m.group(1))])
+                    pos += int(m.group(1))
+                elif m.group(2) is not None:
+                    if any(ord(c) > 127 for c in m.group(2)):
+                        raise ValueError('8-bit quoted string')
+                    toks.append(re.sub(r'\\(.)', r'\1', m.group(2)))
+                else:
+                    toks.append(m.group(3))
+        except ValueError:
+            toks = []
+        if not self.folder or not toks:
+            self.send(('%s BAD search\r\n' % tag).encode())
+            return
+        utf8 = len(toks) > 1 and toks[0].upper() == 'CHARSET' and toks[1].upper() == 'UTF-8'
+        def field(msg, name):
+            hdr = msg.split(b'\r\n\r\n', 1)[0].decode('latin-1')
+            m = re.search(r'(?im)^' + name + r':[ \t]*(.*(?:\r\n[ \t].*)*)', hdr)
+            if not m:
+                return ''
+            try:
+                return str(email.header.make_header(email.header.decode_header(m.group(1))))
+            except Exception:
+                return m.group(1)
+        keep = list(range(len(self.msgs)))
+        i = 0
+        months = ['Jan','Feb','Mar','Apr','May','Jun','Jul','Aug','Sep','Oct','Nov','Dec']
+        try:
+            while i < len(toks):
+                t = toks[i].upper(); i += 1
+                if t == 'CHARSET':
+                    i += 1
+                elif t == 'ALL':
+                    pass
+                elif t == 'UNSEEN':
+                    keep = [k for k in keep if self.uids[k] % 2 == 0]
+                elif t == 'LARGER':
+                    n = int(toks[i]); i += 1
+                    keep = [k for k in keep if len(self.msgs[k]) > n]
+                elif t in ('FROM', 'SUBJECT'):
+                    v = toks[i].encode('latin-1').decode('utf-8') if utf8 else toks[i]; i += 1
+                    v = v.lower()
+                    keep = [k for k in keep if v in field(self.msgs[k], t).lower()]
+                elif t == 'SINCE':
+                    d, mo, y = toks[i].split('-'); i += 1
+                    since = (int(y), months.index(mo.capitalize()) + 1, int(d))
+                    def after(k):
+                        dt = email.utils.parsedate(field(self.msgs[k], 'Date'))
+                        return dt is not None and dt[:3] >= since
+                    keep = [k for k in keep if after(k)]
+                else:
+                    raise ValueError(t)
+        except (ValueError, IndexError):
+            self.send(('%s BAD search\r\n' % tag).encode())
+            return
+        nums = [self.uids[k] if uid else k + 1 for k in keep]
+        self.send(('* SEARCH%s\r\n%s OK search\r\n' % (''.join(' %d' % n for n in nums), tag)).encode())
+
+    def cmd_XAPPEND(self, tag, rest):
+        # Test only: add copies of existing messages to a folder
+        name, _, key = rest.partition(' ')
+        with LOCK:
+            st = folder_state(name)
+            for k in key.split(','):
+                st['keys'].append(k)
+                st['uids'].append(st['uidnext'])
+                st['uidnext'] += 1
+                st['modseq'] += 1
+        self.send(('%s OK appended\r\n' % tag).encode())
+
+    def cmd_XEXPUNGE(self, tag, rest):
+        # Test only: remove messages from a folder by UID
+        name, _, uids = rest.partition(' ')
+        with LOCK:
+            st = folder_state(name)
+            for u in map(int, uids.split(',')):
+                i = st['uids'].index(u)
+                del st['uids'][i], st['keys'][i]
+                st['modseq'] += 1
+                st['vanished'].append((u, st['modseq']))
+        self.send(('%s OK expunged\r\n' % tag).encode())
+
+    def cmd_IDLE(self, tag, rest):
+        import select
+        self.send(b'+ idling\r\n')
+        while True:
+            with LOCK:
+                st = folder_state(self.folder)
+                uids = list(st['uids']); keys = list(st['keys'])
+            for i in range(len(self.uids) - 1, -1, -1):
+                if self.uids[i] not in uids:
+                    del self.uids[i], self.msgs[i]
+                    self.send(('* %d EXPUNGE\r\n' % (i + 1)).encode())
+            if len(uids) > len(self.uids):
+                self.uids = uids
+                self.msgs = [MSGS[k] for k in keys]
+                self.send(('* %d EXISTS\r\n' % len(self.msgs)).encode())
+            if b'\r\n' in self.rbuf or (hasattr(self.conn, 'pending') and self.conn.pending()) or select.select([self.conn], [], [], 0.05)[0]:
+                line = self.readline()
+                if line is None:
+                    return
+                if line.upper() == 'DONE':
+                    self.send(('%s OK idle done\r\n' % tag).encode())
+                else:
+                    self.send(('%s BAD expected DONE\r\n' % tag).encode())
+                return
+
+    def cmd_COMPRESS(self, tag, rest):
+        if 'COMPRESS=DEFLATE' not in self.args.caps or rest.upper() != 'DEFLATE' or getattr(self, 'z_in', None):
+            self.send(('%s NO [COMPRESSIONACTIVE] no\r\n' % tag).encode())
+            return
+        self.send(('%s OK deflate active\r\n' % tag).encode())
+        def start():
+            self.z_out = zlib.compressobj(6, zlib.DEFLATED, -15)
+        self.send(start)
+        self.z_in = zlib.decompressobj(-15)
+
+    def cmd_NOOP(self, tag, rest):
+        self.send(('%s OK noop\r\n' % tag).encode())
+
+    def cmd_LOGOUT(self, tag, rest):
+        self.send(('* BYE\r\n%s OK bye\r\n' % tag).encode())
+
+    def cmd_LOGIN(self, tag, rest):
+        if rest.split(' ')[:2] == ['test', 'pass']:
+            self.send(('%s OK [CAPABILITY IMAP4rev1 %s] logged in\r\n' % (tag, ' '.join(self.args.caps))).encode())
+        else:
+            self.send(('%s NO [AUTHENTICATIONFAILED] bad\r\n' % tag).encode())
+
+    def cmd_SELECT(self, tag, rest):
+        m = re.match(r'"((?:[^"\\]|\\.)*)"|(\S+)', rest)
+        name = m.group(1) if m.group(1) is not None else m.group(2)
+        name = re.sub(r'\\(.)', r'\1', name) if m.group(1) is not None else name
+        if name not in FOLDERS:
+            self.send(('%s NO no such folder\r\n' % tag).encode())
+            return
+        self.folder = name
+        with LOCK:
+            st = folder_state(name)
+            self.msgs = [MSGS[k] for k in st['keys']]
+            self.uids = list(st['uids'])
+        out = '* FLAGS (\\Seen)\r\n* %d EXISTS\r\n* 0 RECENT\r\n* OK [UIDVALIDITY %d] v\r\n* OK [UIDNEXT %d] n\r\n' % (
+            len(self.msgs), UID_VALIDITY, st['uidnext'])
+        opts = rest[m.end():].upper()
+        if 'CONDSTORE' in opts or 'QRESYNC' in opts:
+            out += '* OK [HIGHESTMODSEQ %d] m\r\n' % st['modseq']
+        q = re.search(r'QRESYNC \((\d+) (\d+)', opts)
+        if q and self.enabled and int(q.group(1)) == UID_VALIDITY:
+            gone = [u for u, ms in st['vanished'] if ms > int(q.group(2))]
+            if gone:
+                out += '* VANISHED (EARLIER) %s\r\n' % ','.join(map(str, gone))
+        out += '%s OK [READ-WRITE] selected\r\n' % tag
+        self.send(out.encode())
+    cmd_EXAMINE = cmd_SELECT
+
+    def seqset(self, s, n):
+        res = []
+        for part in s.split(','):
+            a, _, b = part.partition(':')
+            a = n if a == '*' else int(a)
+            b = a if not b else (n if b == '*' else int(b))
+            if a > b:
+                a, b = b, a
+            res.extend(range(a, b + 1))
+        return res
+
+    def header_fields(self, msg, names, negate=False):
+        head = msg.split(b'\r\n\r\n', 1)[0] + b'\r\n'
+        lines = re.findall(rb'[^\r\n]*\r\n(?:[ \t][^\r\n]*\r\n)*', head)
+        out = b''
+        for l in lines:
+            name = l.split(b':', 1)[0].strip().upper().decode('latin-1')
+            if (name in names) != negate:
+                out += l
+        return out + b'\r\n'
+
+    def cmd_FETCH(self, tag, rest, uid=False):
+        m = re.match(r'(\S+) \(?(.*?)\)?$', rest)
+        if not self.folder or not m:
+            self.send(('%s BAD fetch\r\n' % tag).encode())
+            return
+        spec, items = m.group(1), m.group(2)
+        if uid:
+            maxuid = self.uids[-1] if self.uids else 0
+            want = set(self.seqset(spec, maxuid))
+            seqs = [i + 1 for i, u in enumerate(self.uids) if u in want]
+        else:
+            try:
+                seqs = self.seqset(spec, len(self.msgs))
+            except ValueError:
+                self.send(('%s BAD seq\r\n' % tag).encode())
+                return
+            if any(s < 1 or s > len(self.msgs) for s in seqs):
+                self.send(('%s BAD Invalid messageset\r\n' % tag).encode())
+                return
+        toks = re.findall(r'BODY(?:\.PEEK)?\[[^\]]*\](?:<[\d.]+>)?|\S+', items)
+        out = []
+        for s in seqs:
+            msg = self.msgs[s - 1]
+            parts = []
+            if uid:
+                parts.append(b'UID %d' % self.uids[s - 1])
+            for t in toks:
+                T = t.upper()
+                if T == 'UID':
+                    if not uid:
+                        parts.append(b'UID %d' % self.uids[s - 1])
+                elif T == 'RFC822.SIZE':
+                    parts.append(b'RFC822.SIZE %d' % len(msg))
+                elif T == 'BODYSTRUCTURE':
+                    if not self.args.no_structure:
+                        parts.append(b'BODYSTRUCTURE ' + bodystructure(mime_tree(msg)).encode('latin-1'))
+                elif T == 'FLAGS':
+                    parts.append(b'FLAGS ()')
+                elif T.startswith('BODY'):
+                    mm = re.match(r'BODY(?:\.PEEK)?\[([^\]]*)\](?:<(\d+)\.(\d+)>)?', T)
+                    sec = mm.group(1)
+                    if sec == '':
+                        data = msg
+                    elif sec.startswith('HEADER.FIELDS'):
+                        neg = sec.startswith('HEADER.FIELDS.NOT')
+                        names = re.search(r'\((.*)\)', sec).group(1).split()
+                        data = self.header_fields(msg, names, neg)
+                    elif sec == 'HEADER':
+                        data = msg.split(b'\r\n\r\n', 1)[0] + b'\r\n\r\n'
+                    elif sec == 'TEXT':
+                        data = msg.split(b'\r\n\r\n', 1)[1]
+                    elif re.match(r'^[\d.]+$', sec):
+                        data = mime_section(mime_tree(msg), sec)
+                    else:
+                        data = b''
+                    name = re.sub(r'<.*', '', t.replace('.PEEK', '').replace('.peek', ''))
+                    if mm.group(2):
+                        o, l = int(mm.group(2)), int(mm.group(3))
+                        data = data[o:o + l]
+                        name += '<%s>' % mm.group(2)
+                    parts.append(name.encode() + b' {%d}\r\n' % len(data) + data)
+            out.append(b'* %d FETCH (' % s + b' '.join(parts) + b')\r\n')
+        out.append(('%s OK fetch done\r\n' % tag).encode())
+        self.send(b''.join(out))
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument('--port', type=int, default=1143)
+    ap.add_argument('--chunk', type=int, default=0)
+    ap.add_argument('--delay', type=float, default=0)
+    ap.add_argument('--latency', type=float, default=0)
+    ap.add_argument('--rate', type=float, default=0)
+    ap.add_argument('--log', action='store_true')
+    ap.add_argument('--drop-after', type=int, default=0)
+    ap.add_argument('--no-structure', action='store_true')
+    ap.add_argument('--caps', nargs='*', default=[])
+    ap.add_argument('--tls', nargs=2, metavar=('CERT', 'KEY'))
+    ap.add_argument('--tls-max', default='')
+    ap.add_argument('--uid-base', type=int, default=100)
+    ap.add_argument('--uid-validity', type=int, default=4242)
+    args = ap.parse_args()
+    global UID_BASE, UID_VALIDITY
+    UID_BASE = args.uid_base
+    UID_VALIDITY = args.uid_validity
+    ctx = None
+    if args.tls:
+        import ssl
+        ctx = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+        ctx.load_cert_chain(*args.tls)
+        if args.tls_max == '1.2':
+            ctx.maximum_version = ssl.TLSVersion.TLSv1_2
+    s = socket.socket(socket.AF_INET6)
+    s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    s.setsockopt(socket.IPPROTO_IPV6, socket.IPV6_V6ONLY, 0)
+    s.bind(('::', args.port))
+    s.listen(64)
+    while True:
+        c, _ = s.accept()
+        c.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        def go(c=c):
+            try:
+                if ctx:
+                    c = ctx.wrap_socket(c, server_side=True)
+                    if args.log:
+                        sys.stderr.write('%.3f TLS %s %s\n' % (time.time(), c.version(), 'resumed' if c.session_reused else 'full'))
+                Session(c, args).run()
+            except (BrokenPipeError, ConnectionResetError, OSError):
+                pass
+            finally:
+                c.close()
+        threading.Thread(target=go, daemon=True).start()
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,7 @@
+#!/bin/bash
+# Makes a self-signed certificate for localhost for the stand-in server, in the given directory
+set -e
+dir=${1:-.}
+openssl req -x509 -newkey rsa:2048 -nodes -days 30 -subj /CN=localhost \
+    -addext "subjectAltName=DNS:localhost,IP:127.0.0.1,IP:::1" \
+    -keyout "$dir/key.pem" -out "$dir/cert.pem" 2>/dev/null